@@ -0,0 +1,801 @@
+// Server.cpp
+// The /serve daemon, see Server.h.
+
+#include "Server.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h> // socket, accept, recv, send
+#include <afunix.h> // sockaddr_un, Windows 10 1803 and later
+typedef SOCKET SocketHandle;
+#else
+#include <errno.h>
+#include <signal.h> // signal
+#include <unistd.h> // close
+#include <sys/socket.h> // socket, accept, recv, send
+#include <sys/stat.h> // lstat
+#include <sys/un.h> // sockaddr_un
+typedef int SocketHandle;
+const SocketHandle INVALID_SOCKET = -1;
+#endif
+
+// External libraries:
+#include <json/json.h>
+
+#include "MetaData.h"
+#include "ChunkCache.h"
+#include "XZReader.h"
+
+const size_t MAXIMUM_REQUEST_SIZE = 64 * 1024; // Requests are only ever paths and numbers.
+const size_t SERVER_CACHE_SIZE = 256 * 1024 * 1024;
+const size_t MAXIMUM_OPEN_READERS = 64;
+const size_t DECOMPRESS_READ_SIZE = 4 * 1024 * 1024; // How much of the file a decompress job reads at once.
+
+void closeSocket(SocketHandle socketHandle)
+{
+#ifdef _WIN32
+	closesocket(socketHandle);
+#else
+	close(socketHandle);
+#endif
+}
+
+// Sends all of data, as many send()s as it takes.
+bool sendAll(SocketHandle socketHandle, const unsigned char* data, size_t length)
+{
+	while (length > 0)
+	{
+		const int sent = (int)send(socketHandle, (const char*)data, (int)std::min(length, (size_t)(1 << 30)), 0);
+		if (sent <= 0)
+		{
+#ifndef _WIN32
+			if ((sent < 0) && (errno == EINTR))
+			{
+				continue;
+			}
+#endif
+			return false;
+		}
+		data += sent;
+		length -= sent;
+	}
+	return true;
+}
+
+// Fills buffer, false if the client goes before it's full.
+bool receiveAll(SocketHandle socketHandle, unsigned char* buffer, size_t length)
+{
+	while (length > 0)
+	{
+		const int received = (int)recv(socketHandle, (char*)buffer, (int)std::min(length, (size_t)(1 << 30)), 0);
+		if (received <= 0)
+		{
+#ifndef _WIN32
+			if ((received < 0) && (errno == EINTR))
+			{
+				continue;
+			}
+#endif
+			return false;
+		}
+		buffer += received;
+		length -= received;
+	}
+	return true;
+}
+
+uint64_t readLittleEndian(const unsigned char* bytes, unsigned int count)
+{
+	uint64_t value = 0;
+	for (unsigned int b = count; b > 0; --b)
+	{
+		value = (value << 8) | bytes[b - 1];
+	}
+	return value;
+}
+
+void writeLittleEndian(unsigned char* bytes, uint64_t value, unsigned int count)
+{
+	for (unsigned int b = 0; b < count; ++b)
+	{
+		bytes[b] = (unsigned char)(value >> (b * 8));
+	}
+}
+
+bool sendResponse(SocketHandle socketHandle, bool success, const unsigned char* data, size_t length)
+{
+	unsigned char header[5];
+	writeLittleEndian(header, length + 1, 4);
+	header[4] = success ? 0 : 1;
+	return sendAll(socketHandle, header, sizeof(header)) && sendAll(socketHandle, data, length);
+}
+
+bool sendResponse(SocketHandle socketHandle, bool success, const std::string& text)
+{
+	return sendResponse(socketHandle, success, (const unsigned char*)text.data(), text.size());
+}
+
+// Only a socket is ever removed to listen in its place, never a file given by mistake.
+bool isSocketFile(const char* path)
+{
+#ifdef _WIN32
+	const DWORD attributes = GetFileAttributesA(path);
+	return (attributes != INVALID_FILE_ATTRIBUTES) && (attributes & FILE_ATTRIBUTE_REPARSE_POINT);
+#else
+	struct stat fileStatus;
+	return (lstat(path, &fileStatus) == 0) && S_ISSOCK(fileStatus.st_mode);
+#endif
+}
+
+struct ServerJob
+{
+	int type; // ServerJobType
+	std::string inputFilePath; // Compress.
+	std::string fileKey; // Decompress and read range.
+	std::string compressedFilePath; // Compress writes it, decompress and read range read it.
+	std::string outputFilePath; // Decompress.
+	std::string metaDataFilePath;
+	uint64_t offset; // Read range.
+	uint64_t length;
+};
+
+struct RequestReader
+{
+	const unsigned char* data;
+	size_t size;
+	size_t position;
+};
+
+bool readRequestNumber(RequestReader& reader, unsigned int bytes, uint64_t& value)
+{
+	if (reader.size - reader.position < bytes)
+	{
+		return false;
+	}
+	value = readLittleEndian(reader.data + reader.position, bytes);
+	reader.position += bytes;
+	return true;
+}
+
+// Strings are all paths and keys, so they can't be empty or have a nul in them.
+bool readRequestString(RequestReader& reader, std::string& value)
+{
+	uint64_t length = 0;
+	if (!readRequestNumber(reader, 4, length) || (length == 0) || (reader.size - reader.position < length))
+	{
+		return false;
+	}
+	value.assign((const char*)reader.data + reader.position, (size_t)length);
+	reader.position += (size_t)length;
+	return value.find('\0') == std::string::npos;
+}
+
+bool parseRequest(const std::vector<unsigned char>& request, ServerJob& job)
+{
+	RequestReader reader = { request.data(), request.size(), 1 };
+	job.type = request[0];
+	bool success = false;
+	switch (job.type)
+	{
+	case SERVER_JOB_COMPRESS:
+		success = readRequestString(reader, job.inputFilePath) && readRequestString(reader, job.compressedFilePath) && readRequestString(reader, job.metaDataFilePath);
+		break;
+	case SERVER_JOB_DECOMPRESS:
+		success = readRequestString(reader, job.fileKey) && readRequestString(reader, job.compressedFilePath) && readRequestString(reader, job.outputFilePath) && readRequestString(reader, job.metaDataFilePath);
+		break;
+	case SERVER_JOB_READ_RANGE:
+		success = readRequestString(reader, job.fileKey) && readRequestString(reader, job.compressedFilePath) && readRequestString(reader, job.metaDataFilePath) &&
+			readRequestNumber(reader, 8, job.offset) && readRequestNumber(reader, 8, job.length);
+		break;
+	case SERVER_JOB_STATISTICS:
+		success = true;
+		break;
+	}
+	return success && (reader.position == reader.size);
+}
+
+struct ServerClient
+{
+	SocketHandle socketHandle;
+	std::deque<ServerJob> jobs; // Waiting for a worker, oldest first.
+	bool running; // A worker has one of its jobs.
+	std::condition_variable changed; // A job was taken or finished.
+};
+
+// A meta data file the jobs have named, as it was last read or written. root is replaced rather than
+// changed, so a job can keep using the one it started with.
+struct ServedMetaDataFile
+{
+	std::mutex mutex; // Held while root is read, replaced or written out.
+	std::shared_ptr<const Json::Value> root;
+};
+
+struct OpenReader
+{
+	std::shared_ptr<const Json::Value> root; // The meta data it was opened with.
+	std::shared_ptr<XZReader> reader;
+	uint64_t lastUsed;
+};
+
+struct JobStatistics
+{
+	uint64_t done;
+	uint64_t failed;
+	double seconds;
+};
+
+class Server
+{
+public:
+	Server(const CompressorOptions& options);
+
+	bool startListening(const char* socketPath);
+
+	// Starts the workers and takes clients, for good.
+	void serveClients();
+
+private:
+	void serveClient(std::shared_ptr<ServerClient> client);
+	void waitForJobs(ServerClient& client);
+	void runWorker();
+	bool runJob(Compressor& compressor, const ServerJob& job, std::vector<unsigned char>& buffer, size_t& responseLength);
+	bool runCompressJob(Compressor& compressor, const ServerJob& job);
+	bool runDecompressJob(const ServerJob& job, std::vector<unsigned char>& buffer);
+	bool runReadRangeJob(const ServerJob& job, std::vector<unsigned char>& buffer, size_t& bytesRead);
+	std::string getStatistics();
+
+	std::shared_ptr<ServedMetaDataFile> getMetaDataFile(const std::string& metaDataFilePath);
+	bool loadMetaDataFile(ServedMetaDataFile& metaDataFile, const std::string& metaDataFilePath);
+	std::shared_ptr<XZReader> getReader(const ServerJob& job);
+
+	CompressorOptions options;
+	SocketHandle listeningSocket;
+	ChunkCache cache;
+	std::chrono::steady_clock::time_point startTime;
+
+	std::mutex scheduleMutex; // Guards every client's queue and the counters below.
+	std::condition_variable jobWaiting;
+	std::deque<std::shared_ptr<ServerClient> > readyClients; // Clients with a job waiting and none running, in turn.
+	unsigned int clientCount;
+	unsigned int jobsWaiting;
+	unsigned int jobsRunning;
+	JobStatistics jobStatistics[SERVER_JOB_TYPES];
+	uint64_t bytesRead;
+
+	std::mutex metaDataFilesMutex;
+	std::unordered_map<std::string, std::shared_ptr<ServedMetaDataFile> > metaDataFiles;
+
+	std::mutex readersMutex;
+	std::unordered_map<std::string, OpenReader> readers; // By meta data file, file key and compressed file.
+	uint64_t readerUses;
+};
+
+Server::Server(const CompressorOptions& options)
+	: options(options), listeningSocket(INVALID_SOCKET), cache(SERVER_CACHE_SIZE), startTime(std::chrono::steady_clock::now()),
+	clientCount(0), jobsWaiting(0), jobsRunning(0), jobStatistics(), bytesRead(0), readerUses(0)
+{
+	if (this->options.threads == 0)
+	{
+		this->options.threads = 1;
+	}
+}
+
+bool Server::startListening(const char* socketPath)
+{
+#ifdef _WIN32
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+	{
+		printf("Unable to start Winsock.\n");
+		return false;
+	}
+#else
+	// A client that's gone shouldn't take the server with it when its response is sent:
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(address.sun_path))
+	{
+		printf("%s is too long to be a socket's path.\n", socketPath);
+		return false;
+	}
+	memcpy(address.sun_path, socketPath, strlen(socketPath));
+
+	// A socket left by a server that's stopped is replaced, one that's still being served isn't:
+	if (isSocketFile(socketPath))
+	{
+		const SocketHandle probeSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+		const bool served = (probeSocket != INVALID_SOCKET) && (connect(probeSocket, (const sockaddr*)&address, sizeof(address)) == 0);
+		if (probeSocket != INVALID_SOCKET)
+		{
+			closeSocket(probeSocket);
+		}
+		if (served)
+		{
+			printf("%s is already being served.\n", socketPath);
+			return false;
+		}
+		remove(socketPath);
+	}
+
+	listeningSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listeningSocket == INVALID_SOCKET)
+	{
+		printf("Unable to create a socket.\n");
+		return false;
+	}
+
+	if ((bind(listeningSocket, (const sockaddr*)&address, sizeof(address)) != 0) || (listen(listeningSocket, SOMAXCONN) != 0))
+	{
+		printf("Unable to listen on %s.\n", socketPath);
+		closeSocket(listeningSocket);
+		listeningSocket = INVALID_SOCKET;
+		return false;
+	}
+
+	return true;
+}
+
+void Server::serveClients()
+{
+	for (unsigned int w = 0; w < options.threads; ++w)
+	{
+		std::thread(&Server::runWorker, this).detach();
+	}
+
+	for (;;)
+	{
+		const SocketHandle clientSocket = accept(listeningSocket, nullptr, nullptr);
+		if (clientSocket == INVALID_SOCKET)
+		{
+			// Out of sockets or interrupted, try again in a moment:
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			continue;
+		}
+
+		std::shared_ptr<ServerClient> client = std::make_shared<ServerClient>();
+		client->socketHandle = clientSocket;
+		client->running = false;
+		{
+			std::lock_guard<std::mutex> lock(scheduleMutex);
+			++clientCount;
+		}
+		std::thread(&Server::serveClient, this, client).detach();
+	}
+}
+
+// Reads the client's requests and queues its jobs, until it goes. Statistics and requests that can't be
+// parsed are answered here, once the jobs before them have been.
+void Server::serveClient(std::shared_ptr<ServerClient> client)
+{
+	std::vector<unsigned char> request;
+	for (;;)
+	{
+		unsigned char lengthBytes[4];
+		if (!receiveAll(client->socketHandle, lengthBytes, sizeof(lengthBytes)))
+		{
+			break;
+		}
+
+		const uint64_t length = readLittleEndian(lengthBytes, sizeof(lengthBytes));
+		if ((length == 0) || (length > MAXIMUM_REQUEST_SIZE))
+		{
+			// There's no finding the next request after this, so that's the last of the client:
+			waitForJobs(*client);
+			sendResponse(client->socketHandle, false, "Requests can't be empty or over 64KB.");
+			break;
+		}
+
+		request.resize((size_t)length);
+		if (!receiveAll(client->socketHandle, request.data(), request.size()))
+		{
+			break;
+		}
+
+		ServerJob job = {};
+		if (!parseRequest(request, job))
+		{
+			waitForJobs(*client);
+			sendResponse(client->socketHandle, false, "The request isn't a job the server knows.");
+			continue;
+		}
+
+		if (job.type == SERVER_JOB_STATISTICS)
+		{
+			waitForJobs(*client);
+			sendResponse(client->socketHandle, true, getStatistics());
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(scheduleMutex);
+		client->changed.wait(lock, [&client]() { return client->jobs.size() < MAXIMUM_QUEUED_JOBS; });
+		client->jobs.push_back(std::move(job));
+		++jobsWaiting;
+		if (!client->running && (client->jobs.size() == 1))
+		{
+			readyClients.push_back(client);
+			jobWaiting.notify_one();
+		}
+	}
+
+	// Whatever it had queued is still done, the client may only have stopped sending:
+	waitForJobs(*client);
+	closeSocket(client->socketHandle);
+
+	std::lock_guard<std::mutex> lock(scheduleMutex);
+	--clientCount;
+}
+
+void Server::waitForJobs(ServerClient& client)
+{
+	std::unique_lock<std::mutex> lock(scheduleMutex);
+	client.changed.wait(lock, [&client]() { return client.jobs.empty() && !client.running; });
+}
+
+void Server::runWorker()
+{
+	// Jobs run one to a worker, so they don't share the threads:
+	CompressorOptions workerOptions = options;
+	workerOptions.threads = 1;
+	workerOptions.verbose = false;
+	Compressor compressor(workerOptions);
+	std::vector<unsigned char> buffer;
+
+	std::unique_lock<std::mutex> lock(scheduleMutex);
+	for (;;)
+	{
+		jobWaiting.wait(lock, [this]() { return !readyClients.empty(); });
+		std::shared_ptr<ServerClient> client = readyClients.front();
+		readyClients.pop_front();
+		const ServerJob job = std::move(client->jobs.front());
+		client->jobs.pop_front();
+		client->running = true;
+		--jobsWaiting;
+		++jobsRunning;
+		client->changed.notify_all();
+		lock.unlock();
+
+		const std::chrono::steady_clock::time_point jobStart = std::chrono::steady_clock::now();
+		size_t responseLength = 0;
+		const bool success = runJob(compressor, job, buffer, responseLength);
+		if (success)
+		{
+			sendResponse(client->socketHandle, true, buffer.data(), responseLength);
+		}
+		else
+		{
+			// Why it failed has been printed, make sure it's in the output now rather than when the buffer fills:
+			fflush(stdout);
+			const char* jobNames[] = { "", "Compressing", "Decompressing", "Reading from" };
+			const std::string& filePath = (job.type == SERVER_JOB_COMPRESS) ? job.inputFilePath : job.fileKey;
+			sendResponse(client->socketHandle, false, std::string(jobNames[job.type]) + " " + filePath + " failed, see the server's output.");
+		}
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - jobStart).count();
+
+		lock.lock();
+		JobStatistics& statistics = jobStatistics[job.type];
+		++(success ? statistics.done : statistics.failed);
+		statistics.seconds += seconds;
+		if (success && (job.type == SERVER_JOB_READ_RANGE))
+		{
+			bytesRead += responseLength;
+		}
+		--jobsRunning;
+		client->running = false;
+		if (!client->jobs.empty())
+		{
+			readyClients.push_back(client);
+			jobWaiting.notify_one();
+		}
+		client->changed.notify_all();
+	}
+}
+
+// The response is the first responseLength bytes of buffer, which the worker keeps from job to job.
+bool Server::runJob(Compressor& compressor, const ServerJob& job, std::vector<unsigned char>& buffer, size_t& responseLength)
+{
+	responseLength = 0;
+	switch (job.type)
+	{
+	case SERVER_JOB_COMPRESS:
+		return runCompressJob(compressor, job);
+	case SERVER_JOB_DECOMPRESS:
+		return runDecompressJob(job, buffer);
+	case SERVER_JOB_READ_RANGE:
+		return runReadRangeJob(job, buffer, responseLength);
+	}
+	return false;
+}
+
+bool Server::runCompressJob(Compressor& compressor, const ServerJob& job)
+{
+	std::shared_ptr<ServedMetaDataFile> metaDataFile = getMetaDataFile(job.metaDataFilePath);
+	std::shared_ptr<const Json::Value> root;
+	{
+		std::lock_guard<std::mutex> lock(metaDataFile->mutex);
+		if (!loadMetaDataFile(*metaDataFile, job.metaDataFilePath))
+		{
+			return false;
+		}
+		root = metaDataFile->root;
+	}
+
+	// The output is written next to where it's going and renamed into place once it's been added to
+	// the meta data, so it never changes under a reader that has it open:
+	const std::string temporaryFilePath = job.compressedFilePath + ".tmp";
+	FILE* inputFileHandle = nullptr;
+	if (fopen_s(&inputFileHandle, job.inputFilePath.c_str(), "rb") != 0)
+	{
+		printf("Error opening %s for reading.\n", job.inputFilePath.c_str());
+		return false;
+	}
+	FILE* outputFileHandle = nullptr;
+	if (fopen_s(&outputFileHandle, temporaryFilePath.c_str(), "w+b") != 0)
+	{
+		printf("Error opening %s for writing.\n", temporaryFilePath.c_str());
+		fclose(inputFileHandle);
+		return false;
+	}
+
+	// Only /dd needs the other files in the meta data:
+	Json::Value rootJsonValue;
+	if (options.dedup)
+	{
+		rootJsonValue = *root;
+	}
+
+	FileInput input(inputFileHandle);
+	FileOutput output(outputFileHandle);
+	bool success = compressor.compress(input, output, job.inputFilePath.c_str(), job.compressedFilePath.c_str(), rootJsonValue);
+	fclose(inputFileHandle);
+	if (fclose(outputFileHandle) != 0)
+	{
+		printf("A write error occurred.\n");
+		success = false;
+	}
+
+	if (success)
+	{
+		// Into the meta data as it is now, other jobs may have added to it since this one started:
+		std::lock_guard<std::mutex> lock(metaDataFile->mutex);
+		ReferencedEntries referencedEntries;
+		addReferencedEntries(*metaDataFile->root, referencedEntries);
+		if (!checkEntryIsUnreferenced(referencedEntries, job.inputFilePath))
+		{
+			remove(temporaryFilePath.c_str());
+			return false;
+		}
+		MetaDataEntries newEntries;
+		newEntries[job.inputFilePath].header = rootJsonValue[job.inputFilePath][0];
+		std::shared_ptr<Json::Value> newRoot = std::make_shared<Json::Value>(*metaDataFile->root);
+		(*newRoot)[job.inputFilePath] = rootJsonValue[job.inputFilePath];
+		success = replaceFile(temporaryFilePath.c_str(), job.compressedFilePath.c_str()) && updateMetaDataFile(job.metaDataFilePath.c_str(), *metaDataFile->root, newEntries, options.metaDataLog);
+		if (success)
+		{
+			cache.forgetFile(job.compressedFilePath);
+			metaDataFile->root = newRoot;
+		}
+	}
+
+	if (!success)
+	{
+		remove(temporaryFilePath.c_str());
+	}
+	return success;
+}
+
+// Restored through a reader, rather than with decompressFile(), so it reads the compressed file the meta data
+// describes even if a compress job replaces it meanwhile.
+bool Server::runDecompressJob(const ServerJob& job, std::vector<unsigned char>& buffer)
+{
+	std::shared_ptr<XZReader> reader = getReader(job);
+	if (!reader)
+	{
+		return false;
+	}
+
+	FILE* outputFileHandle = nullptr;
+	if (fopen_s(&outputFileHandle, job.outputFilePath.c_str(), "w+b") != 0)
+	{
+		printf("Error opening %s for writing.\n", job.outputFilePath.c_str());
+		return false;
+	}
+
+	buffer.resize(std::max(buffer.size(), DECOMPRESS_READ_SIZE));
+	bool success = true;
+	const uint64_t fileSize = reader->getSize();
+	for (uint64_t offset = 0; success && (offset < fileSize);)
+	{
+		size_t bytesRead = 0;
+		success = reader->read(offset, buffer.data(), DECOMPRESS_READ_SIZE, bytesRead) && (bytesRead > 0);
+		if (success && (fwrite(buffer.data(), bytesRead, 1, outputFileHandle) != 1))
+		{
+			printf("A write error occurred.\n");
+			success = false;
+		}
+		offset += bytesRead;
+	}
+
+	if (fclose(outputFileHandle) != 0)
+	{
+		printf("A write error occurred.\n");
+		success = false;
+	}
+	return success;
+}
+
+bool Server::runReadRangeJob(const ServerJob& job, std::vector<unsigned char>& buffer, size_t& bytesRead)
+{
+	if (job.length > MAXIMUM_SERVED_READ_LENGTH)
+	{
+		printf("%llu bytes is more than a read range job can read.\n", (unsigned long long)job.length);
+		return false;
+	}
+
+	std::shared_ptr<XZReader> reader = getReader(job);
+	if (!reader)
+	{
+		return false;
+	}
+
+	buffer.resize(std::max(buffer.size(), (size_t)job.length));
+	return reader->read(job.offset, buffer.data(), (size_t)job.length, bytesRead);
+}
+
+std::string Server::getStatistics()
+{
+	Json::Value statistics;
+	statistics["uptime_seconds"] = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	{
+		std::lock_guard<std::mutex> lock(scheduleMutex);
+		++jobStatistics[SERVER_JOB_STATISTICS].done;
+		statistics["clients"] = clientCount;
+		statistics["workers"] = options.threads;
+		statistics["jobs_waiting"] = jobsWaiting;
+		statistics["jobs_running"] = jobsRunning;
+
+		const char* jobNames[] = { "", "compress", "decompress", "read_range", "statistics" };
+		for (int type = SERVER_JOB_COMPRESS; type < SERVER_JOB_TYPES; ++type)
+		{
+			Json::Value& jobJsonValue = statistics["jobs"][jobNames[type]];
+			jobJsonValue["done"] = (Json::UInt64)jobStatistics[type].done;
+			jobJsonValue["failed"] = (Json::UInt64)jobStatistics[type].failed;
+			jobJsonValue["seconds"] = jobStatistics[type].seconds;
+		}
+		statistics["jobs"]["read_range"]["bytes_read"] = (Json::UInt64)bytesRead;
+	}
+
+	const ChunkCacheStatistics cacheStatistics = cache.getStatistics();
+	Json::Value& cacheJsonValue = statistics["chunk_cache"];
+	cacheJsonValue["hits"] = (Json::UInt64)cacheStatistics.hits;
+	cacheJsonValue["misses"] = (Json::UInt64)cacheStatistics.misses;
+	cacheJsonValue["waits"] = (Json::UInt64)cacheStatistics.waits;
+	cacheJsonValue["evictions"] = (Json::UInt64)cacheStatistics.evictions;
+	cacheJsonValue["chunks"] = (Json::UInt64)cacheStatistics.entries;
+	cacheJsonValue["bytes"] = (Json::UInt64)cacheStatistics.bytes;
+	{
+		std::lock_guard<std::mutex> lock(readersMutex);
+		statistics["open_readers"] = (Json::UInt64)readers.size();
+	}
+	{
+		std::lock_guard<std::mutex> lock(metaDataFilesMutex);
+		statistics["meta_data_files"] = (Json::UInt64)metaDataFiles.size();
+	}
+
+	Json::StreamWriterBuilder builder;
+	builder["commentStyle"] = "None";
+	builder["indentation"] = "";
+	return Json::writeString(builder, statistics);
+}
+
+std::shared_ptr<ServedMetaDataFile> Server::getMetaDataFile(const std::string& metaDataFilePath)
+{
+	std::lock_guard<std::mutex> lock(metaDataFilesMutex);
+	std::shared_ptr<ServedMetaDataFile>& metaDataFile = metaDataFiles[metaDataFilePath];
+	if (!metaDataFile)
+	{
+		metaDataFile = std::make_shared<ServedMetaDataFile>();
+	}
+	return metaDataFile;
+}
+
+// Reads the file the first time it's needed, with metaDataFile.mutex held. If it can't be read the next
+// job to name it tries again.
+bool Server::loadMetaDataFile(ServedMetaDataFile& metaDataFile, const std::string& metaDataFilePath)
+{
+	if (metaDataFile.root)
+	{
+		return true;
+	}
+
+	std::shared_ptr<Json::Value> rootJsonValue = std::make_shared<Json::Value>();
+	bool metaDataFileExists = false;
+	if (!readMetaDataFile(metaDataFilePath.c_str(), *rootJsonValue, metaDataFileExists))
+	{
+		return false;
+	}
+	metaDataFile.root = rootJsonValue;
+	return true;
+}
+
+// A reader open on the file as the meta data describes it now, reusing the last one if the meta data
+// hasn't changed since it was opened. The least recently used reader is closed to make room for another.
+std::shared_ptr<XZReader> Server::getReader(const ServerJob& job)
+{
+	std::shared_ptr<ServedMetaDataFile> metaDataFile = getMetaDataFile(job.metaDataFilePath);
+
+	// Held while the reader opens, so it can't open the compressed file as it's replaced by a compress job:
+	std::lock_guard<std::mutex> metaDataLock(metaDataFile->mutex);
+	if (!loadMetaDataFile(*metaDataFile, job.metaDataFilePath))
+	{
+		return nullptr;
+	}
+
+	const std::string readerKey = job.metaDataFilePath + '\n' + job.fileKey + '\n' + job.compressedFilePath;
+	{
+		std::lock_guard<std::mutex> lock(readersMutex);
+		std::unordered_map<std::string, OpenReader>::iterator it = readers.find(readerKey);
+		if ((it != readers.end()) && (it->second.root == metaDataFile->root))
+		{
+			it->second.lastUsed = ++readerUses;
+			return it->second.reader;
+		}
+	}
+
+	std::shared_ptr<XZReader> reader = std::make_shared<XZReader>(cache);
+	if (!reader->open(*metaDataFile->root, job.fileKey.c_str(), job.compressedFilePath.c_str()))
+	{
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(readersMutex);
+	if ((readers.size() >= MAXIMUM_OPEN_READERS) && (readers.find(readerKey) == readers.end()))
+	{
+		std::unordered_map<std::string, OpenReader>::iterator leastRecentlyUsed = readers.begin();
+		for (std::unordered_map<std::string, OpenReader>::iterator it = readers.begin(); it != readers.end(); ++it)
+		{
+			if (it->second.lastUsed < leastRecentlyUsed->second.lastUsed)
+			{
+				leastRecentlyUsed = it;
+			}
+		}
+		readers.erase(leastRecentlyUsed);
+	}
+
+	OpenReader& openReader = readers[readerKey];
+	openReader.root = metaDataFile->root;
+	openReader.reader = reader;
+	openReader.lastUsed = ++readerUses;
+	return reader;
+}
+
+bool serve(const char* socketPath, const CompressorOptions& options)
+{
+	Server server(options);
+	if (!server.startListening(socketPath))
+	{
+		return false;
+	}
+
+	printf("Serving on %s with %u workers.\n", socketPath, options.threads);
+	fflush(stdout);
+	server.serveClients();
+	return true;
+}
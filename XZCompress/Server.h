@@ -0,0 +1,56 @@
+#pragma once
+
+// Compression server (/serve):
+// Keeps the tool running and takes jobs over a Unix domain socket, so compressing many small files doesn't
+// mean starting a process, and building the search and its deflate streams again, for each one. Jobs name
+// files (the server's paths, relative ones from where it was started) just as the command line does.
+//
+// Protocol:
+// Every message, both ways, is a frame: a 4 byte length and then that many bytes. A request is a job type
+// byte followed by the job's fields, strings as a 4 byte length and then the characters, offsets and
+// lengths as 8 bytes. Numbers are little endian.
+//   1 compress:    input file, output file, meta data file
+//   2 decompress:  file key, compressed file, output file, meta data file
+//   3 read range:  file key, compressed file, meta data file, offset, length
+//   4 statistics:  nothing
+// A response is 0 if the job was done or 1 if it wasn't, followed by the bytes read for a read range, the
+// statistics as Json, or why it wasn't done. A client's responses come back in the order it sent the jobs.
+//
+// Scheduling:
+// Each client's jobs wait in its own queue. The /t workers take the next job from each client with one
+// waiting in turn, so a client with hundreds queued doesn't hold up one with a single job, and only one of
+// a client's jobs is worked on at a time, which keeps its responses in order. Once MAXIMUM_QUEUED_JOBS are
+// waiting the server stops reading the client's requests until one is taken, so a client that sends jobs
+// faster than they're done is held up by its own socket.
+//
+// What's kept warm:
+// Each worker keeps a Compressor, with its search buffers and deflate streams, from job to job. Meta data
+// files are read once and then kept, and each compress job adds its file to the one in memory and writes
+// it out, so while serving, the server has to be the only thing writing the meta data files it's given.
+// With a meta data log (/mlog, see MetaData.h) each job only appends its file, and other runs can add to
+// the same meta data without either losing the other's files, though the server won't see theirs until
+// it's started again.
+// Readers for decompress and read range jobs are kept open, sharing one chunk cache.
+
+#include <stdint.h>
+
+#include "Compressor.h"
+
+enum ServerJobType
+{
+	SERVER_JOB_COMPRESS = 1,
+	SERVER_JOB_DECOMPRESS,
+	SERVER_JOB_READ_RANGE,
+	SERVER_JOB_STATISTICS,
+	SERVER_JOB_TYPES
+};
+
+// How many of a client's jobs can be waiting before the server stops reading its requests.
+const size_t MAXIMUM_QUEUED_JOBS = 16;
+
+// Read ranges longer than this aren't served, a response has to fit in memory.
+const uint64_t MAXIMUM_SERVED_READ_LENGTH = 64 * 1024 * 1024;
+
+// Listens on socketPath and serves jobs until the process is stopped, compressing with options on
+// options.threads workers. Only returns if it can't listen.
+bool serve(const char* socketPath, const CompressorOptions& options);
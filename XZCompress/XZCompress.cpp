@@ -6,15 +6,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
-
-#include <fstream> // For Json parsers :/
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h> // FindFirstFile, GetFileAttributes
+#else
+#include <glob.h> // glob
+#include <sys/stat.h> // stat
+#endif
 
 // External libraries:
 #include <zlib.h>
 #include <json/json.h>
 
-#define XZCOMPRESS_VERSION 1.0
+#include "Compressor.h"
+#include "MetaData.h"
+#include "ChunkCache.h"
+#include "XZReader.h"
+#include "Parallel.h"
+#include "Server.h"
 
 void printHeader()
 {
@@ -28,123 +46,285 @@ void printUsage()
 	printf("Specify switches:\n");
 	printf("/i	OR /input - input file name - Ex. /i inputFileName.txt\n");
 	printf("/o	OR /output - output file name - Ex. /o outputFileName.txt\n");
-	printf("/ch OR /chunkSize - maximum compressed chunk size - Ex. /ch 123456\n");
+	printf("/ch OR /chunkSize - chunk size - Ex. /ch 123456\n");
 	printf("/m	OR /meta - meta data output file name - Ex. /m metaDataFileName.txt\n");
+	printf("/cdc OR /contentDefinedChunking - split chunks on content instead of fixed offsets, /ch becomes the average chunk size - Ex. /cdc\n");
+	printf("/cmin OR /cdcMin - smallest content defined chunk (default /ch / 4) - Ex. /cmin 8388608\n");
+	printf("/cmax OR /cdcMax - largest content defined chunk (default /ch * 4) - Ex. /cmax 134217728\n");
+	printf("/tc OR /targetCompressed - end each chunk once its compressed data fills /ch, /ch becomes the compressed size each chunk is filled to and /cmax caps the input one chunk takes (default /ch * 16); can't be combined with /cdc - Ex. /tc\n");
+	printf("/lv OR /levels - comma separated deflate levels to search (default 9) - Ex. /lv 6,9\n");
+	printf("/ml OR /memLevels - comma separated deflate memLevels to search (default 9) - Ex. /ml 8,9\n");
+	printf("/st OR /strategies - comma separated deflate strategies to search, 0-4 (default all) - Ex. /st 0,1,3\n");
+	printf("/cd OR /codecs - comma separated codecs to search, zlib, wholebuffer and/or optimal (default zlib) - Ex. /cd zlib,wholebuffer\n");
+	printf("/mbps OR /minThroughput - best ratio while still compressing at this many MB/s, slower settings are dropped from the search - Ex. /mbps 20\n");
+	printf("/bms OR /budgetMs - stop searching a chunk after this many milliseconds and keep the best result so far - Ex. /bms 500\n");
+	printf("/as OR /adaptiveSearch - try the previous chunk's winner first and only search fully when a sample of the chunk favours another - Ex. /as\n");
+	printf("/t OR /threads - compress this many chunks at once, one per thread (default 1, no value or 0 for one per CPU) - Ex. /t 8\n");
+	printf("/sbs OR /subBlockSize - deflate chunks larger than this in sub-blocks of this size, on the /t threads (zlib codec only) - Ex. /sbs 8388608\n");
+	printf("/ultra - after the search, try slower deflateTune() settings on each chunk for up to this many milliseconds (default 2000) - Ex. /ultra 5000\n");
+	printf("/pd OR /primeDictionary - start each chunk's deflate window with the last 32KB of the chunk before it (chunks then depend on their predecessor) - Ex. /pd\n");
+	printf("/td OR /trainDictionary - build a 32KB dictionary from samples of the input, store it next to the output (<output>.dict) and prime every chunk with it - Ex. /td\n");
+	printf("/dd OR /dedup - store chunks whose content was already stored (in this file or another in the metadata) once; a file whose chunks another file's point to can't be compressed again until that one is - Ex. /dd\n");
+	printf("/vf OR /verify - inflate every chunk again on the /t threads and check it against the input's CRC-32 (stored in the metadata) before writing it, stop at the first mismatch - Ex. /vf\n");
+	printf("/resume - continue an interrupted run from the last durable checkpoint - Ex. /resume\n");
+	printf("/cp OR /checkpointInterval - number of chunks per durable checkpoint (default 16) - Ex. /cp 16\n");
+	printf("/b OR /batch - instead of /i, compress every file in a directory, matching a wildcard or listed one per line in a file (@file) to <name>.xz in the /o directory, sharing the /t threads between them and writing the metadata once - Ex. /b C:\\logs\\*.log\n");
+	printf("/mlog OR /metaLog - append each file's metadata to a log next to the meta data file (<meta>.log) instead of writing the whole file again, so runs can share it at once; the log is folded into the file as it grows, and once a meta data file has a log every run adds to it - Ex. /mlog\n");
+	printf("/compact - instead, fold the /m meta data file's log into it now - Ex. /compact /m myMetaDataFile.json\n");
+	printf("/serve - instead, keep running and take compress, decompress and read range jobs over this Unix domain socket (see Server.h), /t of them at once, compressing with the other switches - Ex. /serve xzcompress.sock\n");
 	printf("\n");
 	printf("Ex.:\n");
 	printf("XZCompress /i myFile.dat /o myCompressedFile.dat /ch 33554432 /m myMetaDataFile.json\n");
+	printf("XZCompress /b myDirectory /o myCompressedDirectory /ch 1048576 /m myMetaDataFile.json /t\n");
+	printf("XZCompress /serve xzcompress.sock /ch 1048576 /t\n");
+	printf("\n");
+	printf("To decompress:\n");
+	printf("/d	OR /decompress - name of the original input file in the meta data - Ex. /d myFile.dat\n");
+	printf("/i, /o and /m are then the compressed file, the restored file and the meta data file.\n");
+	printf("/rr OR /readRanges - only read these offset:length ranges (through the chunk cache, on the /t threads) into /o, one after another - Ex. /rr 0:4096,1048576:4096\n");
+	printf("/pf OR /prefetch - with /rr, read the ranges in order and inflate up to this many chunks ahead of them on the /t threads - Ex. /pf 8\n");
+	printf("\n");
+	printf("Ex.:\n");
+	printf("XZCompress /d myFile.dat /i myCompressedFile.dat /o myRestoredFile.dat /m myMetaDataFile.json\n");
 }
 
-long int getFileSize(FILE* fh)
+
+// Parses a comma separated list of integers, ex. "0,1,4".
+bool parseIntegerList(const char* text, int minimum, int maximum, std::vector<int>& values)
 {
-	int returnVal = fseek(fh, 0, SEEK_END);
-	if (returnVal != 0)
+	values.clear();
+	while (text && *text)
 	{
-		printf("An error occurred during seek.\n");
-		return 0;
+		char* end = nullptr;
+		const long value = strtol(text, &end, 10);
+		if ((end == text) || (value < minimum) || (value > maximum))
+		{
+			return false;
+		}
+		values.push_back((int)value);
+		text = (*end == ',') ? end + 1 : end;
+		if ((*end != ',') && (*end != 0))
+		{
+			return false;
+		}
 	}
-
-	return ftell(fh);
+	return !values.empty();
 }
 
-void seekToBeginning(FILE* fh)
+// Parses a comma separated list of codec names, ex. "zlib,optimal".
+bool parseCodecList(const char* text, std::vector<int>& codecs)
 {
-	int returnVal = fseek(fh, 0, SEEK_SET);
-	if (returnVal != 0)
+	codecs.clear();
+	while (text && *text)
 	{
-		printf("An error occurred during seek.\n");
+		const char* end = strchr(text, ',');
+		const std::string name = end ? std::string(text, end) : std::string(text);
+		int codec = CODEC_ZLIB;
+		if (!findCodec(name.c_str(), codec))
+		{
+			return false;
+		}
+		codecs.push_back(codec);
+		text = end ? end + 1 : nullptr;
 	}
+	return !codecs.empty();
 }
 
-void seekForwardBy(FILE* fh, long int offset)
+// Batch mode (/b):
+// The inputs are every file in a directory or matching a wildcard, in name order, or the files a list file
+// ("@list.txt") names, one per line, in its order. Each is compressed to <file name>.xz in the output directory.
+bool isDirectory(const char* path)
 {
-	int returnVal = fseek(fh, offset, SEEK_CUR);
-	if (returnVal != 0)
-	{
-		printf("An error occurred during seek.\n");
-	}
-
+#ifdef _WIN32
+	const DWORD attributes = GetFileAttributesA(path);
+	return (attributes != INVALID_FILE_ATTRIBUTES) && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat fileStatus;
+	return (stat(path, &fileStatus) == 0) && S_ISDIR(fileStatus.st_mode);
+#endif
 }
 
-FILE* openFileForReadingBinary(const char* inputFilePath)
+bool listBatchInputs(const char* inputs, const char* outputDirectory, std::vector<std::string>& inputFilePaths, std::vector<std::string>& outputFilePaths)
 {
-	FILE* inputFileHandle = nullptr;
+#ifdef _WIN32
+	const char pathSeparator = '\\';
+#else
+	const char pathSeparator = '/';
+#endif
+
+	if (inputs[0] == '@')
 	{
-		errno_t fopenRetVal = fopen_s(&inputFileHandle, inputFilePath, "r+b");
-		if (fopenRetVal != 0)
+		FILE* listFileHandle = nullptr;
+		if (fopen_s(&listFileHandle, inputs + 1, "r") != 0)
 		{
-			printf("Error opening %s for reading.\n", inputFilePath);
+			printf("Error opening %s for reading.\n", inputs + 1);
+			return false;
+		}
+
+		char line[4096];
+		while (fgets(line, sizeof(line), listFileHandle))
+		{
+			line[strcspn(line, "\r\n")] = '\0';
+			if (line[0] != '\0')
+			{
+				inputFilePaths.push_back(line);
+			}
 		}
+		fclose(listFileHandle);
+	}
+	else
+	{
+		const bool directory = isDirectory(inputs);
+		const std::string pattern = directory ? std::string(inputs) + pathSeparator + "*" : std::string(inputs);
+#ifdef _WIN32
+		// FindFirstFile() only returns names, the directory is whatever comes before them in the pattern:
+		const size_t directoryEnd = pattern.find_last_of("\\/:");
+		const std::string directoryPath = (directoryEnd == std::string::npos) ? std::string() : pattern.substr(0, directoryEnd + 1);
+		WIN32_FIND_DATAA findData;
+		HANDLE findHandle = FindFirstFileA(pattern.c_str(), &findData);
+		if (findHandle != INVALID_HANDLE_VALUE)
+		{
+			do
+			{
+				if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+				{
+					inputFilePaths.push_back(directoryPath + findData.cFileName);
+				}
+			} while (FindNextFileA(findHandle, &findData));
+			FindClose(findHandle);
+		}
+#else
+		glob_t globResult = {};
+		if (glob(pattern.c_str(), 0, nullptr, &globResult) == 0)
+		{
+			for (size_t p = 0; p < globResult.gl_pathc; ++p)
+			{
+				if (!isDirectory(globResult.gl_pathv[p]))
+				{
+					inputFilePaths.push_back(globResult.gl_pathv[p]);
+				}
+			}
+		}
+		globfree(&globResult);
+#endif
+		std::sort(inputFilePaths.begin(), inputFilePaths.end());
 	}
-	return inputFileHandle;
-}
 
-FILE* openFileForReadingText(const char* inputFilePath)
-{
-	FILE* inputFileHandle = nullptr;
+	if (inputFilePaths.empty())
+	{
+		printf("No files to compress were found in %s.\n", inputs);
+		return false;
+	}
+
+	std::unordered_map<std::string, std::string> inputFromOutput;
+	for (const std::string& inputFilePath : inputFilePaths)
 	{
-		errno_t fopenRetVal = fopen_s(&inputFileHandle, inputFilePath, "r");
-		if (fopenRetVal != 0)
+		const size_t nameStart = inputFilePath.find_last_of("\\/");
+		const std::string fileName = (nameStart == std::string::npos) ? inputFilePath : inputFilePath.substr(nameStart + 1);
+		outputFilePaths.push_back(std::string(outputDirectory) + pathSeparator + fileName + ".xz");
+		std::string& otherInputFilePath = inputFromOutput[outputFilePaths.back()];
+		if (!otherInputFilePath.empty())
 		{
-			printf("Error opening %s for reading.\n", inputFilePath);
+			printf("%s and %s would both be compressed to %s.\n", otherInputFilePath.c_str(), inputFilePath.c_str(), outputFilePaths.back().c_str());
+			return false;
 		}
+		otherInputFilePath = inputFilePath;
 	}
-	return inputFileHandle;
-}
 
-FILE* openFileForWritingBinary(const char* outputFilePath)
-{
-	FILE* outputFileHandle = nullptr;
-errno_t fopenRetVal = fopen_s(&outputFileHandle, outputFilePath, "w+b");
-if (fopenRetVal != 0)
-{
-	printf("Error opening %s for writing.\n", outputFilePath);
-}
-return outputFileHandle;
+	return true;
 }
 
+// Random access reads (/rr):
+// Reads byte ranges ("offset:length,offset:length,...") of a compressed file through an XZReader, on up
+// to threads threads at once, and writes them one after another to the output file. Then reports how the
+// chunk cache did. With /pf the ranges are read in order on one thread, and the threads read ahead instead.
+const size_t READ_RANGES_CACHE_SIZE = 256 * 1024 * 1024;
 
-FILE* openFileForWritingText(const char* outputFilePath)
+bool readFileRanges(const Json::Value& rootJsonValue, const char* fileKey, const char* compressedFilePath, const char* outputFilePath, const char* ranges, unsigned int threads, unsigned int prefetchDepth)
 {
-	FILE* outputFileHandle = nullptr;
-	errno_t fopenRetVal = fopen_s(&outputFileHandle, outputFilePath, "w");
-	if (fopenRetVal != 0)
+	struct ReadRange
 	{
-		printf("Error opening %s for writing.\n", outputFilePath);
+		unsigned long long offset;
+		unsigned long long length;
+		std::vector<unsigned char> data;
+		bool success;
+	};
+	std::vector<ReadRange> readRanges;
+	for (const char* range = ranges; (range != nullptr) && (*range != '\0');)
+	{
+		ReadRange readRange = {};
+		int consumed = 0;
+		if ((sscanf(range, "%llu:%llu%n", &readRange.offset, &readRange.length, &consumed) != 2) || ((range[consumed] != ',') && (range[consumed] != '\0')))
+		{
+			printf("/rr expects offset:length pairs separated by commas.\n");
+			return false;
+		}
+		readRanges.push_back(readRange);
+		range += consumed + ((range[consumed] == ',') ? 1 : 0);
 	}
-	return outputFileHandle;
-}
 
-bool deflate_with_strategy(z_stream& myZStream, const unsigned int strategy, unsigned int currentChunkSize, unsigned char* chunkData, unsigned char* compressedDataBuffer)
-{
-	myZStream.zalloc = Z_NULL;
-	myZStream.zfree = Z_NULL;
-	myZStream.opaque = Z_NULL;
-	myZStream.avail_in = currentChunkSize;
-	myZStream.next_in = chunkData;
-	myZStream.avail_out = currentChunkSize;
-	myZStream.next_out = compressedDataBuffer;
-	myZStream.data_type = Z_BINARY;
-
-	int windowBits = 15;
-	int deflateInitReturnVal = deflateInit2(&myZStream, Z_BEST_COMPRESSION, Z_DEFLATED, windowBits, 9, strategy);
-
-	int deflateReturnVal = deflate(&myZStream, Z_FINISH);
-	if ((deflateReturnVal != Z_STREAM_END) && (deflateReturnVal != Z_OK))
+	ChunkCache cache(READ_RANGES_CACHE_SIZE);
+	XZReader reader(cache);
+	if (prefetchDepth > 0)
+	{
+		reader.setPrefetch(threads, prefetchDepth);
+	}
+	if (!reader.open(rootJsonValue, fileKey, compressedFilePath))
 	{
-		printf("An error occurred during deflate.\n");
 		return false;
 	}
 
-	if (myZStream.total_out >= myZStream.total_in)
+	runInParallel(readRanges.size(), (prefetchDepth > 0) ? 1 : threads, [&readRanges, &reader](size_t r)
 	{
-		//printf("Compressed data size is >= input data size.\n");
+		ReadRange& readRange = readRanges[r];
+		size_t bytesRead = 0;
+		readRange.data.resize((size_t)readRange.length);
+		readRange.success = reader.read(readRange.offset, readRange.data.data(), readRange.data.size(), bytesRead);
+		readRange.data.resize(bytesRead);
+	});
+
+	FILE* outputFileHandle = nullptr;
+	if (fopen_s(&outputFileHandle, outputFilePath, "w+b") != 0)
+	{
+		printf("Error opening %s for writing.\n", outputFilePath);
 		return false;
 	}
 
-	return true;
+	bool success = true;
+	for (const ReadRange& readRange : readRanges)
+	{
+		if (!readRange.success)
+		{
+			printf("Unable to read %llu bytes at %llu.\n", readRange.length, readRange.offset);
+			success = false;
+			break;
+		}
+
+		printf("Read %d bytes at %llu\n", (unsigned int)readRange.data.size(), readRange.offset);
+		if (!readRange.data.empty() && (fwrite(readRange.data.data(), readRange.data.size(), 1, outputFileHandle) != 1))
+		{
+			printf("A write error occurred.\n");
+			success = false;
+			break;
+		}
+	}
+	fclose(outputFileHandle);
+
+	const ChunkCacheStatistics statistics = cache.getStatistics();
+	printf("Chunk cache: %llu hits, %llu misses, %llu waits on another thread's inflate, %llu evictions, %llu chunks (%llu bytes) cached.\n",
+		(unsigned long long)statistics.hits, (unsigned long long)statistics.misses, (unsigned long long)statistics.waits,
+		(unsigned long long)statistics.evictions, (unsigned long long)statistics.entries, (unsigned long long)statistics.bytes);
+	if (prefetchDepth > 0)
+	{
+		const PrefetchStatistics prefetchStatistics = reader.getPrefetchStatistics();
+		printf("Read ahead: %llu chunks queued, %llu ready when read, %llu still inflating, %llu missed, %d chunks ahead at the end.\n",
+			(unsigned long long)prefetchStatistics.chunksQueued, (unsigned long long)prefetchStatistics.hits, (unsigned long long)prefetchStatistics.waits,
+			(unsigned long long)prefetchStatistics.misses, prefetchStatistics.depth);
+	}
+	return success;
 }
 
+
 int main(int argc, char** argv)
 {
 	printHeader();
@@ -166,9 +346,10 @@ int main(int argc, char** argv)
 		if (**(argv + i) == '/')
 		{
 			commandLineParams[uNextSwitch].switchName = *(argv + i);
+			commandLineParams[uNextSwitch].switchValue = nullptr;
 
 			// We found a switch! Now check the next argument, that might be a value:
-			if (**(argv + i + 1) != '/')
+			if ((i + 1 < argc) && (**(argv + i + 1) != '/'))
 			{
 				// It is!
 				commandLineParams[uNextSwitch].switchValue = *(argv + i + 1);
@@ -180,9 +361,16 @@ int main(int argc, char** argv)
 
 	// Now, ignoring the application executable path, what are our arguments:
 	char* inputFilePath = nullptr;
-	unsigned int requestedChunkSize = 0;
 	char* outputFilePath = nullptr;
 	char* outputMetaDataFilePath = nullptr;
+	char* decompressFileKey = nullptr;
+	char* readRanges = nullptr;
+	char* batchInputs = nullptr;
+	char* serveSocketPath = nullptr;
+	bool compactMetaData = false;
+	unsigned int prefetchDepth = 0;
+	CompressorOptions options;
+	options.verbose = true;
 
 	for (unsigned int i = 0; i < uNextSwitch; ++i)
 	{
@@ -196,7 +384,12 @@ int main(int argc, char** argv)
 		if ((_stricmp(currentSwitch.switchName, "/ch") == 0) || _stricmp(currentSwitch.switchName, "/chunkSize") == 0)
 		{
 			char* requestedChunkSizeString = currentSwitch.switchValue;
-			requestedChunkSize = atoi(requestedChunkSizeString);
+			if (requestedChunkSizeString == nullptr)
+			{
+				printf("/ch expects a chunk size in bytes.\n");
+				return 1;
+			}
+			options.chunkSize = atoi(requestedChunkSizeString);
 		}
 
 		if ((_stricmp(currentSwitch.switchName, "/o") == 0) || _stricmp(currentSwitch.switchName, "/output") == 0)
@@ -208,234 +401,272 @@ int main(int argc, char** argv)
 		{
 			outputMetaDataFilePath = currentSwitch.switchValue;
 		}
-	}
 
-	// Check required parameters here:
-	if ((inputFilePath == nullptr) || (outputFilePath == nullptr) || (outputMetaDataFilePath == nullptr))
-	{
-		printUsage();
-		return 1;
-	}
-
-	printf("Opening %s\n", inputFilePath);
-	printf("Using chunk size of %d\n", requestedChunkSize);
-	printf("Writing to %s\n", outputFilePath);
-	printf("Writing metadata to %s\n", outputMetaDataFilePath);
-
-	// Open input file:
-	FILE* inputFileHandle = openFileForReadingBinary(inputFilePath);
-	if (!inputFileHandle)
-	{
-		return 1;
-	}
+		if ((_stricmp(currentSwitch.switchName, "/cdc") == 0) || _stricmp(currentSwitch.switchName, "/contentDefinedChunking") == 0)
+		{
+			options.contentDefinedChunking = true;
+		}
 
-	// Open output file:
-	FILE* outputFileHandle = openFileForWritingBinary(outputFilePath);
-	if (!outputFileHandle)
-	{
-		return 1;
-	}
+		if ((_stricmp(currentSwitch.switchName, "/cmin") == 0) || _stricmp(currentSwitch.switchName, "/cdcMin") == 0)
+		{
+			if (currentSwitch.switchValue)
+			{
+				options.cdcMinimumChunkSize = atoi(currentSwitch.switchValue);
+			}
+		}
 
-	Json::Value rootJsonValue;
+		if ((_stricmp(currentSwitch.switchName, "/cmax") == 0) || _stricmp(currentSwitch.switchName, "/cdcMax") == 0)
+		{
+			if (currentSwitch.switchValue)
+			{
+				options.cdcMaximumChunkSize = atoi(currentSwitch.switchValue);
+			}
+		}
 
-	// Does the metadata file already exist?
-	std::ifstream ifs(outputMetaDataFilePath);
-	if (ifs.is_open())
-	{
-		// If it already exists, populate our JSON data:
-		Json::CharReaderBuilder builder;
-		std::string errs;
-		bool parsingReturnValue = Json::parseFromStream(builder, ifs, &rootJsonValue, &errs);
-		if (!parsingReturnValue)
+		if ((_stricmp(currentSwitch.switchName, "/tc") == 0) || _stricmp(currentSwitch.switchName, "/targetCompressed") == 0)
 		{
-			printf("An existing Json file was found but an error occurred during parsing.\n");
-			return 1;
+			options.targetCompressedChunks = true;
 		}
-	}
 
-	// How big is our input file?
-	long int inputFileSize = getFileSize(inputFileHandle);
+		if ((_stricmp(currentSwitch.switchName, "/pd") == 0) || _stricmp(currentSwitch.switchName, "/primeDictionary") == 0)
+		{
+			options.primeDictionary = true;
+		}
 
-	// Assuming a chunk size of N, how many chunks is this file going to be?
-	unsigned int chunkSize = requestedChunkSize;
-	unsigned int numberOfWholeChunks = inputFileSize / chunkSize;
-	unsigned int lastChunkSize = inputFileSize % chunkSize;
-	unsigned int numberOfChunks = numberOfWholeChunks + (lastChunkSize > 0);
+		if ((_stricmp(currentSwitch.switchName, "/lv") == 0) || _stricmp(currentSwitch.switchName, "/levels") == 0)
+		{
+			if (!parseIntegerList(currentSwitch.switchValue, 1, 9, options.levels))
+			{
+				printf("/lv expects levels between 1 and 9.\n");
+				return 1;
+			}
+		}
 
-	// So, we now know our chunk sizes, let's compress and write out to disk!
-	seekToBeginning(inputFileHandle);
-	seekToBeginning(outputFileHandle);
+		if ((_stricmp(currentSwitch.switchName, "/ml") == 0) || _stricmp(currentSwitch.switchName, "/memLevels") == 0)
+		{
+			if (!parseIntegerList(currentSwitch.switchValue, 1, 9, options.memLevels))
+			{
+				printf("/ml expects memLevels between 1 and 9.\n");
+				return 1;
+			}
+		}
 
-	Json::Value newJsonValue;
-	newJsonValue["xzcompress_version"] = XZCOMPRESS_VERSION;
-	newJsonValue["requested_chunk_size"] = requestedChunkSize;
-	newJsonValue["number_of_chunks"] = numberOfChunks;
-	newJsonValue["uncompressed_file_size_in_bytes"] = (Json::Int64)inputFileSize;
+		if ((_stricmp(currentSwitch.switchName, "/st") == 0) || _stricmp(currentSwitch.switchName, "/strategies") == 0)
+		{
+			if (!parseIntegerList(currentSwitch.switchValue, Z_DEFAULT_STRATEGY, Z_FIXED, options.strategies))
+			{
+				printf("/st expects strategies between %d and %d.\n", Z_DEFAULT_STRATEGY, Z_FIXED);
+				return 1;
+			}
+		}
 
-	// Before we start, let's initialise Zlib:
-	for (unsigned int i = 0; i < numberOfChunks; ++i)
-	{
-		printf("Chunk %d of %d\n", i+1, numberOfChunks);
+		if ((_stricmp(currentSwitch.switchName, "/cd") == 0) || _stricmp(currentSwitch.switchName, "/codecs") == 0)
+		{
+			if (!parseCodecList(currentSwitch.switchValue, options.codecs))
+			{
+				printf("/cd expects codecs from: zlib, wholebuffer, optimal.\n");
+				return 1;
+			}
+		}
 
-		const unsigned int currentChunkSize = (i < numberOfWholeChunks) ? chunkSize : lastChunkSize;
+		if ((_stricmp(currentSwitch.switchName, "/mbps") == 0) || _stricmp(currentSwitch.switchName, "/minThroughput") == 0)
+		{
+			if (currentSwitch.switchValue)
+			{
+				options.minimumMegabytesPerSecond = atof(currentSwitch.switchValue);
+			}
+		}
 
-		unsigned char* chunkData = (unsigned char*)malloc(currentChunkSize);
-		if (!chunkData)
+		if ((_stricmp(currentSwitch.switchName, "/bms") == 0) || _stricmp(currentSwitch.switchName, "/budgetMs") == 0)
 		{
-			printf("Failed to allocate memory for read.\n");
-			return 1;
+			if (currentSwitch.switchValue)
+			{
+				options.searchBudgetMilliseconds = atoi(currentSwitch.switchValue);
+			}
 		}
-		memset(chunkData, 0, currentChunkSize);
 
-		size_t readSize = fread(chunkData, currentChunkSize, 1, inputFileHandle);
-		if (ferror(inputFileHandle))
+		if ((_stricmp(currentSwitch.switchName, "/as") == 0) || _stricmp(currentSwitch.switchName, "/adaptiveSearch") == 0)
 		{
-			printf("A read error occurred.\n");
-			return 1;
+			options.adaptiveSearch = true;
 		}
-		if (feof(inputFileHandle))
+
+		if ((_stricmp(currentSwitch.switchName, "/t") == 0) || _stricmp(currentSwitch.switchName, "/threads") == 0)
 		{
-			printf("Unexpectedly reached end of file.\n");
-			return 1;
+			options.threads = currentSwitch.switchValue ? atoi(currentSwitch.switchValue) : 0;
+			if (options.threads == 0)
+			{
+				options.threads = std::thread::hardware_concurrency();
+			}
+			if (options.threads == 0)
+			{
+				options.threads = 1;
+			}
 		}
 
-		// Compress the chunk:
-		unsigned char* compressedDataBuffer = (unsigned char*)malloc(currentChunkSize);
+		if ((_stricmp(currentSwitch.switchName, "/sbs") == 0) || _stricmp(currentSwitch.switchName, "/subBlockSize") == 0)
+		{
+			options.subBlockSize = currentSwitch.switchValue ? atoi(currentSwitch.switchValue) : 0;
+			if (options.subBlockSize < MINIMUM_SUB_BLOCK_SIZE)
+			{
+				printf("/sbs expects a sub-block size of at least %u bytes.\n", MINIMUM_SUB_BLOCK_SIZE);
+				return 1;
+			}
+		}
 
-		// We're going to run compression 5 times, in order to get the best
-		// compression for smallest size.
-		size_t smallestCompressedDataSize = currentChunkSize;
-		char bestCompressionMethod = -1;
+		if (_stricmp(currentSwitch.switchName, "/ultra") == 0)
+		{
+			options.ultraBudgetMilliseconds = currentSwitch.switchValue ? atoi(currentSwitch.switchValue) : 2000;
+		}
 
-		for (unsigned int i = 0; i < 5; ++i)
+		if ((_stricmp(currentSwitch.switchName, "/td") == 0) || _stricmp(currentSwitch.switchName, "/trainDictionary") == 0)
 		{
-			// Success isn't guaranteed and that's okay..
-			z_stream myZStream = {};
-			deflate_with_strategy(myZStream, i, currentChunkSize, chunkData, compressedDataBuffer);
+			options.trainDictionary = true;
+		}
 
-			if (myZStream.total_out < smallestCompressedDataSize)
-			{
-				smallestCompressedDataSize = myZStream.total_out;
-				bestCompressionMethod = i;
-			}
+		if ((_stricmp(currentSwitch.switchName, "/dd") == 0) || _stricmp(currentSwitch.switchName, "/dedup") == 0)
+		{
+			options.dedup = true;
 		}
-		
-		switch (bestCompressionMethod)
+
+		if ((_stricmp(currentSwitch.switchName, "/vf") == 0) || _stricmp(currentSwitch.switchName, "/verify") == 0)
 		{
-		default:
-			printf("Catastrophic error! None of the compression strategies could produce compressed data smaller than the uncompressed data.\n");
-			return 1;
-			break;
+			options.verify = true;
+		}
 
-		case Z_DEFAULT_STRATEGY:
-			printf("Best compression method: Z_DEFAULT_STRATEGY\n");
-			break;
+		if ((_stricmp(currentSwitch.switchName, "/d") == 0) || _stricmp(currentSwitch.switchName, "/decompress") == 0)
+		{
+			decompressFileKey = currentSwitch.switchValue;
+		}
 
-		case Z_FILTERED:
-			printf("Best compression method: Z_FILTERED");
-			break;
+		if ((_stricmp(currentSwitch.switchName, "/rr") == 0) || _stricmp(currentSwitch.switchName, "/readRanges") == 0)
+		{
+			readRanges = currentSwitch.switchValue;
+		}
 
-		case Z_HUFFMAN_ONLY:
-			printf("Best compression method: Z_HUFFMAN_ONLY\n");
-			break;
+		if ((_stricmp(currentSwitch.switchName, "/pf") == 0) || _stricmp(currentSwitch.switchName, "/prefetch") == 0)
+		{
+			prefetchDepth = currentSwitch.switchValue ? atoi(currentSwitch.switchValue) : 0;
+		}
 
-		case Z_RLE:
-			printf("Best compression method: Z_RLE\n");
-			break;
+		if (_stricmp(currentSwitch.switchName, "/resume") == 0)
+		{
+			options.resume = true;
+		}
 
-		case Z_FIXED:
-			printf("Best compression method: Z_FIXED\n");
-			break;
+		if ((_stricmp(currentSwitch.switchName, "/mlog") == 0) || _stricmp(currentSwitch.switchName, "/metaLog") == 0)
+		{
+			options.metaDataLog = true;
 		}
 
-		// Now run it again so we get the actual data:
+		if (_stricmp(currentSwitch.switchName, "/compact") == 0)
 		{
-			z_stream myZStream = {};
-			const bool deflateResult = deflate_with_strategy(myZStream, bestCompressionMethod, currentChunkSize, chunkData, compressedDataBuffer);
-			if (deflateResult == false)
-			{
-				return 1;
-			}
+			compactMetaData = true;
+		}
 
-			if (myZStream.total_out >= myZStream.total_in)
+		if ((_stricmp(currentSwitch.switchName, "/cp") == 0) || _stricmp(currentSwitch.switchName, "/checkpointInterval") == 0)
+		{
+			if (currentSwitch.switchValue)
 			{
-				printf("Compressed data size is >= input data size.\n");
-				return 1;
+				options.checkpointInterval = atoi(currentSwitch.switchValue);
 			}
 		}
 
-		z_stream myZStream = {};
-		myZStream.zalloc = Z_NULL;
-		myZStream.zfree = Z_NULL;
-		myZStream.opaque = Z_NULL;
-		myZStream.avail_in = currentChunkSize;
-		myZStream.next_in = chunkData;
-		myZStream.avail_out = currentChunkSize;
-		myZStream.next_out = compressedDataBuffer;
-		myZStream.data_type = Z_BINARY;
+		if ((_stricmp(currentSwitch.switchName, "/b") == 0) || _stricmp(currentSwitch.switchName, "/batch") == 0)
+		{
+			batchInputs = currentSwitch.switchValue;
+		}
 
-		int windowBits = 15;
-		int deflateInitReturnVal = deflateInit2(&myZStream, Z_BEST_COMPRESSION, Z_DEFLATED, windowBits, 9, Z_DEFAULT_STRATEGY);
+		if (_stricmp(currentSwitch.switchName, "/serve") == 0)
+		{
+			serveSocketPath = currentSwitch.switchValue;
+		}
+	}
 
-		int deflateReturnVal = deflate(&myZStream, Z_FINISH);
-		if ((deflateReturnVal != Z_STREAM_END) && (deflateReturnVal != Z_OK))
+	if (compactMetaData)
+	{
+		if (outputMetaDataFilePath == nullptr)
 		{
-			printf("An error occurred during deflate.\n");
+			printUsage();
 			return 1;
 		}
 
-		if (myZStream.total_out >= myZStream.total_in)
+		printf("Compacting the metadata log of %s\n", outputMetaDataFilePath);
+		return compactMetaDataFile(outputMetaDataFilePath) ? 0 : 1;
+	}
+
+	if (decompressFileKey)
+	{
+		if ((inputFilePath == nullptr) || (outputFilePath == nullptr) || (outputMetaDataFilePath == nullptr))
 		{
-			printf("Compressed data size is >= input data size.");
+			printUsage();
 			return 1;
 		}
 
-		// Write out some meta data to describe this chunk to JSON:
-		printf("Compressed %d chunk to %d bytes.\n", currentChunkSize, myZStream.total_out);
-		newJsonValue["chunks"][i]["chunk_size_uncompressed"] = currentChunkSize;
-		newJsonValue["chunks"][i]["chunk_size_compressed"] = (unsigned int)myZStream.total_out;
-		newJsonValue["chunks"][i]["deflate_strategy"] = bestCompressionMethod;
+		printf("Restoring %s from %s to %s\n", decompressFileKey, inputFilePath, outputFilePath);
 
-		// Write out compressed data:
-		size_t elementsWritten = fwrite(compressedDataBuffer, myZStream.total_out, 1, outputFileHandle);
-		if (elementsWritten != 1)
+		Json::Value rootJsonValue;
+		bool metaDataFileExists = false;
+		if (!readMetaDataEntry(outputMetaDataFilePath, decompressFileKey, rootJsonValue, metaDataFileExists))
 		{
-			printf("A write error occurred.\n");
 			return 1;
 		}
 
-		// Close Zlib handle:
-		int deflateEndReturnVal = deflateEnd(&myZStream);
-		if (deflateEndReturnVal != Z_OK)
+		if (readRanges)
 		{
-			printf("An error occurred calling deflateEnd().\n");
-			return 1;
+			return readFileRanges(rootJsonValue, decompressFileKey, inputFilePath, outputFilePath, readRanges, options.threads, prefetchDepth) ? 0 : 1;
 		}
 
-		free(compressedDataBuffer);
-		free(chunkData);
+		return decompressFile(rootJsonValue, decompressFileKey, inputFilePath, outputFilePath, options.verbose) ? 0 : 1;
 	}
 
-	// Check for duplicate entries, remove them first:
-
-	if (rootJsonValue.isMember(inputFilePath))
+	if (serveSocketPath)
 	{
-		rootJsonValue.removeMember(inputFilePath);
+		if (options.chunkSize == 0)
+		{
+			printUsage();
+			return 1;
+		}
+
+		printf("Using %s chunk size of %d\n", options.contentDefinedChunking ? "average content defined" : (options.targetCompressedChunks ? "compressed" : "a"), options.chunkSize);
+		return serve(serveSocketPath, options) ? 0 : 1;
 	}
-	rootJsonValue[inputFilePath].append(newJsonValue);
 
-	// Write out Json data:
-	Json::StreamWriterBuilder builder;
-	builder["commentStyle"] = "None";
-	builder["indentation"] = "   ";
+	if (batchInputs)
+	{
+		if ((outputFilePath == nullptr) || (outputMetaDataFilePath == nullptr) || (options.chunkSize == 0))
+		{
+			printUsage();
+			return 1;
+		}
+
+		std::vector<std::string> inputFilePaths;
+		std::vector<std::string> outputFilePaths;
+		if (!listBatchInputs(batchInputs, outputFilePath, inputFilePaths, outputFilePaths))
+		{
+			return 1;
+		}
+
+		printf("Compressing %d files from %s\n", (unsigned int)inputFilePaths.size(), batchInputs);
+		printf("Using %s chunk size of %d\n", options.contentDefinedChunking ? "average content defined" : (options.targetCompressedChunks ? "compressed" : "a"), options.chunkSize);
+		printf("Writing to %s\n", outputFilePath);
+		printf("Writing metadata to %s\n", outputMetaDataFilePath);
 
-	std::unique_ptr<Json::StreamWriter> writer(builder.newStreamWriter());
-	std::ofstream outputFileStream(outputMetaDataFilePath, std::ofstream::out);
-	writer->write(rootJsonValue, &outputFileStream);
+		Compressor compressor(options);
+		return compressor.compressFiles(inputFilePaths, outputFilePaths, outputMetaDataFilePath) ? 0 : 1;
+	}
 
-	fclose(outputFileHandle);
-	fclose(inputFileHandle);
+	// Check required parameters here:
+	if ((inputFilePath == nullptr) || (outputFilePath == nullptr) || (outputMetaDataFilePath == nullptr) || (options.chunkSize == 0))
+	{
+		printUsage();
+		return 1;
+	}
+
+	printf("Opening %s\n", inputFilePath);
+	printf("Using %s chunk size of %d\n", options.contentDefinedChunking ? "average content defined" : (options.targetCompressedChunks ? "compressed" : "a"), options.chunkSize);
+	printf("Writing to %s\n", outputFilePath);
+	printf("Writing metadata to %s\n", outputMetaDataFilePath);
 
-	return 0;
+	Compressor compressor(options);
+	return compressor.compressFile(inputFilePath, outputFilePath, outputMetaDataFilePath) ? 0 : 1;
 }
-	
\ No newline at end of file
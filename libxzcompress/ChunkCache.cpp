@@ -0,0 +1,199 @@
+#include "ChunkCache.h"
+
+ChunkCache::ChunkCache(size_t capacityInBytes, unsigned int shardCount)
+	: capacityInBytes(capacityInBytes), bytesCached(0), nextFileId(0)
+{
+	if (shardCount == 0)
+	{
+		shardCount = 1;
+	}
+
+	for (unsigned int s = 0; s < shardCount; ++s)
+	{
+		shards.emplace_back(new Shard());
+		Shard& shard = *shards.back();
+		shard.hits = shard.misses = shard.waits = shard.failures = shard.evictions = 0;
+	}
+}
+
+uint32_t ChunkCache::getFileId(const std::string& compressedFilePath)
+{
+	std::lock_guard<std::mutex> lock(fileIdsMutex);
+	std::unordered_map<std::string, uint32_t>::const_iterator it = fileIds.find(compressedFilePath);
+	if (it != fileIds.end())
+	{
+		return it->second;
+	}
+
+	const uint32_t fileId = nextFileId++;
+	fileIds[compressedFilePath] = fileId;
+	return fileId;
+}
+
+void ChunkCache::forgetFile(const std::string& compressedFilePath)
+{
+	std::lock_guard<std::mutex> lock(fileIdsMutex);
+	fileIds.erase(compressedFilePath);
+}
+
+ChunkCache::Shard& ChunkCache::getShard(uint64_t key)
+{
+	// Neighbouring chunks go to different shards, so a sequential reader and its neighbours spread out:
+	return *shards[(size_t)((key ^ (key >> 29)) % shards.size())];
+}
+
+CachedChunk ChunkCache::get(uint32_t fileId, uint32_t chunkIndex, const std::function<bool(std::vector<unsigned char>&)>& load, ChunkLookup* lookup)
+{
+	const uint64_t key = ((uint64_t)fileId << 32) | chunkIndex;
+	Shard& shard = getShard(key);
+
+	std::unique_lock<std::mutex> lock(shard.mutex);
+	std::unordered_map<uint64_t, Entry>::iterator it = shard.entries.find(key);
+	if (it != shard.entries.end())
+	{
+		shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lruPosition);
+		shard.hits++;
+		if (lookup)
+		{
+			*lookup = CHUNK_CACHED;
+		}
+		return it->second.chunk;
+	}
+
+	// Someone is already inflating it, wait for them:
+	std::unordered_map<uint64_t, std::shared_ptr<PendingLoad> >::iterator pending = shard.pendingLoads.find(key);
+	if (pending != shard.pendingLoads.end())
+	{
+		std::shared_ptr<PendingLoad> pendingLoad = pending->second;
+		shard.waits++;
+		if (lookup)
+		{
+			*lookup = CHUNK_WAITED;
+		}
+		shard.loaded.wait(lock, [&pendingLoad]() { return pendingLoad->done; });
+		return pendingLoad->chunk;
+	}
+
+	std::shared_ptr<PendingLoad> pendingLoad(new PendingLoad());
+	pendingLoad->done = false;
+	shard.pendingLoads[key] = pendingLoad;
+	shard.misses++;
+	if (lookup)
+	{
+		*lookup = CHUNK_LOADED;
+	}
+	lock.unlock();
+
+	// Loading a chunk can need other chunks (a /pd chunk needs the one before it), so no lock is held here:
+	std::shared_ptr<std::vector<unsigned char> > chunk(new std::vector<unsigned char>());
+	const bool loadedOk = load(*chunk);
+
+	lock.lock();
+	shard.pendingLoads.erase(key);
+	pendingLoad->done = true;
+	if (loadedOk)
+	{
+		pendingLoad->chunk = chunk;
+		insert(shard, key, pendingLoad->chunk);
+	}
+	else
+	{
+		shard.failures++;
+	}
+	shard.loaded.notify_all();
+	return pendingLoad->chunk;
+}
+
+CachedChunk ChunkCache::find(uint32_t fileId, uint32_t chunkIndex)
+{
+	const uint64_t key = ((uint64_t)fileId << 32) | chunkIndex;
+	Shard& shard = getShard(key);
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	std::unordered_map<uint64_t, Entry>::iterator it = shard.entries.find(key);
+	if (it == shard.entries.end())
+	{
+		return CachedChunk();
+	}
+	shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lruPosition);
+	shard.hits++;
+	return it->second.chunk;
+}
+
+void ChunkCache::add(uint32_t fileId, uint32_t chunkIndex, const CachedChunk& chunk)
+{
+	const uint64_t key = ((uint64_t)fileId << 32) | chunkIndex;
+	Shard& shard = getShard(key);
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.misses++;
+	insert(shard, key, chunk);
+}
+
+// Adds a chunk to the front of its shard's list, then evicts from the back of that list until the cache
+// is back under capacity. If that isn't enough (the other shards hold the rest), the oldest chunks of the
+// other shards go too, skipping any shard that's busy rather than waiting on it while holding this one.
+// The new chunk itself is always kept, however big it is. A chunk that's already there (add()ed while
+// get() was loading it too) is left as it is.
+void ChunkCache::insert(Shard& shard, uint64_t key, const CachedChunk& chunk)
+{
+	if (shard.entries.find(key) != shard.entries.end())
+	{
+		return;
+	}
+
+	shard.lru.push_front(key);
+	Entry& entry = shard.entries[key];
+	entry.chunk = chunk;
+	entry.lruPosition = shard.lru.begin();
+	bytesCached += chunk->size();
+
+	evictOldest(shard, 1);
+	for (size_t s = 0; (s < shards.size()) && (bytesCached > capacityInBytes); ++s)
+	{
+		Shard& otherShard = *shards[s];
+		if (&otherShard != &shard)
+		{
+			std::unique_lock<std::mutex> otherLock(otherShard.mutex, std::try_to_lock);
+			if (otherLock.owns_lock())
+			{
+				evictOldest(otherShard, 0);
+			}
+		}
+	}
+}
+
+// Evicts a shard's least recently used chunks while the cache is over capacity, leaving at least keep of them.
+void ChunkCache::evictOldest(Shard& shard, size_t keep)
+{
+	while ((bytesCached > capacityInBytes) && (shard.lru.size() > keep))
+	{
+		std::unordered_map<uint64_t, Entry>::iterator oldest = shard.entries.find(shard.lru.back());
+		bytesCached -= oldest->second.chunk->size();
+		shard.entries.erase(oldest);
+		shard.lru.pop_back();
+		shard.evictions++;
+	}
+}
+
+size_t ChunkCache::getCapacity() const
+{
+	return capacityInBytes;
+}
+
+ChunkCacheStatistics ChunkCache::getStatistics() const
+{
+	ChunkCacheStatistics statistics = {};
+	for (const std::unique_ptr<Shard>& shard : shards)
+	{
+		std::lock_guard<std::mutex> lock(shard->mutex);
+		statistics.hits += shard->hits;
+		statistics.misses += shard->misses;
+		statistics.waits += shard->waits;
+		statistics.failures += shard->failures;
+		statistics.evictions += shard->evictions;
+		statistics.entries += shard->entries.size();
+	}
+	statistics.bytes = bytesCached;
+	return statistics;
+}
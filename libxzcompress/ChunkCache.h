@@ -0,0 +1,109 @@
+#pragma once
+
+// Decompressed chunk cache:
+// Holds inflated chunks for the random access reader, keyed by compressed file and chunk index, up to a
+// total size in bytes. Entries are spread over shards by key, each with its own lock and least recently
+// used list, so lookups from many threads rarely wait on each other. A miss is loaded by the thread that
+// missed, without any lock held; other threads missing on the same chunk meanwhile wait for that load
+// rather than inflating the chunk again.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <list>
+#include <memory>
+#include <string>
+#include <functional>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+typedef std::shared_ptr<const std::vector<unsigned char> > CachedChunk;
+
+// How get() found a chunk:
+enum ChunkLookup
+{
+	CHUNK_CACHED,
+	CHUNK_WAITED, // Another thread was already loading it.
+	CHUNK_LOADED // This thread loaded it.
+};
+
+struct ChunkCacheStatistics
+{
+	uint64_t hits;
+	uint64_t misses; // Each one inflated the chunk.
+	uint64_t waits; // Misses that waited for another thread's load of the same chunk instead.
+	uint64_t failures; // Loads that failed (nothing is cached for them).
+	uint64_t evictions;
+	uint64_t entries;
+	uint64_t bytes;
+};
+
+class ChunkCache
+{
+public:
+	ChunkCache(size_t capacityInBytes, unsigned int shardCount = 16);
+
+	// Every compressed file gets an id to key its chunks with. The same path always gets the same id, so
+	// readers of the same file share its cached chunks.
+	uint32_t getFileId(const std::string& compressedFilePath);
+
+	// For when a compressed file is rewritten: the path gets a new id from now on, so what was cached from
+	// the file as it was is never returned again, it just ages out.
+	void forgetFile(const std::string& compressedFilePath);
+
+	// Returns the chunk, calling load() to fill it in if it isn't cached (or being loaded). Returns null
+	// if load() fails. The chunk stays valid while the caller holds it, even once it's been evicted.
+	CachedChunk get(uint32_t fileId, uint32_t chunkIndex, const std::function<bool(std::vector<unsigned char>&)>& load, ChunkLookup* lookup = nullptr);
+
+	// Returns the chunk if it's cached, otherwise null, without loading it.
+	CachedChunk find(uint32_t fileId, uint32_t chunkIndex);
+
+	// Caches a chunk which was loaded on the way to another one (a /pd chunk's predecessors), unless it
+	// already is.
+	void add(uint32_t fileId, uint32_t chunkIndex, const CachedChunk& chunk);
+
+	size_t getCapacity() const;
+
+	ChunkCacheStatistics getStatistics() const;
+
+private:
+	struct PendingLoad
+	{
+		bool done;
+		CachedChunk chunk;
+	};
+
+	struct Entry
+	{
+		CachedChunk chunk;
+		std::list<uint64_t>::iterator lruPosition;
+	};
+
+	struct Shard
+	{
+		mutable std::mutex mutex;
+		std::condition_variable loaded;
+		std::unordered_map<uint64_t, Entry> entries;
+		std::list<uint64_t> lru; // Most recently used first.
+		std::unordered_map<uint64_t, std::shared_ptr<PendingLoad> > pendingLoads;
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t waits;
+		uint64_t failures;
+		uint64_t evictions;
+	};
+
+	Shard& getShard(uint64_t key);
+	void insert(Shard& shard, uint64_t key, const CachedChunk& chunk);
+	void evictOldest(Shard& shard, size_t keep);
+
+	const size_t capacityInBytes;
+	std::atomic<size_t> bytesCached;
+	std::vector<std::unique_ptr<Shard> > shards;
+
+	std::mutex fileIdsMutex;
+	std::unordered_map<std::string, uint32_t> fileIds;
+	uint32_t nextFileId;
+};
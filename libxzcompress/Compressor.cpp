@@ -0,0 +1,3264 @@
+#include "Compressor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h> // PRId64, SCNd64
+#include <sys/types.h>
+#include <sys/stat.h> // fstat
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <queue>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+
+#ifdef _WIN32
+#include <io.h> // _commit, _chsize_s, _read, _write, _lseeki64
+#else
+#include <unistd.h> // fdatasync, ftruncate, read, write, lseek
+#endif
+
+// External libraries:
+#include <zlib.h>
+
+#include "SimdKernels.h"
+#include "DeflateEncoder.h"
+#include "XZReader.h"
+#include "MetaData.h"
+#include "Parallel.h"
+#include "Sha256.h"
+
+// fseek and ftell use a long, which is only 32 bits on Windows, so anything that
+// can point past 2GB goes through these instead.
+int seekFile(FILE* fh, int64_t offset, int origin)
+{
+#ifdef _WIN32
+	return _fseeki64(fh, offset, origin);
+#else
+	return fseeko(fh, (off_t)offset, origin);
+#endif
+}
+
+int64_t tellFile(FILE* fh)
+{
+#ifdef _WIN32
+	return _ftelli64(fh);
+#else
+	return (int64_t)ftello(fh);
+#endif
+}
+
+int64_t getFileSize(FILE* fh)
+{
+	int returnVal = seekFile(fh, 0, SEEK_END);
+	if (returnVal != 0)
+	{
+		printf("An error occurred during seek.\n");
+		return 0;
+	}
+
+	return tellFile(fh);
+}
+
+void seekToBeginning(FILE* fh)
+{
+	int returnVal = fseek(fh, 0, SEEK_SET);
+	if (returnVal != 0)
+	{
+		printf("An error occurred during seek.\n");
+	}
+}
+
+void seekForwardBy(FILE* fh, int64_t offset)
+{
+	int returnVal = seekFile(fh, offset, SEEK_CUR);
+	if (returnVal != 0)
+	{
+		printf("An error occurred during seek.\n");
+	}
+
+}
+
+FILE* openFileForReadingBinary(const char* inputFilePath)
+{
+	FILE* inputFileHandle = nullptr;
+	{
+		errno_t fopenRetVal = fopen_s(&inputFileHandle, inputFilePath, "r+b");
+		if (fopenRetVal != 0)
+		{
+			printf("Error opening %s for reading.\n", inputFilePath);
+		}
+	}
+	return inputFileHandle;
+}
+
+FILE* openFileForReadingText(const char* inputFilePath)
+{
+	FILE* inputFileHandle = nullptr;
+	{
+		errno_t fopenRetVal = fopen_s(&inputFileHandle, inputFilePath, "r");
+		if (fopenRetVal != 0)
+		{
+			printf("Error opening %s for reading.\n", inputFilePath);
+		}
+	}
+	return inputFileHandle;
+}
+
+FILE* openFileForWritingBinary(const char* outputFilePath)
+{
+	FILE* outputFileHandle = nullptr;
+errno_t fopenRetVal = fopen_s(&outputFileHandle, outputFilePath, "w+b");
+if (fopenRetVal != 0)
+{
+	printf("Error opening %s for writing.\n", outputFilePath);
+}
+return outputFileHandle;
+}
+
+
+FILE* openFileForWritingText(const char* outputFilePath)
+{
+	FILE* outputFileHandle = nullptr;
+	errno_t fopenRetVal = fopen_s(&outputFileHandle, outputFilePath, "w");
+	if (fopenRetVal != 0)
+	{
+		printf("Error opening %s for writing.\n", outputFilePath);
+	}
+	return outputFileHandle;
+}
+
+FILE* openFileForAppendingText(const char* outputFilePath)
+{
+	FILE* outputFileHandle = nullptr;
+	errno_t fopenRetVal = fopen_s(&outputFileHandle, outputFilePath, "a");
+	if (fopenRetVal != 0)
+	{
+		printf("Error opening %s for appending.\n", outputFilePath);
+	}
+	return outputFileHandle;
+}
+
+FILE* openFileForUpdatingBinary(const char* outputFilePath)
+{
+	FILE* outputFileHandle = nullptr;
+	errno_t fopenRetVal = fopen_s(&outputFileHandle, outputFilePath, "r+b");
+	if (fopenRetVal != 0)
+	{
+		printf("Error opening %s for updating.\n", outputFilePath);
+	}
+	return outputFileHandle;
+}
+
+bool fileExists(const char* filePath)
+{
+	FILE* fileHandle = nullptr;
+	if (fopen_s(&fileHandle, filePath, "rb") != 0)
+	{
+		return false;
+	}
+	fclose(fileHandle);
+	return true;
+}
+
+// Flushes stdio's buffers and then asks the OS to put the file's data on disk.
+bool syncFileToDisk(FILE* fh)
+{
+	if (fflush(fh) != 0)
+	{
+		printf("An error occurred during flush.\n");
+		return false;
+	}
+
+#ifdef _WIN32
+	int returnVal = _commit(_fileno(fh));
+#else
+	int returnVal = fdatasync(fileno(fh));
+#endif
+	if (returnVal != 0)
+	{
+		printf("An error occurred during sync.\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool truncateFile(FILE* fh, int64_t size)
+{
+	if (fflush(fh) != 0)
+	{
+		printf("An error occurred during flush.\n");
+		return false;
+	}
+
+#ifdef _WIN32
+	int returnVal = _chsize_s(_fileno(fh), size);
+#else
+	int returnVal = ftruncate(fileno(fh), (off_t)size);
+#endif
+	if (returnVal != 0)
+	{
+		printf("An error occurred during truncate.\n");
+		return false;
+	}
+
+	return true;
+}
+
+// Checkpoint journal:
+// A text file next to the output file ("<output>.journal") which records every chunk once
+// its compressed data is durably on disk. The first line identifies the run, then one line per chunk:
+// <chunk index> <output offset> <compressed size> <uncompressed size> <deflate strategy> <deflate level> <deflate memLevel>
+// <deflateTune good:lazy:nice:chain or -> <crc32 of compressed data> <sha256 or -> <search flags> <codec>
+// A compressed size of 0 marks a deduplicated chunk, which is matched up with its first copy again by hash.
+// Lines are only appended after the output file has been synced, so a torn or missing
+// line just means that chunk (and everything after it) is compressed again on /resume.
+struct JournalEntry
+{
+	unsigned int chunkIndex;
+	int64_t outputOffset;
+	unsigned int chunkSizeCompressed;
+	unsigned int chunkSizeUncompressed;
+	int deflateStrategy;
+	int deflateLevel;
+	int deflateMemLevel;
+	std::string deflateTune; // "good:lazy:nice:chain", empty if not tuned.
+	unsigned long crc;
+	std::string chunkHash; // Empty unless deduplicating.
+	int searchFlags; // SEARCH_ flags.
+	int codec; // ChunkCodec
+};
+
+std::string getJournalFilePath(const char* outputFilePath)
+{
+	return std::string(outputFilePath) + ".journal";
+}
+
+void appendJournalEntry(std::string& pendingJournalText, const JournalEntry& entry)
+{
+	char line[192];
+	snprintf(line, sizeof(line), "%u %" PRId64 " %u %u %d %d %d %s %08lx %s %d %d\n", entry.chunkIndex, entry.outputOffset, entry.chunkSizeCompressed, entry.chunkSizeUncompressed, entry.deflateStrategy, entry.deflateLevel, entry.deflateMemLevel, entry.deflateTune.empty() ? "-" : entry.deflateTune.c_str(), entry.crc, entry.chunkHash.empty() ? "-" : entry.chunkHash.c_str(), entry.searchFlags, entry.codec);
+	pendingJournalText += line;
+}
+
+// Makes the pending journal entries durable. The output file is synced first so that
+// the journal never describes data which isn't on disk yet.
+bool commitJournal(FILE* journalFileHandle, FILE* outputFileHandle, std::string& pendingJournalText)
+{
+	if (pendingJournalText.empty())
+	{
+		return true;
+	}
+
+	if (!syncFileToDisk(outputFileHandle))
+	{
+		return false;
+	}
+
+	size_t elementsWritten = fwrite(pendingJournalText.data(), pendingJournalText.size(), 1, journalFileHandle);
+	if (elementsWritten != 1)
+	{
+		printf("A write error occurred while writing the journal.\n");
+		return false;
+	}
+
+	if (!syncFileToDisk(journalFileHandle))
+	{
+		return false;
+	}
+
+	pendingJournalText.clear();
+	return true;
+}
+
+bool writeJournalHeader(FILE* journalFileHandle, int64_t inputFileSize, unsigned int requestedChunkSize, const std::string& runDescription)
+{
+	fprintf(journalFileHandle, "XZCompress journal %" PRId64 " %u %s\n", inputFileSize, requestedChunkSize, runDescription.c_str());
+	return syncFileToDisk(journalFileHandle);
+}
+
+// Reads back the journal of an interrupted run, keeping only the entries whose
+// compressed data is intact in the output file.
+bool readJournal(const char* journalFilePath, FILE* outputFileHandle, int64_t inputFileSize, unsigned int requestedChunkSize, const std::string& runDescription, std::vector<JournalEntry>& entries)
+{
+	FILE* journalFileHandle = openFileForReadingText(journalFilePath);
+	if (!journalFileHandle)
+	{
+		return false;
+	}
+
+	int64_t journalInputFileSize = 0;
+	unsigned int journalChunkSize = 0;
+	char journalRunDescription[64] = {};
+	if ((fscanf(journalFileHandle, "XZCompress journal %" SCNd64 " %u %63s\n", &journalInputFileSize, &journalChunkSize, journalRunDescription) != 3) ||
+		(journalInputFileSize != inputFileSize) || (journalChunkSize != requestedChunkSize) || (runDescription != journalRunDescription))
+	{
+		printf("The journal %s does not match this input file and chunking.\n", journalFilePath);
+		fclose(journalFileHandle);
+		return false;
+	}
+
+	int64_t outputFileSize = getFileSize(outputFileHandle);
+	int64_t expectedOffset = 0;
+	std::vector<unsigned char> compressedData;
+
+	JournalEntry entry = {};
+	char chunkHash[65] = {};
+	char deflateTune[64] = {};
+	while (fscanf(journalFileHandle, "%u %" SCNd64 " %u %u %d %d %d %63s %lx %64s %d %d\n", &entry.chunkIndex, &entry.outputOffset, &entry.chunkSizeCompressed, &entry.chunkSizeUncompressed, &entry.deflateStrategy, &entry.deflateLevel, &entry.deflateMemLevel, deflateTune, &entry.crc, chunkHash, &entry.searchFlags, &entry.codec) == 12)
+	{
+		entry.deflateTune = (strcmp(deflateTune, "-") == 0) ? "" : deflateTune;
+		entry.chunkHash = (strcmp(chunkHash, "-") == 0) ? "" : chunkHash;
+		if ((entry.chunkSizeCompressed == 0) && entry.chunkHash.empty())
+		{
+			break;
+		}
+
+		if ((entry.chunkIndex != entries.size()) || (entry.outputOffset != expectedOffset) ||
+			(entry.outputOffset + (int64_t)entry.chunkSizeCompressed > outputFileSize))
+		{
+			break;
+		}
+
+		// Check the chunk really made it to disk:
+		compressedData.resize(entry.chunkSizeCompressed);
+		seekFile(outputFileHandle, entry.outputOffset, SEEK_SET);
+		if ((entry.chunkSizeCompressed > 0) && (fread(compressedData.data(), entry.chunkSizeCompressed, 1, outputFileHandle) != 1))
+		{
+			break;
+		}
+
+		if (fastCrc32(0, compressedData.data(), entry.chunkSizeCompressed) != entry.crc)
+		{
+			printf("Chunk %u in the output file does not match the journal, it will be compressed again.\n", entry.chunkIndex + 1);
+			break;
+		}
+
+		entries.push_back(entry);
+		expectedOffset += entry.chunkSizeCompressed;
+	}
+
+	fclose(journalFileHandle);
+	return true;
+}
+
+// Content defined chunking:
+// A Gear rolling hash (as used by FastCDC) is run over the input and a chunk ends where the
+// top bits of the hash are all zero, so boundaries move with the data rather than with file offsets.
+// The hash at a position only depends on the 64 bytes ending there (older bytes are shifted out), which
+// means it can be computed for independent stretches of the input side by side. Normalised chunking
+// uses a stricter mask before the average size and a looser one after it, to keep chunk sizes close to average.
+struct ContentDefinedChunking
+{
+	unsigned int minimumChunkSize;
+	unsigned int averageChunkSize;
+	unsigned int maximumChunkSize;
+	uint64_t strictMask;
+	uint64_t looseMask;
+	uint64_t gearTable[256];
+};
+
+const unsigned int GEAR_WINDOW_SIZE = 64;
+const unsigned int GEAR_LANES = 4;
+const unsigned int GEAR_BLOCK_SIZE = 4096; // Bytes hashed per lane pass, small enough to stay in L1.
+
+bool initContentDefinedChunking(ContentDefinedChunking& cdc, unsigned int minimumChunkSize, unsigned int averageChunkSize, unsigned int maximumChunkSize)
+{
+	if ((minimumChunkSize < GEAR_WINDOW_SIZE) || (minimumChunkSize > averageChunkSize) || (averageChunkSize > maximumChunkSize))
+	{
+		printf("Content defined chunk sizes must satisfy %u <= min <= average <= max.\n", GEAR_WINDOW_SIZE);
+		return false;
+	}
+
+	cdc.minimumChunkSize = minimumChunkSize;
+	cdc.averageChunkSize = averageChunkSize;
+	cdc.maximumChunkSize = maximumChunkSize;
+
+	unsigned int averageBits = 0;
+	while ((2u << averageBits) <= averageChunkSize)
+	{
+		++averageBits;
+	}
+
+	// The top bits of the hash have seen the most input, so the masks use those.
+	// The loose mask is a subset of the strict one.
+	const unsigned int strictBits = (averageBits + 2 < 63) ? averageBits + 2 : 63;
+	const unsigned int looseBits = (averageBits > 3) ? averageBits - 2 : 1;
+	cdc.strictMask = ~0ULL << (64 - strictBits);
+	cdc.looseMask = ~0ULL << (64 - looseBits);
+
+	// The table has to be the same on every run and machine, or boundaries would move.
+	// It's filled from a fixed splitmix64 sequence.
+	uint64_t seed = 0x585A436F6D707265ULL; // "XZCompre"
+	for (unsigned int i = 0; i < 256; ++i)
+	{
+		seed += 0x9E3779B97F4A7C15ULL;
+		uint64_t z = seed;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		cdc.gearTable[i] = z ^ (z >> 31);
+	}
+
+	return true;
+}
+
+// Writes the Gear hash for each position in [begin, begin + length) of data to hashes.
+// The block is split between GEAR_LANES independent hashes that run side by side; each lane
+// starts GEAR_WINDOW_SIZE bytes early so its hashes are identical to a serial pass. Requires begin >= GEAR_WINDOW_SIZE.
+void computeGearHashes(const ContentDefinedChunking& cdc, const unsigned char* data, size_t begin, size_t length, uint64_t* hashes)
+{
+	const size_t laneLength = length / GEAR_LANES;
+	const uint64_t* gear = cdc.gearTable;
+
+	size_t done = 0;
+	if (laneLength > 0)
+	{
+		const unsigned char* lane0 = data + begin - GEAR_WINDOW_SIZE;
+		const unsigned char* lane1 = lane0 + laneLength;
+		const unsigned char* lane2 = lane1 + laneLength;
+		const unsigned char* lane3 = lane2 + laneLength;
+
+		uint64_t h0 = 0, h1 = 0, h2 = 0, h3 = 0;
+		for (size_t j = 0; j < GEAR_WINDOW_SIZE; ++j)
+		{
+			h0 = (h0 << 1) + gear[lane0[j]];
+			h1 = (h1 << 1) + gear[lane1[j]];
+			h2 = (h2 << 1) + gear[lane2[j]];
+			h3 = (h3 << 1) + gear[lane3[j]];
+		}
+		for (size_t j = GEAR_WINDOW_SIZE; j < GEAR_WINDOW_SIZE + laneLength; ++j)
+		{
+			const size_t k = j - GEAR_WINDOW_SIZE;
+			h0 = (h0 << 1) + gear[lane0[j]];
+			h1 = (h1 << 1) + gear[lane1[j]];
+			h2 = (h2 << 1) + gear[lane2[j]];
+			h3 = (h3 << 1) + gear[lane3[j]];
+			hashes[k] = h0;
+			hashes[laneLength + k] = h1;
+			hashes[2 * laneLength + k] = h2;
+			hashes[3 * laneLength + k] = h3;
+		}
+		done = laneLength * GEAR_LANES;
+	}
+
+	// Whatever doesn't divide between the lanes:
+	if (done < length)
+	{
+		uint64_t h = 0;
+		for (size_t j = begin + done - GEAR_WINDOW_SIZE; j < begin + length; ++j)
+		{
+			h = (h << 1) + gear[data[j]];
+			if (j >= begin + done)
+			{
+				hashes[j - begin] = h;
+			}
+		}
+	}
+}
+
+// Returns the length of the chunk starting at data[0], given available bytes of input.
+// If the input ends before a boundary is found, the whole of it is one chunk.
+unsigned int findContentDefinedChunkEnd(const ContentDefinedChunking& cdc, const unsigned char* data, size_t available)
+{
+	if (available <= cdc.minimumChunkSize)
+	{
+		return (unsigned int)available;
+	}
+
+	const size_t end = (available < cdc.maximumChunkSize) ? available : cdc.maximumChunkSize;
+	uint64_t hashes[GEAR_BLOCK_SIZE];
+
+	for (size_t blockBegin = cdc.minimumChunkSize; blockBegin < end; blockBegin += GEAR_BLOCK_SIZE)
+	{
+		const size_t blockLength = (end - blockBegin < GEAR_BLOCK_SIZE) ? end - blockBegin : GEAR_BLOCK_SIZE;
+		computeGearHashes(cdc, data, blockBegin, blockLength, hashes);
+
+		for (size_t k = 0; k < blockLength; ++k)
+		{
+			const size_t position = blockBegin + k;
+			const uint64_t mask = (position < cdc.averageChunkSize) ? cdc.strictMask : cdc.looseMask;
+			if ((hashes[k] & mask) == 0)
+			{
+				return (unsigned int)(position + 1);
+			}
+		}
+	}
+
+	return (unsigned int)end;
+}
+
+// Input window:
+// Chunks are cut from the front of a buffer which is topped up from the input, so content
+// defined chunking can look ahead up to the largest chunk size without reading anything twice.
+bool fillInputWindow(CompressorInput& input, int64_t bytesLeftInFile, std::vector<unsigned char>& inputWindow, size_t& inputWindowFill)
+{
+	size_t bytesToRead = inputWindow.size() - inputWindowFill;
+	if ((int64_t)bytesToRead > bytesLeftInFile)
+	{
+		bytesToRead = (size_t)bytesLeftInFile;
+	}
+
+	if (bytesToRead == 0)
+	{
+		return true;
+	}
+
+	if (!input.read(inputWindow.data() + inputWindowFill, bytesToRead))
+	{
+		printf("A read error occurred.\n");
+		return false;
+	}
+
+	inputWindowFill += bytesToRead;
+	return true;
+}
+
+void consumeInputWindow(std::vector<unsigned char>& inputWindow, size_t& inputWindowFill, size_t bytesConsumed)
+{
+	memmove(inputWindow.data(), inputWindow.data() + bytesConsumed, inputWindowFill - bytesConsumed);
+	inputWindowFill -= bytesConsumed;
+}
+
+// Deduplication:
+// Every stored chunk's SHA-256 goes in the metadata ("chunk_sha256"), along with the compressed file
+// it's in ("compressed_file"). A chunk with the same hash as one already stored is not compressed or
+// written again; its entry has a compressed size of 0 and says where the first copy is
+// ("duplicate_of_chunk", plus "duplicate_of_file" when that's another input's entry). Duplicates keep their
+// hash too, and are checked against it as they're restored. An entry other entries' duplicates point into
+// isn't replaced (ReferencedEntries), as they'd be left pointing at chunks that have gone.
+struct DedupTarget
+{
+	std::string fileKey; // Empty for this file.
+	unsigned int chunkIndex;
+};
+
+// Indexes the stored chunks of every other entry in the metadata, those still kept as chunk records
+// included. Entries written to our own output file are skipped, as that file is about to be replaced.
+void addOtherFilesToDedupIndex(const Json::Value& rootJsonValue, const MetaDataEntries* newEntries, const char* inputFilePath, const char* outputFilePath, std::unordered_map<std::string, DedupTarget>& dedupIndex)
+{
+	if (newEntries)
+	{
+		for (const MetaDataEntries::value_type& newEntry : *newEntries)
+		{
+			const Json::Value& header = newEntry.second.header;
+			if ((newEntry.first == inputFilePath) || !header.isMember("compressed_file") || (header["compressed_file"].asString() == outputFilePath) || header.isMember("dictionary_file"))
+			{
+				continue;
+			}
+
+			const std::vector<ChunkRecord>& chunks = newEntry.second.chunks;
+			for (size_t i = 0; i < chunks.size(); ++i)
+			{
+				if (!chunks[i].chunkHash.empty() && !chunks[i].isDuplicate && !chunks[i].dependsOnPreviousChunk)
+				{
+					dedupIndex.emplace(chunks[i].chunkHash, DedupTarget{ newEntry.first, (unsigned int)i });
+				}
+			}
+		}
+	}
+
+	for (const std::string& fileKey : rootJsonValue.getMemberNames())
+	{
+		if (fileKey == inputFilePath)
+		{
+			continue;
+		}
+
+		// Chunks needing another file's trained dictionary aren't shared either:
+		const Json::Value& entry = rootJsonValue[fileKey][0];
+		if (!entry.isMember("compressed_file") || (entry["compressed_file"].asString() == outputFilePath) || entry.isMember("dictionary_file"))
+		{
+			continue;
+		}
+
+		const Json::Value& chunks = entry["chunks"];
+		for (Json::ArrayIndex i = 0; i < chunks.size(); ++i)
+		{
+			// Chunks that need their predecessor to decompress aren't shared, so a reference to another
+			// file never needs more than the one chunk restored.
+			if (chunks[i].isMember("chunk_sha256") && !chunks[i].isMember("duplicate_of_chunk") && !chunks[i]["depends_on_previous_chunk"].asBool())
+			{
+				dedupIndex.emplace(chunks[i]["chunk_sha256"].asString(), DedupTarget{ fileKey, i });
+			}
+		}
+	}
+}
+
+void recordDuplicateChunk(ChunkRecord& chunkRecord, const DedupTarget& duplicateOf)
+{
+	chunkRecord.chunkSizeCompressed = 0;
+	chunkRecord.isDuplicate = true;
+	chunkRecord.duplicateOfChunk = duplicateOf.chunkIndex;
+	chunkRecord.duplicateOfFile = duplicateOf.fileKey;
+}
+
+// Dictionary priming:
+// Rather than starting from an empty window, a chunk's deflate stream can be given the tail of the
+// uncompressed chunk before it as a preset dictionary, so matches can reach back across the boundary.
+// The dictionary is plain input data, so chunks still don't depend on each other's compressed output,
+// but the decompressor needs the previous chunk restored first ("depends_on_previous_chunk").
+const unsigned int MAXIMUM_DICTIONARY_SIZE = 32768;
+
+bool setDeflateDictionary(z_stream& myZStream, const unsigned char* dictionary, unsigned int dictionaryLength)
+{
+	if (dictionaryLength == 0)
+	{
+		return true;
+	}
+
+	if (deflateSetDictionary(&myZStream, dictionary, dictionaryLength) != Z_OK)
+	{
+		printf("An error occurred calling deflateSetDictionary().\n");
+		return false;
+	}
+
+	return true;
+}
+
+// Dictionary training:
+// For small chunks a shared preset dictionary recovers most of what a cold 32KB window loses.
+// Samples are taken evenly across the input and the dictionary is built from the 64 byte segments
+// that contain the most frequently repeated 8 byte sequences (a simplified form of zstd's COVER
+// algorithm). Once a segment is picked its sequences stop counting, so the dictionary isn't spent on
+// repeats of itself. The best segments go at the end, where deflate's distances are cheapest.
+const unsigned int DICTIONARY_SAMPLE_COUNT = 256;
+const unsigned int DICTIONARY_SAMPLE_SIZE = 16384;
+const unsigned int DICTIONARY_SEGMENT_SIZE = 64;
+const unsigned int DICTIONARY_DMER_SIZE = 8;
+const unsigned int DICTIONARY_HASH_BITS = 20;
+
+static inline uint32_t hashDictionaryDmer(const unsigned char* data)
+{
+	uint64_t dmer = 0;
+	memcpy(&dmer, data, DICTIONARY_DMER_SIZE);
+	return (uint32_t)((dmer * 0x9E3779B97F4A7C15ULL) >> (64 - DICTIONARY_HASH_BITS));
+}
+
+struct DictionarySegment
+{
+	uint64_t score;
+	size_t offset;
+
+	bool operator<(const DictionarySegment& other) const
+	{
+		return score < other.score;
+	}
+};
+
+uint64_t scoreDictionarySegment(const std::vector<unsigned char>& samples, size_t offset, const std::vector<uint32_t>& dmerCounts)
+{
+	uint64_t score = 0;
+	for (size_t i = offset; i + DICTIONARY_DMER_SIZE <= offset + DICTIONARY_SEGMENT_SIZE; ++i)
+	{
+		const uint32_t count = dmerCounts[hashDictionaryDmer(&samples[i])];
+		if (count > 1)
+		{
+			score += count;
+		}
+	}
+	return score;
+}
+
+bool trainDictionary(CompressorInput& input, int64_t inputFileSize, unsigned int requestedChunkSize, std::vector<unsigned char>& dictionary)
+{
+	// Gather the samples:
+	const unsigned int sampleSize = (requestedChunkSize < DICTIONARY_SAMPLE_SIZE) ? requestedChunkSize : DICTIONARY_SAMPLE_SIZE;
+	unsigned int sampleCount = (unsigned int)(inputFileSize / sampleSize);
+	if (sampleCount > DICTIONARY_SAMPLE_COUNT)
+	{
+		sampleCount = DICTIONARY_SAMPLE_COUNT;
+	}
+
+	std::vector<unsigned char> samples((size_t)sampleCount * sampleSize);
+	for (unsigned int i = 0; i < sampleCount; ++i)
+	{
+		const int64_t sampleOffset = (inputFileSize - sampleSize) * i / ((sampleCount > 1) ? sampleCount - 1 : 1);
+		if (!input.seek(sampleOffset) || !input.read(&samples[(size_t)i * sampleSize], sampleSize))
+		{
+			printf("A read error occurred while sampling the input.\n");
+			return false;
+		}
+	}
+
+	// How often does each sequence turn up?
+	std::vector<uint32_t> dmerCounts((size_t)1 << DICTIONARY_HASH_BITS, 0);
+	for (size_t i = 0; i + DICTIONARY_DMER_SIZE <= samples.size(); ++i)
+	{
+		++dmerCounts[hashDictionaryDmer(&samples[i])];
+	}
+
+	// Pick segments greedily. Scores only go down as sequences are used up, so a segment whose
+	// rescored value still beats the next best in the queue is the best one left.
+	std::priority_queue<DictionarySegment> segments;
+	for (size_t offset = 0; offset + DICTIONARY_SEGMENT_SIZE <= samples.size(); offset += DICTIONARY_SEGMENT_SIZE)
+	{
+		segments.push(DictionarySegment{ scoreDictionarySegment(samples, offset, dmerCounts), offset });
+	}
+
+	const size_t dictionarySize = (samples.size() < MAXIMUM_DICTIONARY_SIZE) ? samples.size() - samples.size() % DICTIONARY_SEGMENT_SIZE : MAXIMUM_DICTIONARY_SIZE;
+	dictionary.assign(dictionarySize, 0);
+	size_t dictionaryStart = dictionarySize;
+
+	while ((dictionaryStart >= DICTIONARY_SEGMENT_SIZE) && !segments.empty())
+	{
+		DictionarySegment best = segments.top();
+		segments.pop();
+
+		const uint64_t currentScore = scoreDictionarySegment(samples, best.offset, dmerCounts);
+		if (currentScore == 0)
+		{
+			break;
+		}
+		if (!segments.empty() && (currentScore < segments.top().score))
+		{
+			best.score = currentScore;
+			segments.push(best);
+			continue;
+		}
+
+		dictionaryStart -= DICTIONARY_SEGMENT_SIZE;
+		memcpy(&dictionary[dictionaryStart], &samples[best.offset], DICTIONARY_SEGMENT_SIZE);
+		for (size_t i = best.offset; i + DICTIONARY_DMER_SIZE <= best.offset + DICTIONARY_SEGMENT_SIZE; ++i)
+		{
+			dmerCounts[hashDictionaryDmer(&samples[i])] = 0;
+		}
+	}
+
+	// Nothing worth keeping left, drop the unused front:
+	dictionary.erase(dictionary.begin(), dictionary.begin() + dictionaryStart);
+	return true;
+}
+
+std::string getDictionaryFilePath(const char* outputFilePath)
+{
+	return std::string(outputFilePath) + ".dict";
+}
+
+bool writeDictionaryFile(const char* dictionaryFilePath, const std::vector<unsigned char>& dictionary)
+{
+	FILE* dictionaryFileHandle = openFileForWritingBinary(dictionaryFilePath);
+	if (!dictionaryFileHandle)
+	{
+		return false;
+	}
+
+	bool success = dictionary.empty() || (fwrite(dictionary.data(), dictionary.size(), 1, dictionaryFileHandle) == 1);
+	if (!success)
+	{
+		printf("A write error occurred while writing the dictionary.\n");
+	}
+	success = success && syncFileToDisk(dictionaryFileHandle);
+	fclose(dictionaryFileHandle);
+	return success;
+}
+
+bool readDictionaryFile(const char* dictionaryFilePath, std::vector<unsigned char>& dictionary)
+{
+	FILE* dictionaryFileHandle = openFileForReadingBinary(dictionaryFilePath);
+	if (!dictionaryFileHandle)
+	{
+		return false;
+	}
+
+	dictionary.resize(getFileSize(dictionaryFileHandle));
+	seekToBeginning(dictionaryFileHandle);
+	bool success = dictionary.empty() || (fread(dictionary.data(), dictionary.size(), 1, dictionaryFileHandle) == 1);
+	if (!success)
+	{
+		printf("A read error occurred while reading the dictionary.\n");
+	}
+	fclose(dictionaryFileHandle);
+	return success;
+}
+
+// Deflate parameters:
+// Each chunk is compressed with every candidate combination of codec, level, memLevel and strategy that's
+// still in the search, and the smallest result is kept.
+struct DeflateParameters
+{
+	int level;
+	int memLevel;
+	int strategy;
+
+	// Set by /ultra, overrides the level's match finding (see deflateTune()):
+	bool tuned;
+	int goodLength;
+	int maxLazy;
+	int niceLength;
+	int maxChain;
+
+	int codec; // ChunkCodec
+};
+
+bool applyDeflateTune(z_stream& myZStream, const DeflateParameters& parameters)
+{
+	if (!parameters.tuned)
+	{
+		return true;
+	}
+
+	if (deflateTune(&myZStream, parameters.goodLength, parameters.maxLazy, parameters.niceLength, parameters.maxChain) != Z_OK)
+	{
+		printf("An error occurred calling deflateTune().\n");
+		return false;
+	}
+
+	return true;
+}
+
+// Compresses a chunk with a stream that's ready to start, as deflateInit2() or deflateReset() leaves it.
+bool deflateChunk(z_stream& myZStream, const DeflateParameters& parameters, unsigned int currentChunkSize, const unsigned char* chunkData, unsigned char* compressedDataBuffer, const unsigned char* dictionary, unsigned int dictionaryLength)
+{
+	myZStream.avail_in = currentChunkSize;
+	myZStream.next_in = (Bytef*)chunkData;
+	myZStream.avail_out = currentChunkSize;
+	myZStream.next_out = compressedDataBuffer;
+	myZStream.data_type = Z_BINARY;
+
+	if (!applyDeflateTune(myZStream, parameters) || !setDeflateDictionary(myZStream, dictionary, dictionaryLength))
+	{
+		return false;
+	}
+
+	int deflateReturnVal = deflate(&myZStream, Z_FINISH);
+	if ((deflateReturnVal != Z_STREAM_END) && (deflateReturnVal != Z_OK))
+	{
+		printf("An error occurred during deflate.\n");
+		return false;
+	}
+
+	if (myZStream.total_out >= myZStream.total_in)
+	{
+		//printf("Compressed data size is >= input data size.\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool deflate_with_strategy(z_stream& myZStream, const DeflateParameters& parameters, unsigned int currentChunkSize, const unsigned char* chunkData, unsigned char* compressedDataBuffer, const unsigned char* dictionary, unsigned int dictionaryLength)
+{
+	myZStream.zalloc = Z_NULL;
+	myZStream.zfree = Z_NULL;
+	myZStream.opaque = Z_NULL;
+
+	int windowBits = 15;
+	int deflateInitReturnVal = deflateInit2(&myZStream, parameters.level, Z_DEFLATED, windowBits, parameters.memLevel, parameters.strategy);
+	if (deflateInitReturnVal != Z_OK)
+	{
+		return false;
+	}
+
+	return deflateChunk(myZStream, parameters, currentChunkSize, chunkData, compressedDataBuffer, dictionary, dictionaryLength);
+}
+
+// Deflate stream cache:
+// deflateInit2() allocates and clears a few hundred KB of window and hash tables, which for a small chunk
+// costs more than compressing it. deflateReset() takes a stream back to where deflateInit2() left it
+// (deflateTune() settings included) without either, so a stream is kept for each level, memLevel and
+// strategy the search uses, up to DEFLATE_STREAM_CACHE_SIZE of them, and the least recently used one
+// makes way for a new combination. Streams keep pointers to themselves, so a cache never moves.
+const size_t DEFLATE_STREAM_CACHE_SIZE = 8;
+
+class DeflateStreamCache
+{
+public:
+	DeflateStreamCache()
+		: streamCount(0), useCount(0)
+	{
+	}
+
+	~DeflateStreamCache()
+	{
+		for (size_t s = 0; s < streamCount; ++s)
+		{
+			if (streams[s].initialised)
+			{
+				deflateEnd(&streams[s].stream);
+			}
+		}
+	}
+
+	// A stream ready to compress with parameters, nullptr if zlib couldn't make one.
+	z_stream* get(const DeflateParameters& parameters)
+	{
+		CachedStream* cached = nullptr;
+		for (size_t s = 0; s < streamCount; ++s)
+		{
+			CachedStream& candidate = streams[s];
+			if (candidate.initialised && (candidate.level == parameters.level) && (candidate.memLevel == parameters.memLevel) && (candidate.strategy == parameters.strategy))
+			{
+				candidate.lastUsed = ++useCount;
+				return (deflateReset(&candidate.stream) == Z_OK) ? &candidate.stream : nullptr;
+			}
+			if (!cached || (candidate.lastUsed < cached->lastUsed))
+			{
+				cached = &candidate;
+			}
+		}
+
+		if (streamCount < DEFLATE_STREAM_CACHE_SIZE)
+		{
+			cached = &streams[streamCount++];
+		}
+		else if (cached->initialised)
+		{
+			deflateEnd(&cached->stream);
+		}
+
+		cached->stream = z_stream{};
+		cached->level = parameters.level;
+		cached->memLevel = parameters.memLevel;
+		cached->strategy = parameters.strategy;
+		cached->lastUsed = ++useCount;
+		cached->initialised = (deflateInit2(&cached->stream, parameters.level, Z_DEFLATED, 15, parameters.memLevel, parameters.strategy) == Z_OK);
+		return cached->initialised ? &cached->stream : nullptr;
+	}
+
+private:
+	struct CachedStream
+	{
+		z_stream stream;
+		int level;
+		int memLevel;
+		int strategy;
+		uint64_t lastUsed;
+		bool initialised;
+	};
+
+	DeflateStreamCache(const DeflateStreamCache&);
+	DeflateStreamCache& operator=(const DeflateStreamCache&);
+
+	CachedStream streams[DEFLATE_STREAM_CACHE_SIZE];
+	size_t streamCount;
+	uint64_t useCount;
+};
+
+bool zlibCompress(const DeflateParameters& parameters, unsigned int chunkSize, const unsigned char* chunkData, unsigned char* compressedDataBuffer, const unsigned char* dictionary, unsigned int dictionaryLength, DeflateStreamCache* deflateStreams, unsigned int& compressedDataSize)
+{
+	if (deflateStreams)
+	{
+		z_stream* myZStream = deflateStreams->get(parameters);
+		const bool deflateResult = myZStream && deflateChunk(*myZStream, parameters, chunkSize, chunkData, compressedDataBuffer, dictionary, dictionaryLength);
+		compressedDataSize = myZStream ? (unsigned int)myZStream->total_out : 0;
+		return deflateResult;
+	}
+
+	z_stream myZStream = {};
+	const bool deflateResult = deflate_with_strategy(myZStream, parameters, chunkSize, chunkData, compressedDataBuffer, dictionary, dictionaryLength);
+	deflateEnd(&myZStream);
+	compressedDataSize = (unsigned int)myZStream.total_out;
+	return deflateResult;
+}
+
+// Intra-chunk parallelism (/sbs):
+// A chunk larger than the sub-block size is deflated as raw sub-blocks on several threads. Each is primed
+// with the 32KB before it (deflateSetDictionary()), so matches still reach back across the join, and all
+// but the last end with a sync flush, so they simply concatenate. The zlib header and Adler-32 trailer
+// (adler32_combine() of the sub-blocks') go around them, giving one ordinary zlib stream. A little ratio is
+// lost, each sub-block starts its Huffman codes afresh.
+bool deflateSubBlocks(const DeflateParameters& parameters, unsigned int chunkSize, const unsigned char* chunkData, unsigned char* compressedDataBuffer, const unsigned char* dictionary, unsigned int dictionaryLength, unsigned int subBlockSize, unsigned int threads, unsigned int& compressedDataSize)
+{
+	struct SubBlock
+	{
+		std::vector<unsigned char> compressedData;
+		uLong adler;
+		unsigned int length;
+		bool succeeded;
+	};
+
+	const size_t numSubBlocks = ((size_t)chunkSize + subBlockSize - 1) / subBlockSize;
+	std::vector<SubBlock> subBlocks(numSubBlocks);
+	runInParallel(numSubBlocks, threads, [&](size_t b)
+	{
+		SubBlock& subBlock = subBlocks[b];
+		const unsigned int start = (unsigned int)(b * subBlockSize);
+		const bool last = (b + 1 == numSubBlocks);
+		subBlock.length = last ? chunkSize - start : subBlockSize;
+		subBlock.adler = adler32(adler32(0L, Z_NULL, 0), chunkData + start, subBlock.length);
+
+		// The first sub-block gets the chunk's dictionary, the rest the end of the sub-block before:
+		const unsigned char* subBlockDictionary = (b == 0) ? dictionary : chunkData + start - MAXIMUM_DICTIONARY_SIZE;
+		const unsigned int subBlockDictionaryLength = (b == 0) ? dictionaryLength : MAXIMUM_DICTIONARY_SIZE;
+
+		z_stream myZStream = {};
+		subBlock.succeeded = (deflateInit2(&myZStream, parameters.level, Z_DEFLATED, -MAX_WBITS, parameters.memLevel, parameters.strategy) == Z_OK);
+		if (!subBlock.succeeded)
+		{
+			return;
+		}
+
+		subBlock.compressedData.resize(deflateBound(&myZStream, subBlock.length) + 16);
+		myZStream.next_in = (Bytef*)chunkData + start;
+		myZStream.avail_in = subBlock.length;
+		myZStream.next_out = subBlock.compressedData.data();
+		myZStream.avail_out = (uInt)subBlock.compressedData.size();
+		subBlock.succeeded = applyDeflateTune(myZStream, parameters) && setDeflateDictionary(myZStream, subBlockDictionary, subBlockDictionaryLength) &&
+			(deflate(&myZStream, last ? Z_FINISH : Z_SYNC_FLUSH) == (last ? Z_STREAM_END : Z_OK)) && (myZStream.avail_in == 0);
+		subBlock.compressedData.resize(myZStream.total_out);
+		deflateEnd(&myZStream);
+	});
+
+	// The header, as deflate() writes it (RFC 1950), then the sub-blocks and the trailer:
+	const unsigned int levelFlags = ((parameters.strategy >= Z_HUFFMAN_ONLY) || (parameters.level < 2)) ? 0 : (parameters.level < 6) ? 1 : (parameters.level == 6) ? 2 : 3;
+	unsigned int header = ((Z_DEFLATED + (7 << 4)) << 8) | (levelFlags << 6) | ((dictionaryLength > 0) ? 0x20 : 0);
+	header += 31 - (header % 31);
+
+	size_t totalSize = 2 + ((dictionaryLength > 0) ? 4 : 0) + 4;
+	for (const SubBlock& subBlock : subBlocks)
+	{
+		if (!subBlock.succeeded)
+		{
+			printf("An error occurred during deflate.\n");
+			return false;
+		}
+		totalSize += subBlock.compressedData.size();
+	}
+	compressedDataSize = (totalSize < chunkSize) ? (unsigned int)totalSize : chunkSize;
+	if (totalSize >= chunkSize)
+	{
+		return false;
+	}
+
+	unsigned char* out = compressedDataBuffer;
+	*out++ = (unsigned char)(header >> 8);
+	*out++ = (unsigned char)header;
+	if (dictionaryLength > 0)
+	{
+		const uLong dictionaryAdler = adler32(adler32(0L, Z_NULL, 0), dictionary, dictionaryLength);
+		for (int shift = 24; shift >= 0; shift -= 8)
+		{
+			*out++ = (unsigned char)(dictionaryAdler >> shift);
+		}
+	}
+
+	uLong adler = adler32(0L, Z_NULL, 0);
+	for (const SubBlock& subBlock : subBlocks)
+	{
+		memcpy(out, subBlock.compressedData.data(), subBlock.compressedData.size());
+		out += subBlock.compressedData.size();
+		adler = adler32_combine(adler, subBlock.adler, subBlock.length);
+	}
+	for (int shift = 24; shift >= 0; shift -= 8)
+	{
+		*out++ = (unsigned char)(adler >> shift);
+	}
+	return true;
+}
+
+bool wholeBufferCompress(const DeflateParameters& parameters, unsigned int chunkSize, const unsigned char* chunkData, unsigned char* compressedDataBuffer, const unsigned char* dictionary, unsigned int dictionaryLength, DeflateStreamCache* /* deflateStreams */, unsigned int& compressedDataSize)
+{
+	// As with zlib, the chunk has to get smaller:
+	compressedDataSize = chunkSize;
+	return (chunkSize > 0) && wholeBufferDeflate(chunkData, chunkSize, dictionary, dictionaryLength, parameters.level, parameters.strategy, compressedDataBuffer, chunkSize - 1, compressedDataSize);
+}
+
+bool optimalCompress(const DeflateParameters& parameters, unsigned int chunkSize, const unsigned char* chunkData, unsigned char* compressedDataBuffer, const unsigned char* dictionary, unsigned int dictionaryLength, DeflateStreamCache* /* deflateStreams */, unsigned int& compressedDataSize)
+{
+	compressedDataSize = chunkSize;
+	return (chunkSize > 0) && optimalDeflate(chunkData, chunkSize, dictionary, dictionaryLength, parameters.strategy, compressedDataBuffer, chunkSize - 1, compressedDataSize);
+}
+
+// Compresses a whole chunk into compressedDataBuffer (chunkSize bytes). Fails if it doesn't get smaller.
+// deflateStreams, if there is one, is where zlib's streams come from; the other codecs don't use it.
+typedef bool (*CodecCompressFunction)(const DeflateParameters& parameters, unsigned int chunkSize, const unsigned char* chunkData, unsigned char* compressedDataBuffer, const unsigned char* dictionary, unsigned int dictionaryLength, DeflateStreamCache* deflateStreams, unsigned int& compressedDataSize);
+
+struct Codec
+{
+	const char* name;
+	CodecCompressFunction compress;
+	bool usesLevel;
+	bool usesMemLevel;
+	unsigned int strategies; // A bit for each strategy that means something to it.
+};
+
+const unsigned int ALL_STRATEGIES = (1 << Z_DEFAULT_STRATEGY) | (1 << Z_FILTERED) | (1 << Z_HUFFMAN_ONLY) | (1 << Z_RLE) | (1 << Z_FIXED);
+
+// Indexed by ChunkCodec:
+static const Codec CODECS[] =
+{
+	{ "zlib", zlibCompress, true, true, ALL_STRATEGIES },
+	{ "wholebuffer", wholeBufferCompress, true, false, ALL_STRATEGIES },
+	{ "optimal", optimalCompress, false, false, (1 << Z_DEFAULT_STRATEGY) | (1 << Z_FIXED) },
+};
+
+bool compressWithCodec(const DeflateParameters& parameters, unsigned int chunkSize, const unsigned char* chunkData, unsigned char* compressedDataBuffer, const unsigned char* dictionary, unsigned int dictionaryLength, DeflateStreamCache* deflateStreams, unsigned int& compressedDataSize)
+{
+	return CODECS[parameters.codec].compress(parameters, chunkSize, chunkData, compressedDataBuffer, dictionary, dictionaryLength, deflateStreams, compressedDataSize);
+}
+
+bool findCodec(const char* name, int& codec)
+{
+	for (size_t c = 0; c < sizeof(CODECS) / sizeof(CODECS[0]); ++c)
+	{
+		if (_stricmp(CODECS[c].name, name) == 0)
+		{
+			codec = (int)c;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Target compressed chunk size:
+// Deflates as much of the input as fits in targetCompressedSize bytes of output, in a single pass.
+// Input is fed in steps no bigger than deflate could possibly expand to fill the room that's left
+// (using the same conservative bound as deflateBound()), and each step ends with Z_BLOCK so that
+// total_out plus deflatePending() is exactly what has been produced. Steps shrink as the room runs out.
+const unsigned int TARGET_FINISH_RESERVE = 16; // Final empty block, byte alignment and the adler32 trailer.
+const unsigned int TARGET_MINIMUM_STEP = 256;
+
+unsigned long worstCaseDeflatedSize(unsigned long sourceLength)
+{
+	return sourceLength + ((sourceLength + 7) >> 3) + ((sourceLength + 63) >> 6) + 5;
+}
+
+bool deflate_to_target(z_stream& myZStream, const DeflateParameters& parameters, unsigned int targetCompressedSize, unsigned char* inputData, size_t inputDataSize, unsigned char* compressedDataBuffer, const unsigned char* dictionary, unsigned int dictionaryLength, unsigned int& inputConsumed)
+{
+	myZStream.zalloc = Z_NULL;
+	myZStream.zfree = Z_NULL;
+	myZStream.opaque = Z_NULL;
+	myZStream.avail_in = 0;
+	myZStream.next_in = inputData;
+	myZStream.avail_out = targetCompressedSize;
+	myZStream.next_out = compressedDataBuffer;
+	myZStream.data_type = Z_BINARY;
+
+	int windowBits = 15;
+	int deflateInitReturnVal = deflateInit2(&myZStream, parameters.level, Z_DEFLATED, windowBits, parameters.memLevel, parameters.strategy);
+	if (deflateInitReturnVal != Z_OK)
+	{
+		printf("An error occurred calling deflateInit2().\n");
+		return false;
+	}
+
+	if (!applyDeflateTune(myZStream, parameters) || !setDeflateDictionary(myZStream, dictionary, dictionaryLength))
+	{
+		return false;
+	}
+
+	inputConsumed = 0;
+	while (inputConsumed < inputDataSize)
+	{
+		unsigned int pendingBytes = 0;
+		int pendingBits = 0;
+		deflatePending(&myZStream, &pendingBytes, &pendingBits);
+
+		const unsigned long produced = myZStream.total_out + pendingBytes + (pendingBits + 7) / 8;
+		if (produced + TARGET_FINISH_RESERVE >= targetCompressedSize)
+		{
+			break;
+		}
+		const unsigned long room = targetCompressedSize - TARGET_FINISH_RESERVE - produced;
+
+		// The largest step that's sure to fit:
+		unsigned long step = room - (room >> 3) - (room >> 6);
+		while ((step > 0) && (worstCaseDeflatedSize(step) > room))
+		{
+			step -= (step >> 6) + 1;
+		}
+
+		const size_t inputLeft = inputDataSize - inputConsumed;
+		if (step >= inputLeft)
+		{
+			step = (unsigned long)inputLeft;
+		}
+		else if (step < TARGET_MINIMUM_STEP)
+		{
+			break;
+		}
+
+		myZStream.avail_in = step;
+		int deflateReturnVal = deflate(&myZStream, Z_BLOCK);
+		if ((deflateReturnVal != Z_OK) || (myZStream.avail_in != 0))
+		{
+			printf("An error occurred during deflate.\n");
+			return false;
+		}
+		inputConsumed += step;
+	}
+
+	int deflateReturnVal = deflate(&myZStream, Z_FINISH);
+	if (deflateReturnVal != Z_STREAM_END)
+	{
+		printf("An error occurred during deflate.\n");
+		return false;
+	}
+
+	return true;
+}
+
+// Search space:
+// The candidates are every combination of the requested codecs, levels, memLevels and strategies (that the codec uses). Each keeps
+// a running total of the time it has taken and the bytes it has produced, which is the cost model for
+// /mbps: a candidate can only win a chunk if it compressed that chunk at least that fast, and the
+// candidates tried at all are the ones which save the most bytes per second of compression, up to
+// the total time the target throughput allows. Every SEARCH_CALIBRATION_INTERVAL chunks all of them
+// are tried again, so the choice follows the data.
+// With /bms each chunk's search also has a wall clock budget. Candidates are tried in order of how
+// often they've won so far, and once the budget is spent the best result so far is kept.
+const unsigned int SEARCH_CALIBRATION_INTERVAL = 32;
+
+struct SearchCandidate
+{
+	DeflateParameters parameters;
+	double seconds;
+	uint64_t bytesIn;
+	uint64_t bytesOut;
+	bool inSearch;
+	unsigned int trials;
+	unsigned int wins;
+};
+
+struct CompressionSearch
+{
+	std::vector<SearchCandidate> candidates;
+	double minimumThroughput; // Bytes per second, 0 for no limit.
+	unsigned int chunksSearched;
+	double ultraBudgetSeconds; // Per chunk, 0 unless /ultra.
+	double budgetSeconds; // Per chunk, 0 unless /bms.
+	bool adaptive; // /as
+	size_t previousWinner; // Index of the last chunk's winning candidate, SIZE_MAX if none yet.
+	int lastSearchFlags; // SEARCH_ flags describing the last chunk's search.
+	unsigned int subBlockSize; // 0 unless /sbs.
+	unsigned int subBlockThreads;
+};
+
+// What a thread's chunk searches reuse from one chunk to the next, so they don't allocate once they've seen
+// a chunk as big: the buffers and the deflate streams. The chunk scheduler keeps one for each slot in a
+// batch, compressBuffer() one for each thread.
+struct SearchScratch
+{
+	std::vector<unsigned char> trialCompressedData;
+	std::vector<size_t> searchOrder;
+	std::vector<unsigned char> verifiedChunkData; // /verify
+	DeflateStreamCache deflateStreams;
+};
+
+// Compresses a whole chunk with the candidate's codec, split into parallel sub-blocks if /sbs asks for it
+// (zlib only).
+bool compressForSearch(const CompressionSearch& search, const DeflateParameters& parameters, unsigned int chunkSize, const unsigned char* chunkData, unsigned char* compressedDataBuffer, const unsigned char* dictionary, unsigned int dictionaryLength, DeflateStreamCache* deflateStreams, unsigned int& compressedDataSize)
+{
+	if ((search.subBlockSize > 0) && (chunkSize > search.subBlockSize) && (parameters.codec == CODEC_ZLIB))
+	{
+		return deflateSubBlocks(parameters, chunkSize, chunkData, compressedDataBuffer, dictionary, dictionaryLength, search.subBlockSize, search.subBlockThreads, compressedDataSize);
+	}
+	return compressWithCodec(parameters, chunkSize, chunkData, compressedDataBuffer, dictionary, dictionaryLength, deflateStreams, compressedDataSize);
+}
+
+// How a chunk's search went, these are recorded in the journal too:
+const int SEARCH_BUDGET_TRUNCATED = 1; // /bms stopped it early.
+const int SEARCH_ADAPTIVE_HIT = 2; // /as kept the previous chunk's winner.
+const int SEARCH_ADAPTIVE_MISS = 4; // /as fell back to the full search.
+
+void initCompressionSearch(CompressionSearch& search, const std::vector<int>& codecs, const std::vector<int>& levels, const std::vector<int>& memLevels, const std::vector<int>& strategies, double minimumMegabytesPerSecond)
+{
+	search.candidates.clear();
+	for (int codec : codecs)
+	{
+		// Codecs without a level or memLevel only need trying once:
+		const size_t levelsToTry = CODECS[codec].usesLevel ? levels.size() : 1;
+		for (size_t l = 0; l < levelsToTry; ++l)
+		{
+			const size_t memLevelsToTry = CODECS[codec].usesMemLevel ? memLevels.size() : 1;
+			for (size_t m = 0; m < memLevelsToTry; ++m)
+			{
+				for (int strategy : strategies)
+				{
+					if (!(CODECS[codec].strategies & (1 << strategy)))
+					{
+						continue;
+					}
+
+					SearchCandidate candidate = {};
+					candidate.parameters.codec = codec;
+					candidate.parameters.level = CODECS[codec].usesLevel ? levels[l] : Z_BEST_COMPRESSION;
+					candidate.parameters.memLevel = memLevels[m];
+					candidate.parameters.strategy = strategy;
+					candidate.inSearch = true;
+					search.candidates.push_back(candidate);
+				}
+			}
+		}
+	}
+	search.minimumThroughput = minimumMegabytesPerSecond * 1024.0 * 1024.0;
+	search.chunksSearched = 0;
+	search.ultraBudgetSeconds = 0.0;
+	search.budgetSeconds = 0.0;
+	search.adaptive = false;
+	search.previousWinner = SIZE_MAX;
+	search.lastSearchFlags = 0;
+	search.subBlockSize = 0;
+	search.subBlockThreads = 1;
+}
+
+bool isCalibrationChunk(const CompressionSearch& search)
+{
+	return (search.chunksSearched % SEARCH_CALIBRATION_INTERVAL) == 0;
+}
+
+double getSecondsSince(const std::chrono::steady_clock::time_point& start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The order to try the candidates in: most likely to win first. Candidates which haven't been tried
+// yet rank in the middle, ahead of ones which keep losing. Ties keep their candidate order. It's an
+// insertion sort into the caller's vector, there are only ever a few dozen candidates and std::stable_sort()
+// would allocate a temporary buffer for every chunk.
+void getSearchOrder(const CompressionSearch& search, std::vector<size_t>& order)
+{
+	auto winRate = [&search](size_t c)
+	{
+		const SearchCandidate& candidate = search.candidates[c];
+		return (candidate.wins + 1.0) / (candidate.trials + 2.0);
+	};
+
+	order.resize(search.candidates.size());
+	for (size_t c = 0; c < order.size(); ++c)
+	{
+		const double rate = winRate(c);
+		size_t position = c;
+		while ((position > 0) && (rate > winRate(order[position - 1])))
+		{
+			order[position] = order[position - 1];
+			--position;
+		}
+		order[position] = c;
+	}
+}
+
+// Whether /bms says to stop searching this chunk. At least one candidate is always tried.
+bool isSearchBudgetSpent(CompressionSearch& search, const std::chrono::steady_clock::time_point& chunkStart, bool triedAny)
+{
+	if ((search.budgetSeconds <= 0.0) || !triedAny || (getSecondsSince(chunkStart) < search.budgetSeconds))
+	{
+		return false;
+	}
+
+	search.lastSearchFlags |= SEARCH_BUDGET_TRUNCATED;
+	return true;
+}
+
+bool meetsThroughput(const CompressionSearch& search, double seconds, uint64_t bytesIn)
+{
+	return (search.minimumThroughput <= 0.0) || (bytesIn >= search.minimumThroughput * seconds);
+}
+
+// Chooses the candidates to try from now on. Starting with the fastest, it greedily adds whichever
+// candidate saves the most bytes per extra second, while the total time still meets /mbps.
+void updateSearchCandidates(CompressionSearch& search)
+{
+	const bool calibrated = isCalibrationChunk(search);
+	++search.chunksSearched;
+	if ((search.minimumThroughput <= 0.0) || !calibrated)
+	{
+		return;
+	}
+
+	const double secondsPerByteAllowed = 1.0 / search.minimumThroughput;
+	size_t fastest = 0;
+	for (size_t c = 0; c < search.candidates.size(); ++c)
+	{
+		SearchCandidate& candidate = search.candidates[c];
+		candidate.inSearch = false;
+		if (candidate.bytesIn == 0)
+		{
+			continue;
+		}
+		const SearchCandidate& fastestCandidate = search.candidates[fastest];
+		if ((fastestCandidate.bytesIn == 0) || (candidate.seconds / candidate.bytesIn < fastestCandidate.seconds / fastestCandidate.bytesIn))
+		{
+			fastest = c;
+		}
+	}
+
+	SearchCandidate& fastestCandidate = search.candidates[fastest];
+	if (fastestCandidate.bytesIn == 0)
+	{
+		return;
+	}
+	fastestCandidate.inSearch = true;
+	double secondsPerByte = fastestCandidate.seconds / fastestCandidate.bytesIn;
+	double bestRatio = (double)fastestCandidate.bytesOut / fastestCandidate.bytesIn;
+
+	for (;;)
+	{
+		SearchCandidate* bestValue = nullptr;
+		double bestBytesSavedPerSecond = 0.0;
+		for (SearchCandidate& candidate : search.candidates)
+		{
+			if (candidate.inSearch || (candidate.bytesIn == 0))
+			{
+				continue;
+			}
+
+			const double candidateSecondsPerByte = candidate.seconds / candidate.bytesIn;
+			const double candidateRatio = (double)candidate.bytesOut / candidate.bytesIn;
+			if ((secondsPerByte + candidateSecondsPerByte > secondsPerByteAllowed) || (candidateRatio >= bestRatio))
+			{
+				continue;
+			}
+
+			const double bytesSavedPerSecond = (bestRatio - candidateRatio) / candidateSecondsPerByte;
+			if (bytesSavedPerSecond > bestBytesSavedPerSecond)
+			{
+				bestBytesSavedPerSecond = bytesSavedPerSecond;
+				bestValue = &candidate;
+			}
+		}
+
+		if (!bestValue)
+		{
+			break;
+		}
+
+		bestValue->inSearch = true;
+		secondsPerByte += bestValue->seconds / bestValue->bytesIn;
+		bestRatio = (double)bestValue->bytesOut / bestValue->bytesIn;
+	}
+}
+
+const char* getStrategyName(int strategy)
+{
+	switch (strategy)
+	{
+	case Z_DEFAULT_STRATEGY:
+		return "Z_DEFAULT_STRATEGY";
+
+	case Z_FILTERED:
+		return "Z_FILTERED";
+
+	case Z_HUFFMAN_ONLY:
+		return "Z_HUFFMAN_ONLY";
+
+	case Z_RLE:
+		return "Z_RLE";
+
+	case Z_FIXED:
+		return "Z_FIXED";
+	}
+	return "unknown";
+}
+
+// Reports the winning parameters when verbose. A strategy of -1 means none of them made the chunk smaller, which we can't store.
+bool printCompressionMethod(const DeflateParameters& bestParameters, bool verbose)
+{
+	if (bestParameters.strategy < 0)
+	{
+		printf("Catastrophic error! None of the compression strategies could produce compressed data smaller than the uncompressed data.\n");
+		return false;
+	}
+
+	if (!verbose)
+	{
+		return true;
+	}
+
+	printf("Best compression method: %s, level %d, memLevel %d", getStrategyName(bestParameters.strategy), bestParameters.level, bestParameters.memLevel);
+	if (bestParameters.codec != CODEC_ZLIB)
+	{
+		printf(", codec %s", CODECS[bestParameters.codec].name);
+	}
+	if (bestParameters.tuned)
+	{
+		printf(", tuned %d/%d/%d/%d", bestParameters.goodLength, bestParameters.maxLazy, bestParameters.niceLength, bestParameters.maxChain);
+	}
+	printf("\n");
+	return true;
+}
+
+// Maximum ratio (/ultra):
+// After the normal search, the winner is tried again with deflateTune() settings that search for
+// matches harder than level 9 does: longer hash chains, and never settling for a "good enough" match.
+// They're ordered by cost and stop once the chunk's time budget is spent, or would be by the next one.
+// Huffman only and RLE don't search for matches, so they're left alone.
+struct DeflateTuning
+{
+	int goodLength;
+	int maxLazy;
+	int niceLength;
+	int maxChain;
+};
+
+static const DeflateTuning ULTRA_TUNINGS[] =
+{
+	{ 32, 258, 258, 8192 },
+	{ 258, 258, 258, 8192 },
+	{ 16, 128, 128, 16384 },
+	{ 258, 258, 258, 16384 },
+	{ 8, 32, 258, 32768 },
+	{ 258, 258, 258, 32768 },
+	{ 258, 258, 258, 65535 },
+};
+
+void ultraSearch(const CompressionSearch& search, SearchScratch& scratch, const unsigned char* chunkData, unsigned int chunkSize, const unsigned char* dictionary, unsigned int dictionaryLength, unsigned char* compressedDataBuffer, unsigned int& compressedDataSize, DeflateParameters& bestParameters)
+{
+	if ((search.ultraBudgetSeconds <= 0.0) || (bestParameters.codec != CODEC_ZLIB) || (bestParameters.strategy < 0) || (bestParameters.strategy == Z_HUFFMAN_ONLY) || (bestParameters.strategy == Z_RLE))
+	{
+		return;
+	}
+
+	unsigned char* trialCompressedData = scratch.trialCompressedData.data();
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	double lastTrialSeconds = 0.0;
+	const DeflateParameters untunedParameters = bestParameters;
+
+	for (const DeflateTuning& tuning : ULTRA_TUNINGS)
+	{
+		const double elapsedSeconds = getSecondsSince(start);
+		if (elapsedSeconds + lastTrialSeconds > search.ultraBudgetSeconds)
+		{
+			break;
+		}
+
+		DeflateParameters parameters = untunedParameters;
+		parameters.tuned = true;
+		parameters.goodLength = tuning.goodLength;
+		parameters.maxLazy = tuning.maxLazy;
+		parameters.niceLength = tuning.niceLength;
+		parameters.maxChain = tuning.maxChain;
+
+		unsigned int trialCompressedSize = 0;
+		const bool deflateResult = compressForSearch(search, parameters, chunkSize, chunkData, trialCompressedData, dictionary, dictionaryLength, &scratch.deflateStreams, trialCompressedSize);
+		lastTrialSeconds = getSecondsSince(start) - elapsedSeconds;
+
+		if (deflateResult && (trialCompressedSize < compressedDataSize))
+		{
+			compressedDataSize = trialCompressedSize;
+			bestParameters = parameters;
+			memcpy(compressedDataBuffer, trialCompressedData, compressedDataSize);
+		}
+	}
+}
+
+// The best result so far while searching one chunk. If nothing is fast enough, fall back to the fastest.
+struct ChunkSearchResult
+{
+	unsigned int compressedDataSize;
+	DeflateParameters bestParameters;
+	double fastestSeconds;
+	bool bestMeetsThroughput;
+	SearchCandidate* winner;
+};
+
+// Compresses the whole chunk with one candidate, keeping the output in compressedDataBuffer if it's the best so far.
+void trySearchCandidate(CompressionSearch& search, SearchScratch& scratch, SearchCandidate& candidate, const unsigned char* chunkData, unsigned int chunkSize, const unsigned char* dictionary, unsigned int dictionaryLength, unsigned char* compressedDataBuffer, ChunkSearchResult& result)
+{
+	// Success isn't guaranteed and that's okay..
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	unsigned int trialCompressedSize = 0;
+	unsigned char* trialCompressedData = scratch.trialCompressedData.data();
+	const bool deflateResult = compressForSearch(search, candidate.parameters, chunkSize, chunkData, trialCompressedData, dictionary, dictionaryLength, &scratch.deflateStreams, trialCompressedSize);
+	const double seconds = getSecondsSince(start);
+
+	candidate.seconds += seconds;
+	candidate.trials++;
+	candidate.bytesIn += chunkSize;
+	candidate.bytesOut += deflateResult ? trialCompressedSize : chunkSize;
+	if (!deflateResult)
+	{
+		return;
+	}
+
+	const bool fastEnough = meetsThroughput(search, seconds, chunkSize);
+	const bool better = fastEnough ?
+		(!result.bestMeetsThroughput || (trialCompressedSize < result.compressedDataSize)) :
+		(!result.bestMeetsThroughput && ((result.bestParameters.strategy < 0) || (seconds < result.fastestSeconds)));
+	if (better)
+	{
+		result.compressedDataSize = trialCompressedSize;
+		result.bestParameters = candidate.parameters;
+		result.bestMeetsThroughput = fastEnough;
+		result.fastestSeconds = seconds;
+		result.winner = &candidate;
+		memcpy(compressedDataBuffer, trialCompressedData, result.compressedDataSize);
+	}
+}
+
+// Adaptive search (/as):
+// Neighbouring chunks nearly always pick the same winner, so the previous chunk's winner is run on the
+// whole chunk and the other candidates only on a sample from the start of it (1/16th, at least 32KB).
+// If the previous winner is also the smallest on the sample it wins outright, otherwise the rest of
+// the candidates get a full search as usual. Calibration chunks always get the full search.
+const unsigned int ADAPTIVE_SAMPLE_DIVISOR = 16;
+const unsigned int ADAPTIVE_MINIMUM_SAMPLE = 32 * 1024;
+
+// Whether the previous winner compresses the sample at least as well as every other candidate.
+bool previousWinnerWinsSample(const CompressionSearch& search, SearchScratch& scratch, const unsigned char* chunkData, unsigned int chunkSize, const unsigned char* dictionary, unsigned int dictionaryLength)
+{
+	const unsigned int sampleSize = (chunkSize / ADAPTIVE_SAMPLE_DIVISOR > ADAPTIVE_MINIMUM_SAMPLE) ? chunkSize / ADAPTIVE_SAMPLE_DIVISOR :
+		((chunkSize < ADAPTIVE_MINIMUM_SAMPLE) ? chunkSize : ADAPTIVE_MINIMUM_SAMPLE);
+
+	uLong previousWinnerSize = 0;
+	uLong smallestOtherSize = 0;
+	bool anyOther = false;
+	for (size_t c = 0; c < search.candidates.size(); ++c)
+	{
+		const SearchCandidate& candidate = search.candidates[c];
+		if (!candidate.inSearch && (c != search.previousWinner))
+		{
+			continue;
+		}
+
+		unsigned int trialCompressedSize = 0;
+		const bool deflateResult = compressWithCodec(candidate.parameters, sampleSize, chunkData, scratch.trialCompressedData.data(), dictionary, dictionaryLength, &scratch.deflateStreams, trialCompressedSize);
+		const uLong sampleCompressedSize = deflateResult ? trialCompressedSize : sampleSize;
+
+		if (c == search.previousWinner)
+		{
+			previousWinnerSize = sampleCompressedSize;
+		}
+		else if (!anyOther || (sampleCompressedSize < smallestOtherSize))
+		{
+			smallestOtherSize = sampleCompressedSize;
+			anyOther = true;
+		}
+	}
+
+	return !anyOther || (previousWinnerSize <= smallestOtherSize);
+}
+
+// Compresses a chunk with each candidate in the search and keeps the smallest result in compressedDataBuffer,
+// which must be at least chunkSize bytes. bestParameters.strategy is left at -1 if nothing makes the chunk smaller.
+void compressChunk(CompressionSearch& search, SearchScratch& scratch, const unsigned char* chunkData, unsigned int chunkSize, const unsigned char* dictionary, unsigned int dictionaryLength, unsigned char* compressedDataBuffer, unsigned int& compressedDataSize, DeflateParameters& bestParameters)
+{
+	if (scratch.trialCompressedData.size() < chunkSize)
+	{
+		scratch.trialCompressedData.resize(chunkSize);
+	}
+	const bool calibrating = isCalibrationChunk(search);
+	ChunkSearchResult result = { chunkSize, DeflateParameters{ 0, 0, -1, false, 0, 0, 0, 0, CODEC_ZLIB }, 0.0, false, nullptr };
+	const std::chrono::steady_clock::time_point chunkStart = std::chrono::steady_clock::now();
+	search.lastSearchFlags = 0;
+
+	SearchCandidate* previousWinner = nullptr;
+	if (search.adaptive && !calibrating && (search.previousWinner < search.candidates.size()) && search.candidates[search.previousWinner].inSearch)
+	{
+		previousWinner = &search.candidates[search.previousWinner];
+		trySearchCandidate(search, scratch, *previousWinner, chunkData, chunkSize, dictionary, dictionaryLength, compressedDataBuffer, result);
+		const bool hit = (result.winner == previousWinner) && result.bestMeetsThroughput &&
+			previousWinnerWinsSample(search, scratch, chunkData, chunkSize, dictionary, dictionaryLength);
+		search.lastSearchFlags |= hit ? SEARCH_ADAPTIVE_HIT : SEARCH_ADAPTIVE_MISS;
+	}
+
+	if (!(search.lastSearchFlags & SEARCH_ADAPTIVE_HIT))
+	{
+		getSearchOrder(search, scratch.searchOrder);
+		for (size_t c : scratch.searchOrder)
+		{
+			SearchCandidate& candidate = search.candidates[c];
+			if ((!candidate.inSearch && !calibrating) || (&candidate == previousWinner))
+			{
+				continue;
+			}
+
+			if (isSearchBudgetSpent(search, chunkStart, result.winner != nullptr))
+			{
+				break;
+			}
+
+			trySearchCandidate(search, scratch, candidate, chunkData, chunkSize, dictionary, dictionaryLength, compressedDataBuffer, result);
+		}
+	}
+
+	compressedDataSize = result.compressedDataSize;
+	bestParameters = result.bestParameters;
+	if (result.winner)
+	{
+		result.winner->wins++;
+		search.previousWinner = result.winner - search.candidates.data();
+	}
+	updateSearchCandidates(search);
+	ultraSearch(search, scratch, chunkData, chunkSize, dictionary, dictionaryLength, compressedDataBuffer, compressedDataSize, bestParameters);
+}
+
+// Compresses the start of inputData with each candidate in the search, fitting as much as possible in targetCompressedSize
+// bytes. The candidate which fits the most input wins (then the smallest output), its result is left in
+// compressedDataBuffer (at least targetCompressedSize bytes) and chunkSize is set to the input it covers.
+// As with compressChunk(), bestParameters.strategy is left at -1 if nothing makes the chunk smaller.
+void compressChunkToTarget(CompressionSearch& search, unsigned char* inputData, size_t inputDataSize, unsigned int targetCompressedSize, const unsigned char* dictionary, unsigned int dictionaryLength, unsigned char* compressedDataBuffer, unsigned int& compressedDataSize, unsigned int& chunkSize, DeflateParameters& bestParameters)
+{
+	std::vector<unsigned char> trialCompressedData(targetCompressedSize);
+	const bool calibrating = isCalibrationChunk(search);
+	chunkSize = 0;
+	compressedDataSize = 0;
+	bestParameters = DeflateParameters{ 0, 0, -1, false, 0, 0, 0, 0, CODEC_ZLIB };
+	double fastestSeconds = 0.0;
+	bool bestMeetsThroughput = false;
+	SearchCandidate* winner = nullptr;
+	const std::chrono::steady_clock::time_point chunkStart = std::chrono::steady_clock::now();
+	search.lastSearchFlags = 0;
+
+	std::vector<size_t> searchOrder;
+	getSearchOrder(search, searchOrder);
+	for (size_t c : searchOrder)
+	{
+		SearchCandidate& candidate = search.candidates[c];
+		if ((!candidate.inSearch && !calibrating) || (candidate.parameters.codec != CODEC_ZLIB))
+		{
+			// Only zlib can stop at a compressed size:
+			continue;
+		}
+
+		if (isSearchBudgetSpent(search, chunkStart, winner != nullptr))
+		{
+			break;
+		}
+
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		z_stream myZStream = {};
+		unsigned int inputConsumed = 0;
+		const bool deflateResult = deflate_to_target(myZStream, candidate.parameters, targetCompressedSize, inputData, inputDataSize, trialCompressedData.data(), dictionary, dictionaryLength, inputConsumed);
+		deflateEnd(&myZStream);
+		const double seconds = getSecondsSince(start);
+
+		candidate.seconds += seconds;
+		candidate.trials++;
+		candidate.bytesIn += inputConsumed;
+		candidate.bytesOut += myZStream.total_out;
+
+		// As with fixed size chunks, a chunk has to get smaller to be worth storing:
+		if (!deflateResult || (myZStream.total_out >= inputConsumed))
+		{
+			continue;
+		}
+
+		const bool fastEnough = meetsThroughput(search, seconds, inputConsumed);
+		const bool fitsMore = (inputConsumed > chunkSize) || ((inputConsumed == chunkSize) && (myZStream.total_out < compressedDataSize));
+		const bool better = fastEnough ?
+			(!bestMeetsThroughput || fitsMore) :
+			(!bestMeetsThroughput && ((bestParameters.strategy < 0) || (seconds < fastestSeconds)));
+		if (better)
+		{
+			chunkSize = inputConsumed;
+			compressedDataSize = (unsigned int)myZStream.total_out;
+			bestParameters = candidate.parameters;
+			bestMeetsThroughput = fastEnough;
+			fastestSeconds = seconds;
+			winner = &candidate;
+			memcpy(compressedDataBuffer, trialCompressedData.data(), compressedDataSize);
+		}
+	}
+
+	if (winner)
+	{
+		winner->wins++;
+		search.previousWinner = winner - search.candidates.data();
+	}
+	updateSearchCandidates(search);
+}
+
+// Round trip verification (/verify):
+// Each compressed chunk is inflated again and the CRC-32 of what comes out is checked against the CRC-32
+// of the input chunk, which goes in the meta data ("chunk_crc32"). It's done by the worker that compressed
+// the chunk, while the rest of the batch is still compressing, and before anything is written, so a chunk
+// that doesn't round trip never reaches the output file or the journal.
+bool verifyChunk(SearchScratch& scratch, const unsigned char* compressedData, unsigned int compressedDataSize, unsigned int chunkSize, uint32_t chunkCrc, const unsigned char* dictionary, unsigned int dictionaryLength)
+{
+	std::vector<unsigned char>& chunkData = scratch.verifiedChunkData;
+	if (chunkData.size() < chunkSize)
+	{
+		chunkData.resize(chunkSize);
+	}
+	return inflateChunk(compressedData, compressedDataSize, chunkData.data(), chunkSize, dictionary, dictionaryLength) &&
+		(fastCrc32(0, chunkData.data(), chunkSize) == chunkCrc);
+}
+
+// Chunk scheduler (/t):
+// Chunks are read a batch at a time, one per thread, and compressed at the same time, each with its own
+// copy of the search as it was at the start of the batch. They're then written out in order exactly as
+// one thread would, with what each copy learnt about the candidates added back into the shared search.
+// With /tc a chunk has to be compressed to know where it ends, so the batches are a single chunk. With /sbs
+// the threads go to the sub-blocks of one chunk instead. With compressFiles() a batch carries on into the
+// next input when one runs out, so a lot of small files still keep every thread busy.
+struct CompressionRun;
+
+struct ScheduledChunk
+{
+	CompressionRun* run; // The input it's from.
+	unsigned int chunkIndex;
+	int64_t inputEndOffset;
+	std::vector<unsigned char> data;
+	std::vector<unsigned char> dictionary;
+	std::string chunkHash; // Empty unless deduplicating.
+	bool isDuplicate;
+	DedupTarget duplicateOf;
+	bool needsCompressing; // Not yet compressed and not a duplicate.
+	bool searched; // Whether search needs merging back.
+	uint32_t chunkCrc; // Only with /verify.
+	bool verified;
+
+	CompressionSearch search;
+	std::vector<unsigned char> compressedData;
+	unsigned int compressedDataSize;
+	DeflateParameters bestParameters;
+};
+
+// scratch has one SearchScratch for each chunk in the batch.
+void compressScheduledChunks(std::vector<ScheduledChunk>& batch, SearchScratch* scratch, unsigned int threads, bool verify)
+{
+	runInParallel(batch.size(), threads, [&batch, scratch, verify](size_t c)
+	{
+		ScheduledChunk& chunk = batch[c];
+		if (chunk.needsCompressing)
+		{
+			compressChunk(chunk.search, scratch[c], chunk.data.data(), (unsigned int)chunk.data.size(), chunk.dictionary.data(), (unsigned int)chunk.dictionary.size(), chunk.compressedData.data(), chunk.compressedDataSize, chunk.bestParameters);
+		}
+
+		chunk.verified = false;
+		if (verify)
+		{
+			chunk.chunkCrc = fastCrc32(0, chunk.data.data(), chunk.data.size());
+			if (!chunk.isDuplicate && (chunk.bestParameters.strategy != -1))
+			{
+				chunk.verified = verifyChunk(scratch[c], chunk.compressedData.data(), chunk.compressedDataSize, (unsigned int)chunk.data.size(), chunk.chunkCrc, chunk.dictionary.data(), (unsigned int)chunk.dictionary.size());
+			}
+		}
+	});
+}
+
+// Adds what a chunk's copy of the search learnt since batchStart back into the shared search, as if
+// the chunk had been searched with it directly.
+void mergeChunkSearch(CompressionSearch& search, const CompressionSearch& batchStart, const CompressionSearch& chunkSearch)
+{
+	for (size_t c = 0; c < search.candidates.size(); ++c)
+	{
+		SearchCandidate& candidate = search.candidates[c];
+		const SearchCandidate& before = batchStart.candidates[c];
+		const SearchCandidate& after = chunkSearch.candidates[c];
+		candidate.seconds += after.seconds - before.seconds;
+		candidate.bytesIn += after.bytesIn - before.bytesIn;
+		candidate.bytesOut += after.bytesOut - before.bytesOut;
+		candidate.trials += after.trials - before.trials;
+		candidate.wins += after.wins - before.wins;
+	}
+	search.previousWinner = chunkSearch.previousWinner;
+	search.lastSearchFlags = chunkSearch.lastSearchFlags;
+	updateSearchCandidates(search);
+}
+
+void countSearchFlags(int searchFlags, unsigned int& searchTruncatedChunks, unsigned int& adaptiveSearchHits, unsigned int& adaptiveSearchMisses)
+{
+	searchTruncatedChunks += (searchFlags & SEARCH_BUDGET_TRUNCATED) ? 1 : 0;
+	adaptiveSearchHits += (searchFlags & SEARCH_ADAPTIVE_HIT) ? 1 : 0;
+	adaptiveSearchMisses += (searchFlags & SEARCH_ADAPTIVE_MISS) ? 1 : 0;
+}
+
+// The winning deflateTune() settings, as [good_length, max_lazy, nice_length, max_chain].
+void recordDeflateTune(ChunkRecord& chunkRecord, int goodLength, int maxLazy, int niceLength, int maxChain)
+{
+	chunkRecord.tuned = true;
+	chunkRecord.deflateTune[0] = goodLength;
+	chunkRecord.deflateTune[1] = maxLazy;
+	chunkRecord.deflateTune[2] = niceLength;
+	chunkRecord.deflateTune[3] = maxChain;
+}
+
+
+// Inputs and outputs:
+
+FileInput::FileInput(FILE* fileHandle)
+	: fileHandle(fileHandle)
+{
+}
+
+uint64_t FileInput::getSize()
+{
+	const int64_t position = tellFile(fileHandle);
+	const int64_t size = getFileSize(fileHandle);
+	seekFile(fileHandle, position, SEEK_SET);
+	return (size > 0) ? size : 0;
+}
+
+bool FileInput::read(unsigned char* buffer, size_t length)
+{
+	return (length == 0) || (fread(buffer, length, 1, fileHandle) == 1);
+}
+
+bool FileInput::seek(uint64_t offset)
+{
+	return seekFile(fileHandle, (int64_t)offset, SEEK_SET) == 0;
+}
+
+FileOutput::FileOutput(FILE* fileHandle)
+	: fileHandle(fileHandle)
+{
+}
+
+bool FileOutput::write(const unsigned char* data, size_t length)
+{
+	return (length == 0) || (fwrite(data, length, 1, fileHandle) == 1);
+}
+
+// The most read() and write() are asked for at once, Windows' take an unsigned int.
+const size_t FILE_DESCRIPTOR_IO_SIZE = 1 << 30;
+
+FileDescriptorInput::FileDescriptorInput(int fileDescriptor)
+	: fileDescriptor(fileDescriptor)
+{
+}
+
+uint64_t FileDescriptorInput::getSize()
+{
+#ifdef _WIN32
+	struct _stat64 fileStatus;
+	if (_fstat64(fileDescriptor, &fileStatus) != 0)
+#else
+	struct stat fileStatus;
+	if (fstat(fileDescriptor, &fileStatus) != 0)
+#endif
+	{
+		return 0;
+	}
+
+	return fileStatus.st_size;
+}
+
+bool FileDescriptorInput::read(unsigned char* buffer, size_t length)
+{
+	while (length > 0)
+	{
+		const size_t bytesToRead = (length < FILE_DESCRIPTOR_IO_SIZE) ? length : FILE_DESCRIPTOR_IO_SIZE;
+#ifdef _WIN32
+		const int bytesRead = _read(fileDescriptor, buffer, (unsigned int)bytesToRead);
+#else
+		const ssize_t bytesRead = ::read(fileDescriptor, buffer, bytesToRead);
+		if ((bytesRead < 0) && (errno == EINTR))
+		{
+			continue;
+		}
+#endif
+		if (bytesRead <= 0)
+		{
+			return false;
+		}
+		buffer += bytesRead;
+		length -= bytesRead;
+	}
+	return true;
+}
+
+bool FileDescriptorInput::seek(uint64_t offset)
+{
+#ifdef _WIN32
+	return _lseeki64(fileDescriptor, (__int64)offset, SEEK_SET) == (__int64)offset;
+#else
+	return lseek(fileDescriptor, (off_t)offset, SEEK_SET) == (off_t)offset;
+#endif
+}
+
+FileDescriptorOutput::FileDescriptorOutput(int fileDescriptor)
+	: fileDescriptor(fileDescriptor)
+{
+}
+
+bool FileDescriptorOutput::write(const unsigned char* data, size_t length)
+{
+	while (length > 0)
+	{
+		const size_t bytesToWrite = (length < FILE_DESCRIPTOR_IO_SIZE) ? length : FILE_DESCRIPTOR_IO_SIZE;
+#ifdef _WIN32
+		const int bytesWritten = _write(fileDescriptor, data, (unsigned int)bytesToWrite);
+#else
+		const ssize_t bytesWritten = ::write(fileDescriptor, data, bytesToWrite);
+		if ((bytesWritten < 0) && (errno == EINTR))
+		{
+			continue;
+		}
+#endif
+		if (bytesWritten <= 0)
+		{
+			return false;
+		}
+		data += bytesWritten;
+		length -= bytesWritten;
+	}
+	return true;
+}
+
+MemoryInput::MemoryInput(const unsigned char* data, size_t size)
+	: data(data), size(size), position(0)
+{
+}
+
+uint64_t MemoryInput::getSize()
+{
+	return size;
+}
+
+bool MemoryInput::read(unsigned char* buffer, size_t length)
+{
+	if (length > size - position)
+	{
+		return false;
+	}
+
+	if (length > 0)
+	{
+		memcpy(buffer, data + position, length);
+	}
+	position += length;
+	return true;
+}
+
+bool MemoryInput::seek(uint64_t offset)
+{
+	if (offset > size)
+	{
+		return false;
+	}
+
+	position = (size_t)offset;
+	return true;
+}
+
+MemoryOutput::MemoryOutput(std::vector<unsigned char>& buffer)
+	: buffer(buffer)
+{
+}
+
+bool MemoryOutput::write(const unsigned char* data, size_t length)
+{
+	buffer.insert(buffer.end(), data, data + length);
+	return true;
+}
+
+CallbackInput::CallbackInput(uint64_t size, const ReadCallback& readCallback)
+	: size(size), position(0), readCallback(readCallback)
+{
+}
+
+uint64_t CallbackInput::getSize()
+{
+	return size;
+}
+
+bool CallbackInput::read(unsigned char* buffer, size_t length)
+{
+	if ((length > size - position) || !readCallback(position, buffer, length))
+	{
+		return false;
+	}
+
+	position += length;
+	return true;
+}
+
+bool CallbackInput::seek(uint64_t offset)
+{
+	if (offset > size)
+	{
+		return false;
+	}
+
+	position = offset;
+	return true;
+}
+
+CallbackOutput::CallbackOutput(const WriteCallback& writeCallback)
+	: writeCallback(writeCallback)
+{
+}
+
+bool CallbackOutput::write(const unsigned char* data, size_t length)
+{
+	return writeCallback(data, length);
+}
+
+// Compressor:
+
+// compressFile()'s and compressFiles()' journal, one for each output. writeChunk() appends an entry for
+// every chunk it writes, and commits them every checkpointInterval chunks.
+struct CompressionJournal
+{
+	FILE* journalFileHandle;
+	FILE* outputFileHandle;
+	std::vector<JournalEntry> entries; // Recovered from the interrupted run, already in the output file.
+	std::string pendingText;
+};
+
+// Checks the options go together and works out the chunking. The run description names the chunking
+// and whatever else changes what's written, a journal is only resumed by a run with the same one.
+bool checkCompressorOptions(const CompressorOptions& options, ContentDefinedChunking& cdc, unsigned int& maximumUncompressedChunkSize, std::string& runDescription)
+{
+	const unsigned int requestedChunkSize = options.chunkSize;
+	if (requestedChunkSize == 0)
+	{
+		printf("A chunk size is needed.\n");
+		return false;
+	}
+
+	if ((options.subBlockSize > 0) && (options.subBlockSize < MINIMUM_SUB_BLOCK_SIZE))
+	{
+		printf("/sbs expects a sub-block size of at least %u bytes.\n", MINIMUM_SUB_BLOCK_SIZE);
+		return false;
+	}
+
+	runDescription = "fixed";
+	if (options.contentDefinedChunking)
+	{
+		const unsigned int cdcMinimumChunkSize = (options.cdcMinimumChunkSize != 0) ? options.cdcMinimumChunkSize : requestedChunkSize / 4;
+		const unsigned int cdcMaximumChunkSize = (options.cdcMaximumChunkSize != 0) ? options.cdcMaximumChunkSize : requestedChunkSize * 4;
+		if (!initContentDefinedChunking(cdc, cdcMinimumChunkSize, requestedChunkSize, cdcMaximumChunkSize))
+		{
+			return false;
+		}
+
+		runDescription = "cdc:" + std::to_string(cdcMinimumChunkSize) + ":" + std::to_string(requestedChunkSize) + ":" + std::to_string(cdcMaximumChunkSize);
+	}
+
+	// With /tc, /ch is the compressed size and /cmax caps how much input one chunk can take:
+	maximumUncompressedChunkSize = requestedChunkSize;
+	if (options.targetCompressedChunks)
+	{
+		if (options.contentDefinedChunking)
+		{
+			printf("/tc and /cdc can't be used together.\n");
+			return false;
+		}
+
+		if (requestedChunkSize < TARGET_FINISH_RESERVE + TARGET_MINIMUM_STEP * 2)
+		{
+			printf("The target compressed chunk size must be at least %u.\n", TARGET_FINISH_RESERVE + TARGET_MINIMUM_STEP * 2);
+			return false;
+		}
+
+		if (std::find(options.codecs.begin(), options.codecs.end(), (int)CODEC_ZLIB) == options.codecs.end())
+		{
+			printf("/tc needs the zlib codec in /cd, it's the only one that can stop at a compressed size.\n");
+			return false;
+		}
+
+		maximumUncompressedChunkSize = (options.cdcMaximumChunkSize != 0) ? options.cdcMaximumChunkSize : requestedChunkSize * 16;
+		runDescription = "target:" + std::to_string(maximumUncompressedChunkSize);
+	}
+	else if (options.contentDefinedChunking)
+	{
+		maximumUncompressedChunkSize = cdc.maximumChunkSize;
+	}
+
+	if (options.primeDictionary && options.trainDictionary)
+	{
+		printf("/pd and /td can't be used together.\n");
+		return false;
+	}
+
+	if (options.primeDictionary)
+	{
+		runDescription += "+pd";
+	}
+
+	if (options.trainDictionary)
+	{
+		runDescription += "+td";
+	}
+
+	// Chunks are only journalled once they've been verified, so /resume can only trust a run that verified too:
+	if (options.verify)
+	{
+		runDescription += "+verify";
+	}
+
+	return true;
+}
+
+// Compression runs:
+// Everything about one input while it's being compressed. run() takes a single input from start to finish;
+// compressFiles() has a few in flight at once, as a batch of chunks can reach from the end of one into
+// the next. beginCompressionRun() gets it ready (the dictionary, the journal's chunks), cutChunk()
+// takes the next chunk off its input, writeChunk() writes one once it's compressed, in order, and
+// finishCompressionRun() adds its meta data to the root. Until then each chunk's meta data is only a
+// ChunkRecord; compressFile() and compressFiles() keep it that way and write the records straight out.
+struct CompressionRun
+{
+	CompressorInput* input;
+	CompressorOutput* output;
+	const char* inputKey;
+	const char* compressedFileName;
+	CompressionJournal* journal; // nullptr if there isn't one.
+
+	ContentDefinedChunking cdc;
+	unsigned int maximumUncompressedChunkSize;
+	int64_t inputFileSize;
+	unsigned int numberOfChunks; // With fixed size chunks.
+	std::unordered_map<std::string, DedupTarget> dedupIndex;
+	CompressionSearch search;
+	CompressionSearch batchSearch; // The search as it was when this input's first chunk in the batch was cut.
+	unsigned int chunksToSearch; // This input's chunks in the batch which are searched.
+	std::vector<unsigned char> sharedDictionary; // /td
+	std::vector<unsigned char> previousChunkTail; // /pd
+	std::vector<unsigned char> inputWindow;
+	size_t inputWindowFill;
+	int64_t inputFileOffset;
+	int64_t outputFileOffset;
+	unsigned int nextChunkIndex;
+	unsigned int searchTruncatedChunks;
+	unsigned int adaptiveSearchHits;
+	unsigned int adaptiveSearchMisses;
+	MetaDataEntry entry;
+};
+
+// A chunk's record, which it's given as it's written.
+ChunkRecord& getChunkRecord(CompressionRun& run, unsigned int chunkIndex)
+{
+	if (run.entry.chunks.size() <= chunkIndex)
+	{
+		run.entry.chunks.resize(chunkIndex + 1, ChunkRecord());
+	}
+	return run.entry.chunks[chunkIndex];
+}
+
+// newEntries are the files that have finished and not been written to the meta data file yet, if any.
+bool beginCompressionRun(const CompressorOptions& options, CompressionRun& run, const Json::Value& rootJsonValue, const MetaDataEntries* newEntries)
+{
+	std::string runDescription;
+	if (!checkCompressorOptions(options, run.cdc, run.maximumUncompressedChunkSize, runDescription))
+	{
+		return false;
+	}
+
+	CompressorInput& input = *run.input;
+	const unsigned int requestedChunkSize = options.chunkSize;
+	const bool targetCompressedChunks = options.targetCompressedChunks;
+	const unsigned int threads = (options.threads > 0) ? options.threads : 1;
+	const unsigned int subBlockSize = options.subBlockSize;
+
+	const std::vector<JournalEntry> noJournalEntries;
+	const std::vector<JournalEntry>& journalEntries = run.journal ? run.journal->entries : noJournalEntries;
+
+	run.inputFileSize = (int64_t)input.getSize();
+
+	if (options.dedup)
+	{
+		addOtherFilesToDedupIndex(rootJsonValue, newEntries, run.inputKey, run.compressedFileName, run.dedupIndex);
+	}
+
+	CompressionSearch& search = run.search;
+	initCompressionSearch(search, options.codecs, options.levels, options.memLevels, options.strategies, options.minimumMegabytesPerSecond);
+	search.ultraBudgetSeconds = options.ultraBudgetMilliseconds / 1000.0;
+	search.budgetSeconds = options.searchBudgetMilliseconds / 1000.0;
+	search.adaptive = options.adaptiveSearch;
+	run.searchTruncatedChunks = 0;
+	run.adaptiveSearchHits = 0;
+	run.adaptiveSearchMisses = 0;
+	if (options.adaptiveSearch && targetCompressedChunks)
+	{
+		printf("/as isn't used with /tc, each candidate there decides where the chunk ends.\n");
+	}
+	if ((options.ultraBudgetMilliseconds > 0) && targetCompressedChunks)
+	{
+		printf("/ultra isn't used with /tc, chunk extents there come from the normal search.\n");
+	}
+	if ((threads > 1) && targetCompressedChunks)
+	{
+		printf("/t isn't used with /tc, each chunk has to be compressed before the next one's start is known.\n");
+	}
+	if ((subBlockSize > 0) && targetCompressedChunks)
+	{
+		printf("/sbs isn't used with /tc, a chunk there ends wherever the compressed data fills the target.\n");
+	}
+	search.subBlockSize = targetCompressedChunks ? 0 : subBlockSize;
+	search.subBlockThreads = threads;
+
+	// Build (or, when resuming, reload) the shared dictionary:
+	const std::string dictionaryFilePath = getDictionaryFilePath(run.compressedFileName);
+	if (options.trainDictionary)
+	{
+		if (!journalEntries.empty())
+		{
+			if (!readDictionaryFile(dictionaryFilePath.c_str(), run.sharedDictionary))
+			{
+				printf("Unable to resume without the dictionary the earlier chunks were compressed with.\n");
+				return false;
+			}
+		}
+		else
+		{
+			if (!trainDictionary(input, run.inputFileSize, requestedChunkSize, run.sharedDictionary) ||
+				!writeDictionaryFile(dictionaryFilePath.c_str(), run.sharedDictionary))
+			{
+				return false;
+			}
+		}
+		if (options.verbose)
+		{
+			printf("Using a %d byte dictionary from %s\n", (unsigned int)run.sharedDictionary.size(), dictionaryFilePath.c_str());
+		}
+	}
+
+	// Assuming a chunk size of N, how many chunks is this file going to be?
+	// (With content defined chunking we only know once we're done.)
+	unsigned int chunkSize = requestedChunkSize;
+	unsigned int numberOfWholeChunks = (unsigned int)(run.inputFileSize / chunkSize);
+	unsigned int lastChunkSize = (unsigned int)(run.inputFileSize % chunkSize);
+	run.numberOfChunks = numberOfWholeChunks + (lastChunkSize > 0);
+
+	// So, we now know our chunk sizes, let's compress and write out to disk!
+	Json::Value& newJsonValue = run.entry.header;
+	newJsonValue["xzcompress_version"] = XZCOMPRESS_VERSION;
+	newJsonValue["requested_chunk_size"] = requestedChunkSize;
+	newJsonValue["number_of_chunks"] = run.numberOfChunks;
+	newJsonValue["uncompressed_file_size_in_bytes"] = (Json::Int64)run.inputFileSize;
+	if (options.dedup)
+	{
+		newJsonValue["compressed_file"] = run.compressedFileName;
+	}
+	if (options.contentDefinedChunking)
+	{
+		newJsonValue["chunking"] = "cdc";
+		newJsonValue["cdc_min_chunk_size"] = run.cdc.minimumChunkSize;
+		newJsonValue["cdc_average_chunk_size"] = run.cdc.averageChunkSize;
+		newJsonValue["cdc_max_chunk_size"] = run.cdc.maximumChunkSize;
+	}
+	else if (targetCompressedChunks)
+	{
+		newJsonValue["chunking"] = "target_compressed";
+		newJsonValue["max_chunk_size_uncompressed"] = run.maximumUncompressedChunkSize;
+	}
+	if (options.trainDictionary)
+	{
+		newJsonValue["dictionary_file"] = dictionaryFilePath;
+		newJsonValue["dictionary_adler32"] = (unsigned int)adler32(adler32(0L, Z_NULL, 0), run.sharedDictionary.data(), (unsigned int)run.sharedDictionary.size());
+	}
+
+	// Chunks recovered from the journal are already in the output file, skip past them:
+	run.inputFileOffset = 0;
+	run.outputFileOffset = 0;
+	std::vector<unsigned char> resumedChunkData;
+	for (const JournalEntry& entry : journalEntries)
+	{
+		ChunkRecord& chunkRecord = getChunkRecord(run, entry.chunkIndex);
+		chunkRecord.chunkSizeUncompressed = entry.chunkSizeUncompressed;
+		chunkRecord.chunkHash = entry.chunkHash;
+
+		if (entry.chunkSizeCompressed == 0)
+		{
+			std::unordered_map<std::string, DedupTarget>::const_iterator existing = run.dedupIndex.find(entry.chunkHash);
+			if (existing == run.dedupIndex.end())
+			{
+				printf("Unable to resume, the first copy of deduplicated chunk %d is no longer in the meta data.\n", entry.chunkIndex + 1);
+				return false;
+			}
+			recordDuplicateChunk(chunkRecord, existing->second);
+		}
+		else
+		{
+			chunkRecord.chunkSizeCompressed = entry.chunkSizeCompressed;
+			chunkRecord.deflateStrategy = entry.deflateStrategy;
+			chunkRecord.deflateLevel = entry.deflateLevel;
+			chunkRecord.deflateMemLevel = entry.deflateMemLevel;
+			if ((entry.codec < 0) || (entry.codec >= (int)(sizeof(CODECS) / sizeof(CODECS[0]))))
+			{
+				printf("Unable to resume, chunk %d was made by an unknown codec.\n", entry.chunkIndex + 1);
+				return false;
+			}
+			if (entry.codec != CODEC_ZLIB)
+			{
+				chunkRecord.codec = CODECS[entry.codec].name;
+			}
+			int goodLength = 0, maxLazy = 0, niceLength = 0, maxChain = 0;
+			if (sscanf(entry.deflateTune.c_str(), "%d:%d:%d:%d", &goodLength, &maxLazy, &niceLength, &maxChain) == 4)
+			{
+				recordDeflateTune(chunkRecord, goodLength, maxLazy, niceLength, maxChain);
+			}
+			chunkRecord.searchBudgetTruncated = (entry.searchFlags & SEARCH_BUDGET_TRUNCATED) != 0;
+			countSearchFlags(entry.searchFlags, run.searchTruncatedChunks, run.adaptiveSearchHits, run.adaptiveSearchMisses);
+			chunkRecord.dependsOnPreviousChunk = options.primeDictionary && (entry.chunkIndex > 0);
+			if (!entry.chunkHash.empty())
+			{
+				run.dedupIndex[entry.chunkHash] = DedupTarget{ std::string(), entry.chunkIndex };
+			}
+		}
+
+		if (options.verify)
+		{
+			// The journal doesn't keep the CRC-32 of the input, read the chunk again for it:
+			resumedChunkData.resize(entry.chunkSizeUncompressed);
+			if (!input.seek(run.inputFileOffset) || !input.read(resumedChunkData.data(), entry.chunkSizeUncompressed))
+			{
+				printf("A read error occurred.\n");
+				return false;
+			}
+			chunkRecord.hasCrc = true;
+			chunkRecord.chunkCrc = fastCrc32(0, resumedChunkData.data(), entry.chunkSizeUncompressed);
+		}
+		run.inputFileOffset += entry.chunkSizeUncompressed;
+		run.outputFileOffset += entry.chunkSizeCompressed;
+	}
+
+	if (run.journal)
+	{
+		if (!truncateFile(run.journal->outputFileHandle, run.outputFileOffset))
+		{
+			return false;
+		}
+		seekToBeginning(run.journal->outputFileHandle);
+		seekForwardBy(run.journal->outputFileHandle, run.outputFileOffset);
+	}
+
+	// The end of the last chunk, for /pd. When resuming it's read back from the input:
+	if (options.primeDictionary && !journalEntries.empty())
+	{
+		const unsigned int lastChunkSize = journalEntries.back().chunkSizeUncompressed;
+		run.previousChunkTail.resize((lastChunkSize < MAXIMUM_DICTIONARY_SIZE) ? lastChunkSize : MAXIMUM_DICTIONARY_SIZE);
+		if (!input.seek(run.inputFileOffset - (int64_t)run.previousChunkTail.size()) ||
+			!input.read(run.previousChunkTail.data(), run.previousChunkTail.size()))
+		{
+			printf("A read error occurred.\n");
+			return false;
+		}
+	}
+
+	if (!input.seek(run.inputFileOffset))
+	{
+		printf("An error occurred during seek.\n");
+		return false;
+	}
+
+	run.inputWindow.resize(run.maximumUncompressedChunkSize);
+	run.inputWindowFill = 0;
+	run.nextChunkIndex = (unsigned int)journalEntries.size();
+	return true;
+}
+
+bool hasChunksToCut(const CompressionRun& run)
+{
+	return run.inputFileOffset < run.inputFileSize;
+}
+
+// How many chunks go in a batch.
+unsigned int getBatchSize(const CompressorOptions& options)
+{
+	const unsigned int threads = (options.threads > 0) ? options.threads : 1;
+	return (options.targetCompressedChunks || (options.subBlockSize > 0)) ? 1 : threads;
+}
+
+// Takes the run's next chunk off its input. firstInBatch says it's the run's first chunk in this batch.
+bool cutChunk(const CompressorOptions& options, CompressionRun& run, ScheduledChunk& chunk, bool firstInBatch)
+{
+	if (firstInBatch)
+	{
+		run.batchSearch = run.search;
+		run.chunksToSearch = 0;
+	}
+
+	const unsigned int requestedChunkSize = options.chunkSize;
+	const bool targetCompressedChunks = options.targetCompressedChunks;
+	if (!fillInputWindow(*run.input, run.inputFileSize - run.inputFileOffset - (int64_t)run.inputWindowFill, run.inputWindow, run.inputWindowFill))
+	{
+		return false;
+	}
+
+	chunk.run = &run;
+	chunk.chunkIndex = run.nextChunkIndex++;
+	chunk.dictionary = options.trainDictionary ? run.sharedDictionary : run.previousChunkTail;
+	chunk.search = run.batchSearch;
+	chunk.search.chunksSearched += run.chunksToSearch;
+	chunk.compressedData.resize(targetCompressedChunks ? requestedChunkSize : 0);
+	chunk.compressedDataSize = 0;
+	chunk.bestParameters = DeflateParameters{ 0, 0, -1, false, 0, 0, 0, 0, CODEC_ZLIB };
+	unsigned int currentChunkSize = (unsigned int)run.inputWindowFill;
+	if (options.contentDefinedChunking)
+	{
+		currentChunkSize = findContentDefinedChunkEnd(run.cdc, run.inputWindow.data(), run.inputWindowFill);
+	}
+	else if (targetCompressedChunks)
+	{
+		// The chunk is however much input fits under the target, so it has to be compressed to know where it ends:
+		compressChunkToTarget(chunk.search, run.inputWindow.data(), run.inputWindowFill, requestedChunkSize, chunk.dictionary.data(), (unsigned int)chunk.dictionary.size(), chunk.compressedData.data(), chunk.compressedDataSize, currentChunkSize, chunk.bestParameters);
+	}
+	if (!targetCompressedChunks)
+	{
+		chunk.compressedData.resize(currentChunkSize);
+	}
+	chunk.data.assign(run.inputWindow.data(), run.inputWindow.data() + currentChunkSize);
+	chunk.inputEndOffset = run.inputFileOffset + currentChunkSize;
+
+	// Have we already stored this content, earlier in this file or in another one?
+	chunk.isDuplicate = false;
+	chunk.chunkHash.clear();
+	if (options.dedup)
+	{
+		chunk.chunkHash = sha256ToHex(chunk.data.data(), currentChunkSize);
+		std::unordered_map<std::string, DedupTarget>::const_iterator existing = run.dedupIndex.find(chunk.chunkHash);
+		if (existing != run.dedupIndex.end())
+		{
+			chunk.isDuplicate = true;
+			chunk.duplicateOf = existing->second;
+		}
+		else
+		{
+			run.dedupIndex[chunk.chunkHash] = DedupTarget{ std::string(), chunk.chunkIndex };
+		}
+	}
+	chunk.needsCompressing = !chunk.isDuplicate && !targetCompressedChunks;
+	chunk.searched = chunk.needsCompressing || targetCompressedChunks;
+	run.chunksToSearch += chunk.needsCompressing ? 1 : 0;
+
+	if (options.primeDictionary)
+	{
+		const unsigned int tailLength = (currentChunkSize < MAXIMUM_DICTIONARY_SIZE) ? currentChunkSize : MAXIMUM_DICTIONARY_SIZE;
+		run.previousChunkTail.assign(chunk.data.end() - tailLength, chunk.data.end());
+	}
+	consumeInputWindow(run.inputWindow, run.inputWindowFill, currentChunkSize);
+	run.inputFileOffset += currentChunkSize;
+	return true;
+}
+
+// Writes a compressed chunk to the run's output, records it in the meta data and the journal.
+bool writeChunk(const CompressorOptions& options, CompressionRun& run, ScheduledChunk& chunk)
+{
+	const unsigned int i = chunk.chunkIndex;
+	const unsigned int currentChunkSize = (unsigned int)chunk.data.size();
+	if (options.verbose)
+	{
+		if (options.contentDefinedChunking)
+		{
+			printf("Chunk %d (%" PRId64 " of %" PRId64 " bytes)\n", i+1, chunk.inputEndOffset, run.inputFileSize);
+		}
+		else if (options.targetCompressedChunks)
+		{
+			printf("Chunk %d\n", i+1);
+		}
+		else
+		{
+			printf("Chunk %d of %d\n", i+1, run.numberOfChunks);
+		}
+	}
+
+	if (chunk.searched)
+	{
+		mergeChunkSearch(run.search, run.batchSearch, chunk.search);
+	}
+
+	const DeflateParameters& bestParameters = chunk.bestParameters;
+	unsigned int compressedDataSize = chunk.compressedDataSize;
+	ChunkRecord& chunkRecord = getChunkRecord(run, i);
+	chunkRecord.chunkSizeUncompressed = currentChunkSize;
+	if (chunk.isDuplicate)
+	{
+		// Nothing to compress or write, just point at the first copy:
+		if (options.verbose)
+		{
+			printf("Chunk is a duplicate of chunk %d%s%s.\n", chunk.duplicateOf.chunkIndex + 1, chunk.duplicateOf.fileKey.empty() ? "" : " of ", chunk.duplicateOf.fileKey.c_str());
+		}
+		recordDuplicateChunk(chunkRecord, chunk.duplicateOf);
+		compressedDataSize = 0;
+	}
+	else
+	{
+		if (!printCompressionMethod(bestParameters, options.verbose))
+		{
+			return false;
+		}
+
+		if (options.verify && !chunk.verified)
+		{
+			printf("Chunk %d did not decompress to its input, stopping before it is written.\n", i+1);
+			return false;
+		}
+
+		// Write out some meta data to describe this chunk to JSON:
+		if (options.verbose)
+		{
+			printf("Compressed %d chunk to %d bytes.\n", currentChunkSize, compressedDataSize);
+		}
+		chunkRecord.chunkSizeCompressed = compressedDataSize;
+		chunkRecord.deflateStrategy = bestParameters.strategy;
+		chunkRecord.deflateLevel = bestParameters.level;
+		chunkRecord.deflateMemLevel = bestParameters.memLevel;
+		if (bestParameters.codec != CODEC_ZLIB)
+		{
+			chunkRecord.codec = CODECS[bestParameters.codec].name;
+		}
+		if (bestParameters.tuned)
+		{
+			recordDeflateTune(chunkRecord, bestParameters.goodLength, bestParameters.maxLazy, bestParameters.niceLength, bestParameters.maxChain);
+		}
+		chunkRecord.dependsOnPreviousChunk = options.primeDictionary && !chunk.dictionary.empty();
+		chunkRecord.searchBudgetTruncated = (chunk.search.lastSearchFlags & SEARCH_BUDGET_TRUNCATED) != 0;
+		countSearchFlags(chunk.search.lastSearchFlags, run.searchTruncatedChunks, run.adaptiveSearchHits, run.adaptiveSearchMisses);
+
+		// Write out compressed data:
+		if (!run.output->write(chunk.compressedData.data(), compressedDataSize))
+		{
+			printf("A write error occurred.\n");
+			return false;
+		}
+	}
+
+	if (options.dedup)
+	{
+		chunkRecord.chunkHash = chunk.chunkHash;
+	}
+	if (options.verify)
+	{
+		chunkRecord.hasCrc = true;
+		chunkRecord.chunkCrc = chunk.chunkCrc;
+	}
+
+	// Record the chunk in the journal, and make a batch of them durable every so often:
+	JournalEntry journalEntry = {};
+	journalEntry.chunkIndex = i;
+	journalEntry.outputOffset = run.outputFileOffset;
+	journalEntry.chunkSizeCompressed = compressedDataSize;
+	journalEntry.chunkSizeUncompressed = currentChunkSize;
+	journalEntry.deflateStrategy = bestParameters.strategy;
+	journalEntry.deflateLevel = bestParameters.level;
+	journalEntry.deflateMemLevel = bestParameters.memLevel;
+	if (bestParameters.tuned)
+	{
+		journalEntry.deflateTune = std::to_string(bestParameters.goodLength) + ":" + std::to_string(bestParameters.maxLazy) + ":" + std::to_string(bestParameters.niceLength) + ":" + std::to_string(bestParameters.maxChain);
+	}
+	journalEntry.crc = run.journal ? fastCrc32(0, chunk.compressedData.data(), compressedDataSize) : 0;
+	journalEntry.chunkHash = chunk.chunkHash;
+	journalEntry.searchFlags = (compressedDataSize > 0) ? chunk.search.lastSearchFlags : 0;
+	journalEntry.codec = (compressedDataSize > 0) ? bestParameters.codec : CODEC_ZLIB;
+	run.outputFileOffset += compressedDataSize;
+	if (run.journal)
+	{
+		const unsigned int checkpointInterval = (options.checkpointInterval > 0) ? options.checkpointInterval : 1;
+		appendJournalEntry(run.journal->pendingText, journalEntry);
+		if ((((i + 1) % checkpointInterval) == 0) && !commitJournal(run.journal->journalFileHandle, run.journal->outputFileHandle, run.journal->pendingText))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Once every chunk is written: the summary, the last of the journal and the run's entry in the meta data.
+// With newEntries, the entry goes there, chunk records and all, and any earlier one is taken out of the root.
+bool finishCompressionRun(const CompressorOptions& options, CompressionRun& run, Json::Value& rootJsonValue, MetaDataEntries* newEntries)
+{
+	Json::Value& newJsonValue = run.entry.header;
+	newJsonValue["number_of_chunks"] = (Json::ArrayIndex)run.entry.chunks.size();
+	if (run.search.subBlockSize > 0)
+	{
+		newJsonValue["sub_block_size"] = run.search.subBlockSize;
+	}
+	if (options.searchBudgetMilliseconds > 0)
+	{
+		newJsonValue["search_budget_ms"] = options.searchBudgetMilliseconds;
+		newJsonValue["search_budget_truncated_chunks"] = run.searchTruncatedChunks;
+	}
+	if (options.adaptiveSearch && !options.targetCompressedChunks)
+	{
+		newJsonValue["search_adaptive_hits"] = run.adaptiveSearchHits;
+		newJsonValue["search_adaptive_misses"] = run.adaptiveSearchMisses;
+		if (options.verbose)
+		{
+			printf("Adaptive search kept the previous winner for %u of %u chunks.\n", run.adaptiveSearchHits, run.adaptiveSearchHits + run.adaptiveSearchMisses);
+		}
+	}
+
+	// Everything is compressed, make the last few chunks durable before the metadata is written:
+	if (run.journal && !commitJournal(run.journal->journalFileHandle, run.journal->outputFileHandle, run.journal->pendingText))
+	{
+		return false;
+	}
+
+	// Replace any earlier entry for this input:
+	if (rootJsonValue.isMember(run.inputKey))
+	{
+		rootJsonValue.removeMember(run.inputKey);
+	}
+	if (newEntries)
+	{
+		(*newEntries)[run.inputKey] = std::move(run.entry);
+		return true;
+	}
+
+	for (const ChunkRecord& chunkRecord : run.entry.chunks)
+	{
+		appendChunkRecord(chunkRecord, newJsonValue["chunks"]);
+	}
+	rootJsonValue[run.inputKey].append(newJsonValue);
+
+	return true;
+}
+
+// The files compressFile() and compressFiles() compress an input from and to, and its journal.
+struct CompressionFiles
+{
+	FILE* inputFileHandle;
+	FILE* outputFileHandle;
+	CompressionJournal journal;
+	std::string journalFilePath;
+};
+
+// Opens the input and output files and starts the journal, reading back the one an interrupted run left if resuming.
+bool openCompressionFiles(const std::string& runDescription, unsigned int requestedChunkSize, bool resume, bool verbose, const char* inputFilePath, const char* outputFilePath, CompressionFiles& files)
+{
+	// Open input file:
+	files.inputFileHandle = openFileForReadingBinary(inputFilePath);
+	if (!files.inputFileHandle)
+	{
+		return false;
+	}
+
+	// How big is our input file?
+	int64_t inputFileSize = getFileSize(files.inputFileHandle);
+
+	// Open output file. When resuming, keep what is already there:
+	files.outputFileHandle = resume ? openFileForUpdatingBinary(outputFilePath) : openFileForWritingBinary(outputFilePath);
+	if (!files.outputFileHandle)
+	{
+		return false;
+	}
+
+	files.journal.outputFileHandle = files.outputFileHandle;
+	files.journalFilePath = getJournalFilePath(outputFilePath);
+	if (resume)
+	{
+		if (!readJournal(files.journalFilePath.c_str(), files.outputFileHandle, inputFileSize, requestedChunkSize, runDescription, files.journal.entries))
+		{
+			printf("Unable to resume, run again without /resume.\n");
+			return false;
+		}
+		if (verbose)
+		{
+			printf("Resuming after %d chunks.\n", (unsigned int)files.journal.entries.size());
+		}
+	}
+
+	// (Re)write the journal so it only holds the entries we trust. It's written next to the old one and
+	// renamed over it once it's on disk, so stopping part way through still leaves a journal to resume from:
+	const std::string temporaryJournalFilePath = files.journalFilePath + ".tmp";
+	FILE* temporaryJournalFileHandle = openFileForWritingText(temporaryJournalFilePath.c_str());
+	if (!temporaryJournalFileHandle)
+	{
+		return false;
+	}
+
+	for (const JournalEntry& entry : files.journal.entries)
+	{
+		appendJournalEntry(files.journal.pendingText, entry);
+	}
+
+	bool written = writeJournalHeader(temporaryJournalFileHandle, inputFileSize, requestedChunkSize, runDescription) &&
+		commitJournal(temporaryJournalFileHandle, files.outputFileHandle, files.journal.pendingText);
+	written = (fclose(temporaryJournalFileHandle) == 0) && written;
+	if (!written || !replaceFile(temporaryJournalFilePath.c_str(), files.journalFilePath.c_str()))
+	{
+		remove(temporaryJournalFilePath.c_str());
+		return false;
+	}
+
+	// Windows won't rename a file that's open, so the journal is only opened to carry on appending now:
+	files.journal.journalFileHandle = openFileForAppendingText(files.journalFilePath.c_str());
+	return files.journal.journalFileHandle != nullptr;
+}
+
+// The journal is left where it is, it's only removed once the meta data has been written.
+void closeCompressionFiles(CompressionFiles& files)
+{
+	if (files.outputFileHandle)
+	{
+		fclose(files.outputFileHandle);
+		files.outputFileHandle = nullptr;
+	}
+	if (files.inputFileHandle)
+	{
+		fclose(files.inputFileHandle);
+		files.inputFileHandle = nullptr;
+	}
+	if (files.journal.journalFileHandle)
+	{
+		fclose(files.journal.journalFileHandle);
+		files.journal.journalFileHandle = nullptr;
+	}
+}
+
+// One of compressFiles()' inputs, from when it's opened until it's finished.
+struct BatchFile
+{
+	CompressionFiles files;
+	std::unique_ptr<FileInput> input;
+	std::unique_ptr<FileOutput> output;
+	CompressionRun run;
+};
+
+// compressBuffer():
+// What's kept from one object to the next: the chunking, the search (so what it learns about the
+// candidates carries over from object to object), a SearchScratch for each thread and the batch.
+struct BufferChunk
+{
+	CompressionSearch search;
+	const unsigned char* dictionary; // /pd, the end of the chunk before in the caller's buffer.
+	unsigned int dictionaryLength;
+	unsigned int compressedDataSize;
+	DeflateParameters bestParameters;
+	bool verified;
+};
+
+struct BufferCompressionState
+{
+	ContentDefinedChunking cdc;
+	CompressionSearch search;
+	CompressionSearch batchSearch; // The search as it was when the batch started.
+	unsigned int threads;
+	std::unique_ptr<SearchScratch[]> scratch;
+	std::vector<BufferChunk> batch;
+	std::unique_ptr<WorkerPool> workers; // With /t, started by the first call.
+};
+
+Compressor::Compressor(const CompressorOptions& options)
+	: options(options)
+{
+}
+
+Compressor::~Compressor()
+{
+}
+
+const CompressorOptions& Compressor::getOptions() const
+{
+	return options;
+}
+
+bool Compressor::compressFile(const char* inputFilePath, const char* outputFilePath, const char* metaDataFilePath)
+{
+	// The run description is needed for the journal before anything is compressed:
+	ContentDefinedChunking cdc = {};
+	unsigned int maximumUncompressedChunkSize = 0;
+	std::string runDescription;
+	if (!checkCompressorOptions(options, cdc, maximumUncompressedChunkSize, runDescription))
+	{
+		return false;
+	}
+
+	// Does the metadata file already exist? If it does, populate our JSON data. It's read even when appending
+	// to the log, as the file's entry can only be replaced if no other entry's chunks point into it:
+	const bool useMetaDataLog = options.metaDataLog || metaDataLogExists(metaDataFilePath);
+	Json::Value rootJsonValue;
+	bool metaDataFileExists = false;
+	if (!readMetaDataFile(metaDataFilePath, rootJsonValue, metaDataFileExists))
+	{
+		return false;
+	}
+	ReferencedEntries referencedEntries;
+	addReferencedEntries(rootJsonValue, referencedEntries);
+	if (!checkEntryIsUnreferenced(referencedEntries, inputFilePath))
+	{
+		return false;
+	}
+	MetaDataEntries newEntries;
+
+	CompressionFiles files = {};
+	bool success = openCompressionFiles(runDescription, options.chunkSize, options.resume, options.verbose, inputFilePath, outputFilePath, files);
+
+	if (success)
+	{
+		FileInput input(files.inputFileHandle);
+		FileOutput output(files.outputFileHandle);
+		success = run(input, output, inputFilePath, outputFilePath, rootJsonValue, &files.journal, &newEntries);
+	}
+
+	if (success && !updateMetaDataFile(metaDataFilePath, rootJsonValue, newEntries, useMetaDataLog))
+	{
+		printf("The journal has been kept so the run can be resumed.\n");
+		success = false;
+	}
+
+	closeCompressionFiles(files);
+
+	// The metadata is complete, so the journal is no longer needed:
+	if (success)
+	{
+		remove(files.journalFilePath.c_str());
+	}
+
+	return success;
+}
+
+bool Compressor::compressFiles(const std::vector<std::string>& inputFilePaths, const std::vector<std::string>& outputFilePaths, const char* metaDataFilePath)
+{
+	ContentDefinedChunking cdc = {};
+	unsigned int maximumUncompressedChunkSize = 0;
+	std::string runDescription;
+	if (!checkCompressorOptions(options, cdc, maximumUncompressedChunkSize, runDescription))
+	{
+		return false;
+	}
+
+	if (inputFilePaths.size() != outputFilePaths.size())
+	{
+		printf("Every input file needs an output file.\n");
+		return false;
+	}
+
+	const bool useMetaDataLog = options.metaDataLog || metaDataLogExists(metaDataFilePath);
+	Json::Value rootJsonValue;
+	bool metaDataFileExists = false;
+	if (!readMetaDataFile(metaDataFilePath, rootJsonValue, metaDataFileExists))
+	{
+		return false;
+	}
+	MetaDataEntries newEntries; // The files that have finished.
+	ReferencedEntries referencedEntries; // Added to as they finish.
+	addReferencedEntries(rootJsonValue, referencedEntries);
+
+	const unsigned int threads = (options.threads > 0) ? options.threads : 1;
+	const unsigned int batchSize = getBatchSize(options);
+	std::vector<ScheduledChunk> batch;
+	if (!runScratch)
+	{
+		runScratch.reset(new SearchScratch[batchSize]);
+	}
+
+	// The files which have been opened and not finished yet. Only the last can still have chunks to cut:
+	std::vector<std::unique_ptr<BatchFile>> openFiles;
+	std::vector<std::string> finishedJournalFilePaths;
+	size_t nextFile = 0;
+	unsigned int finishedFiles = 0;
+	bool success = true;
+	while (success)
+	{
+		// Cut the next batch, moving on to the next file whenever one runs out:
+		batch.clear();
+		while (success && (batch.size() < batchSize))
+		{
+			if (openFiles.empty() || !hasChunksToCut(openFiles.back()->run))
+			{
+				if (nextFile == inputFilePaths.size())
+				{
+					break;
+				}
+
+				const char* inputFilePath = inputFilePaths[nextFile].c_str();
+				const char* outputFilePath = outputFilePaths[nextFile].c_str();
+				++nextFile;
+				if (options.verbose)
+				{
+					printf("Compressing %s to %s\n", inputFilePath, outputFilePath);
+				}
+
+				if (!checkEntryIsUnreferenced(referencedEntries, inputFilePath))
+				{
+					success = false;
+					break;
+				}
+
+				// With /resume, a file without a journal was either never started or has already finished, it's compressed from the start:
+				const bool resume = options.resume && fileExists(getJournalFilePath(outputFilePath).c_str());
+				openFiles.emplace_back(new BatchFile());
+				BatchFile& file = *openFiles.back();
+				file.files = CompressionFiles{};
+				success = openCompressionFiles(runDescription, options.chunkSize, resume, options.verbose, inputFilePath, outputFilePath, file.files);
+				if (success)
+				{
+					file.input.reset(new FileInput(file.files.inputFileHandle));
+					file.output.reset(new FileOutput(file.files.outputFileHandle));
+					file.run.input = file.input.get();
+					file.run.output = file.output.get();
+					file.run.inputKey = inputFilePath;
+					file.run.compressedFileName = outputFilePath;
+					file.run.journal = &file.files.journal;
+					success = beginCompressionRun(options, file.run, rootJsonValue, &newEntries);
+				}
+				continue;
+			}
+
+			CompressionRun& run = openFiles.back()->run;
+			const bool firstInBatch = batch.empty() || (batch.back().run != &run);
+			batch.emplace_back();
+			success = cutChunk(options, run, batch.back(), firstInBatch);
+		}
+		if (!success)
+		{
+			break;
+		}
+
+		compressScheduledChunks(batch, runScratch.get(), threads, options.verify);
+
+		// Write them out in order:
+		for (ScheduledChunk& chunk : batch)
+		{
+			success = writeChunk(options, *chunk.run, chunk);
+			if (!success)
+			{
+				break;
+			}
+		}
+
+		// Every file that's been cut to the end has now been written, so it can be finished:
+		while (success && !openFiles.empty() && !hasChunksToCut(openFiles.front()->run))
+		{
+			BatchFile& file = *openFiles.front();
+			success = finishCompressionRun(options, file.run, rootJsonValue, &newEntries);
+			if (success)
+			{
+				addReferencedEntries(file.run.inputKey, newEntries[file.run.inputKey], referencedEntries);
+				closeCompressionFiles(file.files);
+				finishedJournalFilePaths.push_back(file.files.journalFilePath);
+				++finishedFiles;
+				openFiles.erase(openFiles.begin());
+			}
+		}
+
+		if (openFiles.empty() && (nextFile == inputFilePaths.size()))
+		{
+			break;
+		}
+	}
+
+	// The journals of anything that didn't finish are kept for /resume:
+	for (std::unique_ptr<BatchFile>& file : openFiles)
+	{
+		closeCompressionFiles(file->files);
+	}
+
+	// The files which did finish still go in the meta data:
+	if (finishedFiles > 0)
+	{
+		if (options.verbose)
+		{
+			printf("Writing the metadata for %u of %u files.\n", finishedFiles, (unsigned int)inputFilePaths.size());
+		}
+		if (!updateMetaDataFile(metaDataFilePath, rootJsonValue, newEntries, useMetaDataLog))
+		{
+			printf("The journals have been kept so the run can be resumed.\n");
+			return false;
+		}
+		for (const std::string& journalFilePath : finishedJournalFilePaths)
+		{
+			remove(journalFilePath.c_str());
+		}
+	}
+
+	return success;
+}
+
+bool Compressor::compress(CompressorInput& input, CompressorOutput& output, const char* inputKey, const char* compressedFileName, Json::Value& rootJsonValue)
+{
+	return run(input, output, inputKey, compressedFileName, rootJsonValue, nullptr, nullptr);
+}
+
+bool Compressor::run(CompressorInput& input, CompressorOutput& output, const char* inputKey, const char* compressedFileName, Json::Value& rootJsonValue, CompressionJournal* journal, MetaDataEntries* newEntries)
+{
+	CompressionRun compressionRun = {};
+	compressionRun.input = &input;
+	compressionRun.output = &output;
+	compressionRun.inputKey = inputKey;
+	compressionRun.compressedFileName = compressedFileName;
+	compressionRun.journal = journal;
+	if (!beginCompressionRun(options, compressionRun, rootJsonValue, newEntries))
+	{
+		return false;
+	}
+
+	const unsigned int threads = (options.threads > 0) ? options.threads : 1;
+	const unsigned int batchSize = getBatchSize(options);
+	std::vector<ScheduledChunk> batch;
+	if (!runScratch)
+	{
+		runScratch.reset(new SearchScratch[batchSize]);
+	}
+	while (hasChunksToCut(compressionRun))
+	{
+		// Read the next batch of chunks:
+		batch.clear();
+		while ((batch.size() < batchSize) && hasChunksToCut(compressionRun))
+		{
+			batch.emplace_back();
+			if (!cutChunk(options, compressionRun, batch.back(), batch.size() == 1))
+			{
+				return false;
+			}
+		}
+
+		compressScheduledChunks(batch, runScratch.get(), threads, options.verify);
+
+		// Write them out in order:
+		for (ScheduledChunk& chunk : batch)
+		{
+			if (!writeChunk(options, compressionRun, chunk))
+			{
+				return false;
+			}
+		}
+	}
+
+	return finishCompressionRun(options, compressionRun, rootJsonValue, newEntries);
+}
+
+size_t Compressor::getCompressedBufferBound(size_t size)
+{
+	return size;
+}
+
+size_t Compressor::getMaximumChunkCount(size_t size) const
+{
+	unsigned int smallestChunkSize = options.chunkSize;
+	if (options.contentDefinedChunking)
+	{
+		smallestChunkSize = (options.cdcMinimumChunkSize != 0) ? options.cdcMinimumChunkSize : options.chunkSize / 4;
+	}
+	if (smallestChunkSize == 0)
+	{
+		smallestChunkSize = 1;
+	}
+	return (size + smallestChunkSize - 1) / smallestChunkSize;
+}
+
+bool Compressor::compressBuffer(const unsigned char* data, size_t size, unsigned char* arena, size_t arenaSize, ChunkTable& table)
+{
+	table.chunkCount = 0;
+	table.compressedSize = 0;
+
+	if (!bufferState)
+	{
+		if (options.trainDictionary || options.dedup || options.targetCompressedChunks)
+		{
+			printf("/td, /dd and /tc aren't supported when compressing a buffer.\n");
+			return false;
+		}
+
+		std::unique_ptr<BufferCompressionState> state(new BufferCompressionState());
+		unsigned int maximumUncompressedChunkSize = 0;
+		std::string runDescription;
+		if (!checkCompressorOptions(options, state->cdc, maximumUncompressedChunkSize, runDescription))
+		{
+			return false;
+		}
+
+		initCompressionSearch(state->search, options.codecs, options.levels, options.memLevels, options.strategies, options.minimumMegabytesPerSecond);
+		state->search.ultraBudgetSeconds = options.ultraBudgetMilliseconds / 1000.0;
+		state->search.budgetSeconds = options.searchBudgetMilliseconds / 1000.0;
+		state->search.adaptive = options.adaptiveSearch;
+		state->search.subBlockSize = options.subBlockSize;
+		state->threads = (options.threads > 0) ? options.threads : 1;
+		state->scratch.reset(new SearchScratch[state->threads]);
+		state->batch.resize(state->threads);
+		if (state->threads > 1)
+		{
+			state->workers.reset(new WorkerPool(state->threads));
+		}
+		bufferState = std::move(state);
+	}
+	BufferCompressionState& state = *bufferState;
+
+	if ((arenaSize < getCompressedBufferBound(size)) || (table.maximumChunks < getMaximumChunkCount(size)))
+	{
+		printf("The arena or the chunk table is too small for the buffer.\n");
+		return false;
+	}
+
+	// Small objects stay on this thread. Otherwise it's a batch per thread (or one chunk's sub-blocks) at a time:
+	const unsigned int threads = (size <= SMALL_BUFFER_SIZE) ? 1 : state.threads;
+	const unsigned int batchSize = (options.subBlockSize > 0) ? 1 : threads;
+	state.search.subBlockThreads = threads;
+
+	size_t inputOffset = 0;
+	unsigned int previousChunkSize = 0;
+	while (inputOffset < size)
+	{
+		// Cut the next batch of chunks:
+		const size_t firstChunk = table.chunkCount;
+		size_t batchCount = 0;
+		state.batchSearch = state.search;
+		while ((batchCount < batchSize) && (inputOffset < size))
+		{
+			const size_t available = size - inputOffset;
+			unsigned int currentChunkSize = (available < options.chunkSize) ? (unsigned int)available : options.chunkSize;
+			if (options.contentDefinedChunking)
+			{
+				currentChunkSize = findContentDefinedChunkEnd(state.cdc, data + inputOffset, available);
+			}
+
+			ChunkTableEntry& entry = table.chunks[table.chunkCount++];
+			entry = ChunkTableEntry{};
+			entry.uncompressedOffset = inputOffset;
+			entry.uncompressedSize = currentChunkSize;
+
+			BufferChunk& chunk = state.batch[batchCount];
+			chunk.search = state.batchSearch;
+			chunk.search.chunksSearched += (unsigned int)batchCount;
+			chunk.dictionaryLength = !options.primeDictionary ? 0 : (previousChunkSize < MAXIMUM_DICTIONARY_SIZE) ? previousChunkSize : MAXIMUM_DICTIONARY_SIZE;
+			chunk.dictionary = data + inputOffset - chunk.dictionaryLength;
+			chunk.compressedDataSize = 0;
+			chunk.bestParameters = DeflateParameters{ 0, 0, -1, false, 0, 0, 0, 0, CODEC_ZLIB };
+			entry.dependsOnPreviousChunk = (chunk.dictionaryLength > 0);
+
+			previousChunkSize = currentChunkSize;
+			inputOffset += currentChunkSize;
+			++batchCount;
+		}
+
+		// Each chunk is compressed into the arena where its input would be, there's room as nothing is bigger
+		// compressed, and what's ahead of it has already been moved down to the end of the compressed data:
+		auto compressBatchChunk = [&](size_t b)
+		{
+			BufferChunk& chunk = state.batch[b];
+			ChunkTableEntry& entry = table.chunks[firstChunk + b];
+			const unsigned char* chunkData = data + entry.uncompressedOffset;
+			unsigned char* compressedData = arena + entry.uncompressedOffset;
+			compressChunk(chunk.search, state.scratch[b], chunkData, entry.uncompressedSize, chunk.dictionary, chunk.dictionaryLength, compressedData, chunk.compressedDataSize, chunk.bestParameters);
+
+			chunk.verified = false;
+			if (options.verify)
+			{
+				entry.crc32 = fastCrc32(0, chunkData, entry.uncompressedSize);
+				if (chunk.bestParameters.strategy != -1)
+				{
+					chunk.verified = verifyChunk(state.scratch[b], compressedData, chunk.compressedDataSize, entry.uncompressedSize, entry.crc32, chunk.dictionary, chunk.dictionaryLength);
+				}
+			}
+		};
+		if (batchCount == 1)
+		{
+			compressBatchChunk(0);
+		}
+		else
+		{
+			state.workers->run(batchCount, compressBatchChunk);
+		}
+
+		// Then they're packed in order:
+		for (size_t b = 0; b < batchCount; ++b)
+		{
+			BufferChunk& chunk = state.batch[b];
+			ChunkTableEntry& entry = table.chunks[firstChunk + b];
+			mergeChunkSearch(state.search, state.batchSearch, chunk.search);
+
+			const DeflateParameters& bestParameters = chunk.bestParameters;
+			if (!printCompressionMethod(bestParameters, false))
+			{
+				return false;
+			}
+
+			if (options.verify && !chunk.verified)
+			{
+				printf("Chunk %d did not decompress to its input.\n", (int)(firstChunk + b + 1));
+				return false;
+			}
+
+			memmove(arena + table.compressedSize, arena + entry.uncompressedOffset, chunk.compressedDataSize);
+			entry.compressedOffset = table.compressedSize;
+			entry.compressedSize = chunk.compressedDataSize;
+			entry.codec = bestParameters.codec;
+			entry.level = bestParameters.level;
+			entry.memLevel = bestParameters.memLevel;
+			entry.strategy = bestParameters.strategy;
+			entry.tuned = bestParameters.tuned;
+			entry.goodLength = bestParameters.goodLength;
+			entry.maxLazy = bestParameters.maxLazy;
+			entry.niceLength = bestParameters.niceLength;
+			entry.maxChain = bestParameters.maxChain;
+			entry.searchBudgetTruncated = (chunk.search.lastSearchFlags & SEARCH_BUDGET_TRUNCATED) != 0;
+			table.compressedSize += chunk.compressedDataSize;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,293 @@
+#pragma once
+
+// Compressor:
+// Everything the command line tool does to compress a file, for use in process. Options are set once and
+// a Compressor can then compress any number of inputs, one after another, each into its own output. The
+// input and output can be files, file descriptors, memory or callbacks. Its meta data is added to a
+// Json::Value the caller keeps, so compressing many objects doesn't mean reading and writing the meta data
+// file for each one. compressFile() is what the command line tool runs: files in and out, the meta data
+// file read and written, and a journal so an interrupted run can be resumed; compressFiles() does the same
+// for many files at once. compressBuffer() is for objects
+// already in memory: it compresses into the caller's memory and returns a table of the chunks instead.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include <functional>
+#include <memory>
+
+// External libraries:
+#include <json/json.h>
+
+#include "MetaData.h"
+
+#define XZCOMPRESS_VERSION 1.0
+
+// Codecs:
+// What produces a chunk's zlib stream. zlib's deflate() is the default; the whole buffer encoder
+// (DeflateEncoder.cpp) makes use of the chunk being entirely in memory, and its optimal parsing mode
+// spends far longer for the smallest output. All produce standard streams, so chunks inflate the same
+// way whichever made them.
+enum ChunkCodec
+{
+	CODEC_ZLIB,
+	CODEC_WHOLE_BUFFER,
+	CODEC_OPTIMAL,
+};
+
+// Looks a codec up by name ("zlib", "wholebuffer" or "optimal").
+bool findCodec(const char* name, int& codec);
+
+// The smallest /sbs sub-block.
+const unsigned int MINIMUM_SUB_BLOCK_SIZE = 64 * 1024;
+
+// The command line switch each option comes from is alongside it, see printUsage() for what they do.
+struct CompressorOptions
+{
+	unsigned int chunkSize = 0; // /ch, required.
+	bool contentDefinedChunking = false; // /cdc
+	unsigned int cdcMinimumChunkSize = 0; // /cmin, 0 for chunkSize / 4.
+	unsigned int cdcMaximumChunkSize = 0; // /cmax, 0 for chunkSize * 4 (chunkSize * 16 with /tc).
+	bool targetCompressedChunks = false; // /tc
+	bool primeDictionary = false; // /pd
+	bool trainDictionary = false; // /td
+	bool dedup = false; // /dd
+	std::vector<int> codecs = { CODEC_ZLIB }; // /cd
+	std::vector<int> levels = { 9 }; // /lv
+	std::vector<int> memLevels = { 9 }; // /ml
+	std::vector<int> strategies = { 0, 1, 2, 3, 4 }; // /st, Z_DEFAULT_STRATEGY to Z_FIXED.
+	double minimumMegabytesPerSecond = 0.0; // /mbps
+	unsigned int searchBudgetMilliseconds = 0; // /bms
+	bool adaptiveSearch = false; // /as
+	unsigned int ultraBudgetMilliseconds = 0; // /ultra
+	unsigned int threads = 1; // /t
+	unsigned int subBlockSize = 0; // /sbs, 0 for whole chunks.
+	bool verify = false; // /vf
+	unsigned int checkpointInterval = 16; // /cp, compressFile() only.
+	bool resume = false; // /resume, compressFile() only.
+	bool metaDataLog = false; // /mlog, compressFile() and compressFiles() append to the meta data log (see MetaData.h).
+	bool verbose = false; // Report each chunk as it's written, as the command line tool does.
+};
+
+// Where the data to compress comes from. The size has to be known up front.
+class CompressorInput
+{
+public:
+	virtual ~CompressorInput() {}
+
+	virtual uint64_t getSize() = 0;
+
+	// Reads exactly length bytes from the current position, and moves past them.
+	virtual bool read(unsigned char* buffer, size_t length) = 0;
+
+	// Only needed for /td (the input is sampled first) and when resuming.
+	virtual bool seek(uint64_t offset) = 0;
+};
+
+// Where the compressed chunks go, in order.
+class CompressorOutput
+{
+public:
+	virtual ~CompressorOutput() {}
+
+	virtual bool write(const unsigned char* data, size_t length) = 0;
+};
+
+class FileInput : public CompressorInput
+{
+public:
+	FileInput(FILE* fileHandle);
+
+	uint64_t getSize();
+	bool read(unsigned char* buffer, size_t length);
+	bool seek(uint64_t offset);
+
+private:
+	FILE* fileHandle;
+};
+
+class FileOutput : public CompressorOutput
+{
+public:
+	FileOutput(FILE* fileHandle);
+
+	bool write(const unsigned char* data, size_t length);
+
+private:
+	FILE* fileHandle;
+};
+
+class FileDescriptorInput : public CompressorInput
+{
+public:
+	FileDescriptorInput(int fileDescriptor);
+
+	uint64_t getSize();
+	bool read(unsigned char* buffer, size_t length);
+	bool seek(uint64_t offset);
+
+private:
+	int fileDescriptor;
+};
+
+class FileDescriptorOutput : public CompressorOutput
+{
+public:
+	FileDescriptorOutput(int fileDescriptor);
+
+	bool write(const unsigned char* data, size_t length);
+
+private:
+	int fileDescriptor;
+};
+
+// Reads from memory the caller keeps hold of until compress() returns.
+class MemoryInput : public CompressorInput
+{
+public:
+	MemoryInput(const unsigned char* data, size_t size);
+
+	uint64_t getSize();
+	bool read(unsigned char* buffer, size_t length);
+	bool seek(uint64_t offset);
+
+private:
+	const unsigned char* data;
+	size_t size;
+	size_t position;
+};
+
+// Appends to the caller's buffer.
+class MemoryOutput : public CompressorOutput
+{
+public:
+	MemoryOutput(std::vector<unsigned char>& buffer);
+
+	bool write(const unsigned char* data, size_t length);
+
+private:
+	std::vector<unsigned char>& buffer;
+};
+
+// Reads length bytes at offset through a callback.
+class CallbackInput : public CompressorInput
+{
+public:
+	typedef std::function<bool(uint64_t offset, unsigned char* buffer, size_t length)> ReadCallback;
+
+	CallbackInput(uint64_t size, const ReadCallback& readCallback);
+
+	uint64_t getSize();
+	bool read(unsigned char* buffer, size_t length);
+	bool seek(uint64_t offset);
+
+private:
+	uint64_t size;
+	uint64_t position;
+	ReadCallback readCallback;
+};
+
+class CallbackOutput : public CompressorOutput
+{
+public:
+	typedef std::function<bool(const unsigned char* data, size_t length)> WriteCallback;
+
+	CallbackOutput(const WriteCallback& writeCallback);
+
+	bool write(const unsigned char* data, size_t length);
+
+private:
+	WriteCallback writeCallback;
+};
+
+// One chunk of compressBuffer()'s output, with what the meta data would record for it.
+struct ChunkTableEntry
+{
+	uint64_t uncompressedOffset;
+	uint64_t compressedOffset; // Into the arena.
+	unsigned int uncompressedSize;
+	unsigned int compressedSize;
+	int codec; // ChunkCodec
+	int level;
+	int memLevel;
+	int strategy;
+	bool tuned; // /ultra's deflateTune() settings follow, as "deflate_tune" in the meta data.
+	int goodLength;
+	int maxLazy;
+	int niceLength;
+	int maxChain;
+	bool dependsOnPreviousChunk; // /pd
+	bool searchBudgetTruncated; // /bms
+	uint32_t crc32; // Of the uncompressed chunk, only with /vf.
+};
+
+// compressBuffer()'s result. The entries are the caller's, maximumChunks of them.
+struct ChunkTable
+{
+	ChunkTableEntry* chunks;
+	size_t maximumChunks;
+	size_t chunkCount;
+	size_t compressedSize; // How much of the arena was used.
+};
+
+// Objects up to this size are compressed by compressBuffer() on the calling thread, whatever /t says.
+const size_t SMALL_BUFFER_SIZE = 1024 * 1024;
+
+struct CompressionJournal;
+struct SearchScratch;
+struct BufferCompressionState;
+
+class Compressor
+{
+public:
+	Compressor(const CompressorOptions& options);
+	~Compressor();
+
+	const CompressorOptions& getOptions() const;
+
+	// Compresses inputFilePath into outputFilePath and adds it to the meta data file, as the command line
+	// tool does. The journal ("<output>.journal") is kept if it fails, for options.resume.
+	bool compressFile(const char* inputFilePath, const char* outputFilePath, const char* metaDataFilePath);
+
+	// Compresses each input file into the output file at the same index, as compressFile() would, but with
+	// one scheduler for all of them: when a file runs out of chunks the batch carries on with the next one,
+	// so small files don't leave threads idle. The meta data file is read once, and written once at the end
+	// with every file that finished, even if a later one failed; only then are their journals removed. /dd
+	// finds the chunks of files that had finished before a file was started.
+	bool compressFiles(const std::vector<std::string>& inputFilePaths, const std::vector<std::string>& outputFilePaths, const char* metaDataFilePath);
+
+	// Compresses input into output and adds its meta data to rootJsonValue under inputKey, replacing any
+	// there already. compressedFileName is what the meta data records as the compressed file, for /dd to
+	// find the chunks from other inputs, and /td stores the dictionary next to it ("<name>.dict"). The
+	// search's buffers and deflate streams are kept for the next input, as they are for compressBuffer().
+	bool compress(CompressorInput& input, CompressorOutput& output, const char* inputKey, const char* compressedFileName, Json::Value& rootJsonValue);
+
+	// Compresses size bytes of memory into arena, one chunk after another, and describes them in table. No
+	// files and no meta data; the search and the buffers and deflate streams it uses are kept from one call
+	// to the next, so once a Compressor has compressed an object as big, zlib chunks don't allocate (/vf
+	// still inflates each chunk with a new stream, and /sbs and the other codecs allocate their own buffers).
+	// Objects larger than SMALL_BUFFER_SIZE are split between the /t threads a batch at a time, as
+	// compress() does, on threads started by the first call and kept with the rest. /td, /dd and /tc aren't
+	// supported. Fails, as the command line tool does, if a chunk
+	// doesn't get smaller.
+	bool compressBuffer(const unsigned char* data, size_t size, unsigned char* arena, size_t arenaSize, ChunkTable& table);
+
+	// The arena compressBuffer() needs for size bytes. Every chunk has to get smaller, so it's never more than the input.
+	static size_t getCompressedBufferBound(size_t size);
+
+	// The most chunks compressBuffer() can cut size bytes into.
+	size_t getMaximumChunkCount(size_t size) const;
+
+private:
+	Compressor(const Compressor&);
+	Compressor& operator=(const Compressor&);
+
+	// With newEntries, the input's meta data is left there as chunk records, for writeMetaDataFile().
+	bool run(CompressorInput& input, CompressorOutput& output, const char* inputKey, const char* compressedFileName, Json::Value& rootJsonValue, CompressionJournal* journal, MetaDataEntries* newEntries);
+
+	CompressorOptions options;
+	std::unique_ptr<SearchScratch[]> runScratch; // One for each chunk in a batch, made by the first run.
+	std::unique_ptr<BufferCompressionState> bufferState; // Made by the first compressBuffer().
+};
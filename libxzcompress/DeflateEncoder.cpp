@@ -0,0 +1,1320 @@
+#include "DeflateEncoder.h"
+
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+// External libraries:
+#include <zlib.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+const unsigned int WINDOW_SIZE = 32768;
+const unsigned int MAXIMUM_DISTANCE = WINDOW_SIZE - 1; // So a chain never reaches a slot that's been reused.
+const unsigned int MIN_MATCH = 3;
+const unsigned int MAX_MATCH = 258;
+const unsigned int TOO_FAR = 4096; // A 3 byte match further back than this costs more than 3 literals, as in zlib.
+const unsigned int HASH3_BITS = 15;
+const unsigned int HASH4_BITS = 16;
+
+const unsigned int NUM_LITLEN_SYMBOLS = 286;
+const unsigned int NUM_FIXED_LITLEN_SYMBOLS = 288; // The fixed code also assigns 286 and 287.
+const unsigned int NUM_DISTANCE_SYMBOLS = 30;
+const unsigned int NUM_PRECODE_SYMBOLS = 19;
+const unsigned int END_OF_BLOCK = 256;
+const unsigned int MAX_CODE_LENGTH = 15;
+const unsigned int MAX_PRECODE_LENGTH = 7;
+const unsigned int MAX_STORED_BLOCK_LENGTH = 65535;
+
+static const unsigned short LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const unsigned char LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const unsigned short DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const unsigned char DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const unsigned char PRECODE_EXTRA[NUM_PRECODE_SYMBOLS] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7 };
+static const unsigned char PRECODE_ORDER[NUM_PRECODE_SYMBOLS] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// Match finding effort for each level, the same as zlib's. Levels 1-3 take the first match they find,
+// and only add the positions inside matches up to maxLazy long to the hash chains. The rest look one
+// byte ahead for a longer match (lazy matching) unless the current one is already maxLazy long, and
+// search a quarter as far for it if the current one is goodLength long.
+struct MatchFinderSettings
+{
+	unsigned int goodLength;
+	unsigned int maxLazy;
+	unsigned int niceLength;
+	unsigned int maxChain;
+	bool lazy;
+};
+
+static const MatchFinderSettings LEVEL_SETTINGS[10] =
+{
+	{ 0, 0, 0, 0, false }, // Stored
+	{ 4, 4, 8, 4, false },
+	{ 4, 5, 16, 8, false },
+	{ 4, 6, 32, 32, false },
+	{ 4, 4, 16, 16, true },
+	{ 8, 16, 32, 32, true },
+	{ 8, 16, 128, 128, true },
+	{ 8, 32, 128, 256, true },
+	{ 32, 128, 258, 1024, true },
+	{ 32, 258, 258, 4096, true },
+};
+
+// Block splitting:
+// As in libdeflate, the symbols are sorted into a few rough types (literal classes, short and long
+// matches). Every OBSERVATIONS_PER_BLOCK_CHECK symbols the latest counts are compared with the block's so
+// far, and the block ends if they differ by enough. Blocks stay between MIN_BLOCK_LENGTH and roughly
+// SOFT_MAX_BLOCK_LENGTH bytes of input.
+const unsigned int NUM_LITERAL_OBSERVATION_TYPES = 8;
+const unsigned int NUM_OBSERVATION_TYPES = NUM_LITERAL_OBSERVATION_TYPES + 2;
+const unsigned int OBSERVATIONS_PER_BLOCK_CHECK = 512;
+const unsigned int MIN_BLOCK_LENGTH = 10000;
+const unsigned int SOFT_MAX_BLOCK_LENGTH = 300000;
+
+struct DeflateLookupTables
+{
+	unsigned char lengthCode[MAX_MATCH + 1];
+	unsigned char distanceCode[512];
+};
+
+static DeflateLookupTables buildLookupTables()
+{
+	DeflateLookupTables tables = {};
+	for (unsigned int code = 0; code < 28; ++code)
+	{
+		for (unsigned int length = LENGTH_BASE[code]; length < LENGTH_BASE[code] + (1u << LENGTH_EXTRA[code]); ++length)
+		{
+			tables.lengthCode[length] = (unsigned char)code;
+		}
+	}
+	tables.lengthCode[MAX_MATCH] = 28;
+
+	// Distances up to 256 are looked up directly, longer ones by their top bits:
+	for (unsigned int code = 0; code < NUM_DISTANCE_SYMBOLS; ++code)
+	{
+		for (unsigned int distance = DISTANCE_BASE[code]; distance < DISTANCE_BASE[code] + (1u << DISTANCE_EXTRA[code]); ++distance)
+		{
+			const unsigned int d = distance - 1;
+			tables.distanceCode[(d < 256) ? d : 256 + (d >> 7)] = (unsigned char)code;
+		}
+	}
+	return tables;
+}
+
+static const DeflateLookupTables lookupTables = buildLookupTables();
+
+static inline unsigned int getDistanceCode(unsigned int distance)
+{
+	const unsigned int d = distance - 1;
+	return lookupTables.distanceCode[(d < 256) ? d : 256 + (d >> 7)];
+}
+
+static inline unsigned int countTrailingZeros(uint64_t value)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+	unsigned long index = 0;
+	_BitScanForward64(&index, value);
+	return index;
+#elif defined(_MSC_VER)
+	unsigned long index = 0;
+	if (_BitScanForward(&index, (unsigned long)value))
+	{
+		return index;
+	}
+	_BitScanForward(&index, (unsigned long)(value >> 32));
+	return index + 32;
+#else
+	return (unsigned int)__builtin_ctzll(value);
+#endif
+}
+
+// A literal (litLen < 256) or a match (litLen = 256 + length).
+struct DeflateSymbol
+{
+	uint16_t litLen;
+	uint16_t distance;
+};
+
+struct DeflateEncoder
+{
+	const unsigned char* buffer; // Dictionary then data.
+	size_t bufferSize;
+	bool fixedCodeOnly; // Z_FIXED
+
+	std::vector<unsigned char> output;
+	uint64_t bitBuffer;
+	unsigned int bitCount;
+
+	// The block being built, covering buffer[blockStart, inputEnd):
+	size_t blockStart;
+	size_t inputEnd;
+	std::vector<DeflateSymbol> symbols;
+	uint32_t litLenFrequencies[NUM_LITLEN_SYMBOLS];
+	uint32_t distanceFrequencies[NUM_DISTANCE_SYMBOLS];
+
+	uint32_t observations[NUM_OBSERVATION_TYPES];
+	uint32_t newObservations[NUM_OBSERVATION_TYPES];
+	uint32_t numObservations;
+	uint32_t numNewObservations;
+};
+
+// Bits go out least significant first, as DEFLATE wants.
+static inline void putBits(DeflateEncoder& encoder, uint32_t bits, unsigned int count)
+{
+	encoder.bitBuffer |= (uint64_t)bits << encoder.bitCount;
+	encoder.bitCount += count;
+	if (encoder.bitCount >= 32)
+	{
+		const unsigned char bytes[4] = { (unsigned char)encoder.bitBuffer, (unsigned char)(encoder.bitBuffer >> 8), (unsigned char)(encoder.bitBuffer >> 16), (unsigned char)(encoder.bitBuffer >> 24) };
+		encoder.output.insert(encoder.output.end(), bytes, bytes + 4);
+		encoder.bitBuffer >>= 32;
+		encoder.bitCount -= 32;
+	}
+}
+
+// Pads to a byte boundary and writes out everything pending.
+static void flushBits(DeflateEncoder& encoder)
+{
+	while (encoder.bitCount > 0)
+	{
+		encoder.output.push_back((unsigned char)encoder.bitBuffer);
+		encoder.bitBuffer >>= 8;
+		encoder.bitCount = (encoder.bitCount > 8) ? encoder.bitCount - 8 : 0;
+	}
+	encoder.bitBuffer = 0;
+}
+
+// Huffman codes:
+// Code lengths come from a Huffman tree (built with the two queue method over the symbols sorted by
+// frequency), then any over maxLength are shortened, as miniz does: the counts per length are adjusted
+// until the code is complete again, and the lengths are handed out with the shortest going to the
+// most frequent symbols. There are always at least two codes, inflate() doesn't accept less than a complete code.
+static void buildCodeLengths(const uint32_t* frequencies, unsigned int numSymbols, unsigned int maxLength, unsigned char* lengths)
+{
+	std::vector<unsigned int> used;
+	for (unsigned int s = 0; s < numSymbols; ++s)
+	{
+		if (frequencies[s] > 0)
+		{
+			used.push_back(s);
+		}
+	}
+	for (unsigned int s = 0; (used.size() < 2) && (s < numSymbols); ++s)
+	{
+		if (frequencies[s] == 0)
+		{
+			used.push_back(s);
+		}
+	}
+	std::stable_sort(used.begin(), used.end(), [frequencies](unsigned int a, unsigned int b) { return frequencies[a] < frequencies[b]; });
+
+	const size_t numLeaves = used.size();
+	const size_t numNodes = 2 * numLeaves - 1;
+	std::vector<uint64_t> weight(numNodes);
+	std::vector<size_t> parent(numNodes);
+	for (size_t i = 0; i < numLeaves; ++i)
+	{
+		weight[i] = frequencies[used[i]];
+	}
+
+	// Leaves and new internal nodes both come out in increasing weight, so the smallest is always at the front of one of them:
+	size_t nextLeaf = 0;
+	size_t nextInternal = numLeaves;
+	for (size_t node = numLeaves; node < numNodes; ++node)
+	{
+		size_t children[2];
+		for (size_t& child : children)
+		{
+			if ((nextLeaf < numLeaves) && ((nextInternal >= node) || (weight[nextLeaf] <= weight[nextInternal])))
+			{
+				child = nextLeaf++;
+			}
+			else
+			{
+				child = nextInternal++;
+			}
+		}
+		weight[node] = weight[children[0]] + weight[children[1]];
+		parent[children[0]] = node;
+		parent[children[1]] = node;
+	}
+
+	// Parents always come after their children, so depths can be filled in backwards from the root:
+	std::vector<unsigned int> depth(numNodes, 0);
+	unsigned int lengthCounts[MAX_CODE_LENGTH + 1] = {};
+	for (size_t node = numNodes - 1; node-- > 0;)
+	{
+		depth[node] = depth[parent[node]] + 1;
+	}
+	for (size_t i = 0; i < numLeaves; ++i)
+	{
+		lengthCounts[(depth[i] < maxLength) ? depth[i] : maxLength]++;
+	}
+
+	uint32_t total = 0;
+	for (unsigned int length = 1; length <= maxLength; ++length)
+	{
+		total += lengthCounts[length] << (maxLength - length);
+	}
+	while (total != (1u << maxLength))
+	{
+		lengthCounts[maxLength]--;
+		for (unsigned int length = maxLength - 1; length > 0; --length)
+		{
+			if (lengthCounts[length] > 0)
+			{
+				lengthCounts[length]--;
+				lengthCounts[length + 1] += 2;
+				break;
+			}
+		}
+		total--;
+	}
+
+	memset(lengths, 0, numSymbols);
+	size_t leaf = 0;
+	for (unsigned int length = maxLength; length > 0; --length)
+	{
+		for (unsigned int i = 0; i < lengthCounts[length]; ++i)
+		{
+			lengths[used[leaf++]] = (unsigned char)length;
+		}
+	}
+}
+
+// Canonical codes for the lengths, bit reversed so they can go straight to putBits().
+static void buildCodes(const unsigned char* lengths, unsigned int numSymbols, uint16_t* codes)
+{
+	unsigned int lengthCounts[MAX_CODE_LENGTH + 1] = {};
+	for (unsigned int s = 0; s < numSymbols; ++s)
+	{
+		lengthCounts[lengths[s]]++;
+	}
+	lengthCounts[0] = 0;
+
+	unsigned int nextCode[MAX_CODE_LENGTH + 1] = {};
+	unsigned int code = 0;
+	for (unsigned int length = 1; length <= MAX_CODE_LENGTH; ++length)
+	{
+		code = (code + lengthCounts[length - 1]) << 1;
+		nextCode[length] = code;
+	}
+
+	for (unsigned int s = 0; s < numSymbols; ++s)
+	{
+		const unsigned int length = lengths[s];
+		unsigned int reversed = 0;
+		for (unsigned int bit = 0, value = nextCode[length]++; bit < length; ++bit, value >>= 1)
+		{
+			reversed = (reversed << 1) | (value & 1);
+		}
+		codes[s] = (uint16_t)reversed;
+	}
+}
+
+static void getFixedCodeLengths(unsigned char* litLenLengths, unsigned char* distanceLengths)
+{
+	for (unsigned int s = 0; s < NUM_FIXED_LITLEN_SYMBOLS; ++s)
+	{
+		litLenLengths[s] = (s < 144) ? 8 : (s < 256) ? 9 : (s < 280) ? 7 : 8;
+	}
+	memset(distanceLengths, 5, NUM_DISTANCE_SYMBOLS);
+}
+
+// The bits symbols with these frequencies take with the given code lengths.
+static uint64_t getSymbolBits(const uint32_t* litLenFrequencies, const uint32_t* distanceFrequencies, const unsigned char* litLenLengths, const unsigned char* distanceLengths)
+{
+	uint64_t bits = 0;
+	for (unsigned int s = 0; s < NUM_LITLEN_SYMBOLS; ++s)
+	{
+		bits += (uint64_t)litLenFrequencies[s] * (litLenLengths[s] + ((s > END_OF_BLOCK) ? LENGTH_EXTRA[s - END_OF_BLOCK - 1] : 0));
+	}
+	for (unsigned int s = 0; s < NUM_DISTANCE_SYMBOLS; ++s)
+	{
+		bits += (uint64_t)distanceFrequencies[s] * (distanceLengths[s] + DISTANCE_EXTRA[s]);
+	}
+	return bits;
+}
+
+// The code lengths of a dynamic block are themselves run length encoded (symbols 16-18) and Huffman coded (the precode).
+struct PrecodeItem
+{
+	unsigned char symbol;
+	unsigned char extraBits;
+};
+
+static void runLengthEncodeCodeLengths(const unsigned char* lengths, unsigned int count, std::vector<PrecodeItem>& items)
+{
+	unsigned int i = 0;
+	while (i < count)
+	{
+		const unsigned char length = lengths[i];
+		unsigned int run = 1;
+		while ((i + run < count) && (lengths[i + run] == length))
+		{
+			++run;
+		}
+		i += run;
+
+		if (length == 0)
+		{
+			while (run >= 11)
+			{
+				const unsigned int repeat = (run < 138) ? run : 138;
+				items.push_back(PrecodeItem{ 18, (unsigned char)(repeat - 11) });
+				run -= repeat;
+			}
+			if (run >= 3)
+			{
+				items.push_back(PrecodeItem{ 17, (unsigned char)(run - 3) });
+				run = 0;
+			}
+		}
+		else
+		{
+			items.push_back(PrecodeItem{ length, 0 });
+			--run;
+			while (run >= 3)
+			{
+				const unsigned int repeat = (run < 6) ? run : 6;
+				items.push_back(PrecodeItem{ 16, (unsigned char)(repeat - 3) });
+				run -= repeat;
+			}
+		}
+
+		for (; run > 0; --run)
+		{
+			items.push_back(PrecodeItem{ length, 0 });
+		}
+	}
+}
+
+static void writeStoredBlocks(DeflateEncoder& encoder, bool final)
+{
+	size_t position = encoder.blockStart;
+	do
+	{
+		const size_t length = ((encoder.inputEnd - position) < MAX_STORED_BLOCK_LENGTH) ? encoder.inputEnd - position : MAX_STORED_BLOCK_LENGTH;
+		const bool last = (position + length == encoder.inputEnd);
+		putBits(encoder, (final && last) ? 1 : 0, 1);
+		putBits(encoder, 0, 2);
+		flushBits(encoder);
+		putBits(encoder, (uint32_t)length, 16);
+		putBits(encoder, (uint32_t)(~length & 0xFFFF), 16);
+		flushBits(encoder);
+		encoder.output.insert(encoder.output.end(), encoder.buffer + position, encoder.buffer + position + length);
+		position += length;
+	} while (position < encoder.inputEnd);
+}
+
+static void writeSymbols(DeflateEncoder& encoder, const unsigned char* litLenLengths, const uint16_t* litLenCodes, const unsigned char* distanceLengths, const uint16_t* distanceCodes)
+{
+	for (const DeflateSymbol& symbol : encoder.symbols)
+	{
+		if (symbol.litLen < END_OF_BLOCK)
+		{
+			putBits(encoder, litLenCodes[symbol.litLen], litLenLengths[symbol.litLen]);
+			continue;
+		}
+
+		const unsigned int length = symbol.litLen - END_OF_BLOCK;
+		const unsigned int lengthCode = lookupTables.lengthCode[length];
+		putBits(encoder, litLenCodes[END_OF_BLOCK + 1 + lengthCode], litLenLengths[END_OF_BLOCK + 1 + lengthCode]);
+		putBits(encoder, length - LENGTH_BASE[lengthCode], LENGTH_EXTRA[lengthCode]);
+
+		const unsigned int distanceCode = getDistanceCode(symbol.distance);
+		putBits(encoder, distanceCodes[distanceCode], distanceLengths[distanceCode]);
+		putBits(encoder, symbol.distance - DISTANCE_BASE[distanceCode], DISTANCE_EXTRA[distanceCode]);
+	}
+	putBits(encoder, litLenCodes[END_OF_BLOCK], litLenLengths[END_OF_BLOCK]);
+}
+
+// Writes out the current block as whichever of dynamic Huffman, fixed Huffman or stored is smallest, and starts a new one.
+static void flushBlock(DeflateEncoder& encoder, bool final)
+{
+	encoder.litLenFrequencies[END_OF_BLOCK]++;
+
+	// Dynamic:
+	unsigned char litLenLengths[NUM_LITLEN_SYMBOLS];
+	unsigned char distanceLengths[NUM_DISTANCE_SYMBOLS];
+	buildCodeLengths(encoder.litLenFrequencies, NUM_LITLEN_SYMBOLS, MAX_CODE_LENGTH, litLenLengths);
+	buildCodeLengths(encoder.distanceFrequencies, NUM_DISTANCE_SYMBOLS, MAX_CODE_LENGTH, distanceLengths);
+
+	unsigned int numLitLenCodes = NUM_LITLEN_SYMBOLS;
+	while ((numLitLenCodes > 257) && (litLenLengths[numLitLenCodes - 1] == 0))
+	{
+		--numLitLenCodes;
+	}
+	unsigned int numDistanceCodes = NUM_DISTANCE_SYMBOLS;
+	while ((numDistanceCodes > 1) && (distanceLengths[numDistanceCodes - 1] == 0))
+	{
+		--numDistanceCodes;
+	}
+
+	unsigned char allLengths[NUM_LITLEN_SYMBOLS + NUM_DISTANCE_SYMBOLS];
+	memcpy(allLengths, litLenLengths, numLitLenCodes);
+	memcpy(allLengths + numLitLenCodes, distanceLengths, numDistanceCodes);
+	std::vector<PrecodeItem> precodeItems;
+	runLengthEncodeCodeLengths(allLengths, numLitLenCodes + numDistanceCodes, precodeItems);
+
+	uint32_t precodeFrequencies[NUM_PRECODE_SYMBOLS] = {};
+	for (const PrecodeItem& item : precodeItems)
+	{
+		precodeFrequencies[item.symbol]++;
+	}
+	unsigned char precodeLengths[NUM_PRECODE_SYMBOLS];
+	buildCodeLengths(precodeFrequencies, NUM_PRECODE_SYMBOLS, MAX_PRECODE_LENGTH, precodeLengths);
+	unsigned int numPrecodeCodes = NUM_PRECODE_SYMBOLS;
+	while ((numPrecodeCodes > 4) && (precodeLengths[PRECODE_ORDER[numPrecodeCodes - 1]] == 0))
+	{
+		--numPrecodeCodes;
+	}
+
+	uint64_t dynamicBits = 3 + 5 + 5 + 4 + 3 * numPrecodeCodes + getSymbolBits(encoder.litLenFrequencies, encoder.distanceFrequencies, litLenLengths, distanceLengths);
+	for (const PrecodeItem& item : precodeItems)
+	{
+		dynamicBits += precodeLengths[item.symbol] + PRECODE_EXTRA[item.symbol];
+	}
+
+	// Fixed:
+	unsigned char fixedLitLenLengths[NUM_FIXED_LITLEN_SYMBOLS];
+	unsigned char fixedDistanceLengths[NUM_DISTANCE_SYMBOLS];
+	getFixedCodeLengths(fixedLitLenLengths, fixedDistanceLengths);
+	const uint64_t fixedBits = 3 + getSymbolBits(encoder.litLenFrequencies, encoder.distanceFrequencies, fixedLitLenLengths, fixedDistanceLengths);
+
+	// Stored (the padding to a byte boundary is a guess):
+	const uint64_t blockLength = encoder.inputEnd - encoder.blockStart;
+	const uint64_t storedBlocks = (blockLength == 0) ? 1 : (blockLength + MAX_STORED_BLOCK_LENGTH - 1) / MAX_STORED_BLOCK_LENGTH;
+	const uint64_t storedBits = storedBlocks * (3 + 7 + 32) + 8 * blockLength;
+
+	if (encoder.fixedCodeOnly || ((fixedBits <= dynamicBits) && (fixedBits <= storedBits)))
+	{
+		uint16_t litLenCodes[NUM_FIXED_LITLEN_SYMBOLS];
+		uint16_t distanceCodes[NUM_DISTANCE_SYMBOLS];
+		buildCodes(fixedLitLenLengths, NUM_FIXED_LITLEN_SYMBOLS, litLenCodes);
+		buildCodes(fixedDistanceLengths, NUM_DISTANCE_SYMBOLS, distanceCodes);
+		putBits(encoder, final ? 1 : 0, 1);
+		putBits(encoder, 1, 2);
+		writeSymbols(encoder, fixedLitLenLengths, litLenCodes, fixedDistanceLengths, distanceCodes);
+	}
+	else if (storedBits < dynamicBits)
+	{
+		writeStoredBlocks(encoder, final);
+	}
+	else
+	{
+		uint16_t litLenCodes[NUM_LITLEN_SYMBOLS];
+		uint16_t distanceCodes[NUM_DISTANCE_SYMBOLS];
+		uint16_t precodeCodes[NUM_PRECODE_SYMBOLS];
+		buildCodes(litLenLengths, NUM_LITLEN_SYMBOLS, litLenCodes);
+		buildCodes(distanceLengths, NUM_DISTANCE_SYMBOLS, distanceCodes);
+		buildCodes(precodeLengths, NUM_PRECODE_SYMBOLS, precodeCodes);
+
+		putBits(encoder, final ? 1 : 0, 1);
+		putBits(encoder, 2, 2);
+		putBits(encoder, numLitLenCodes - 257, 5);
+		putBits(encoder, numDistanceCodes - 1, 5);
+		putBits(encoder, numPrecodeCodes - 4, 4);
+		for (unsigned int i = 0; i < numPrecodeCodes; ++i)
+		{
+			putBits(encoder, precodeLengths[PRECODE_ORDER[i]], 3);
+		}
+		for (const PrecodeItem& item : precodeItems)
+		{
+			putBits(encoder, precodeCodes[item.symbol], precodeLengths[item.symbol]);
+			putBits(encoder, item.extraBits, PRECODE_EXTRA[item.symbol]);
+		}
+		writeSymbols(encoder, litLenLengths, litLenCodes, distanceLengths, distanceCodes);
+	}
+
+	encoder.blockStart = encoder.inputEnd;
+	encoder.symbols.clear();
+	memset(encoder.litLenFrequencies, 0, sizeof(encoder.litLenFrequencies));
+	memset(encoder.distanceFrequencies, 0, sizeof(encoder.distanceFrequencies));
+	memset(encoder.observations, 0, sizeof(encoder.observations));
+	memset(encoder.newObservations, 0, sizeof(encoder.newObservations));
+	encoder.numObservations = 0;
+	encoder.numNewObservations = 0;
+}
+
+static bool shouldEndBlock(DeflateEncoder& encoder, uint64_t blockLength)
+{
+	if (encoder.numObservations > 0)
+	{
+		uint64_t totalDelta = 0;
+		for (unsigned int i = 0; i < NUM_OBSERVATION_TYPES; ++i)
+		{
+			const uint64_t expected = (uint64_t)encoder.observations[i] * encoder.numNewObservations;
+			const uint64_t actual = (uint64_t)encoder.newObservations[i] * encoder.numObservations;
+			totalDelta += (actual > expected) ? actual - expected : expected - actual;
+		}
+
+		// Be less eager to end short blocks with few symbols, their statistics aren't settled yet:
+		const uint64_t numItems = encoder.numObservations + encoder.numNewObservations;
+		uint64_t cutoff = (uint64_t)encoder.numNewObservations * 200 / 512 * encoder.numObservations;
+		if ((blockLength < MIN_BLOCK_LENGTH) && (numItems < 8192))
+		{
+			cutoff += cutoff * (8192 - numItems) / 8192;
+		}
+		if (totalDelta + (blockLength / 4096) * encoder.numObservations >= cutoff)
+		{
+			return true;
+		}
+	}
+
+	for (unsigned int i = 0; i < NUM_OBSERVATION_TYPES; ++i)
+	{
+		encoder.observations[i] += encoder.newObservations[i];
+		encoder.newObservations[i] = 0;
+	}
+	encoder.numObservations += encoder.numNewObservations;
+	encoder.numNewObservations = 0;
+	return false;
+}
+
+static inline void checkBlockEnd(DeflateEncoder& encoder)
+{
+	const uint64_t blockLength = encoder.inputEnd - encoder.blockStart;
+	if ((encoder.numNewObservations < OBSERVATIONS_PER_BLOCK_CHECK) || (blockLength < MIN_BLOCK_LENGTH) || (encoder.bufferSize - encoder.inputEnd < MIN_BLOCK_LENGTH))
+	{
+		return;
+	}
+
+	if ((blockLength >= SOFT_MAX_BLOCK_LENGTH) || shouldEndBlock(encoder, blockLength))
+	{
+		flushBlock(encoder, false);
+	}
+}
+
+static inline void observeLiteral(DeflateEncoder& encoder, unsigned char literal)
+{
+	encoder.newObservations[((literal >> 5) & 0x6) | (literal & 1)]++;
+	encoder.numNewObservations++;
+}
+
+static inline void observeMatch(DeflateEncoder& encoder, unsigned int length)
+{
+	encoder.newObservations[NUM_LITERAL_OBSERVATION_TYPES + ((length >= 9) ? 1 : 0)]++;
+	encoder.numNewObservations++;
+}
+
+// Adds a symbol to the current block without checking whether the block should end.
+static inline void recordLiteral(DeflateEncoder& encoder, unsigned char literal)
+{
+	encoder.symbols.push_back(DeflateSymbol{ literal, 0 });
+	encoder.litLenFrequencies[literal]++;
+	observeLiteral(encoder, literal);
+	encoder.inputEnd++;
+}
+
+static inline void recordMatch(DeflateEncoder& encoder, unsigned int length, unsigned int distance)
+{
+	encoder.symbols.push_back(DeflateSymbol{ (uint16_t)(END_OF_BLOCK + length), (uint16_t)distance });
+	encoder.litLenFrequencies[END_OF_BLOCK + 1 + lookupTables.lengthCode[length]]++;
+	encoder.distanceFrequencies[getDistanceCode(distance)]++;
+	observeMatch(encoder, length);
+	encoder.inputEnd += length;
+}
+
+static inline void addLiteral(DeflateEncoder& encoder, unsigned char literal)
+{
+	recordLiteral(encoder, literal);
+	checkBlockEnd(encoder);
+}
+
+static inline void addMatch(DeflateEncoder& encoder, unsigned int length, unsigned int distance)
+{
+	recordMatch(encoder, length, distance);
+	checkBlockEnd(encoder);
+}
+
+// Match finding:
+// As in libdeflate, hash chains over 4 byte prefixes, which are far shorter than zlib's 3 byte ones,
+// plus a table of just the latest position for each 3 byte prefix for the occasional 3 byte match.
+// The whole buffer is there, so nothing ever slides; prev is indexed by position modulo the window,
+// and chains stop at the edge of the window.
+struct MatchFinder
+{
+	const unsigned char* buffer;
+	size_t size;
+	std::vector<int32_t> head3;
+	std::vector<int32_t> head4;
+	std::vector<int32_t> prev;
+};
+
+static inline uint32_t hash3(const unsigned char* p)
+{
+	const uint32_t value = p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+	return (value * 0x9E3779B1u) >> (32 - HASH3_BITS);
+}
+
+static inline uint32_t hash4(const unsigned char* p)
+{
+	uint32_t value;
+	memcpy(&value, p, 4);
+	return (value * 0x1E35A7BDu) >> (32 - HASH4_BITS);
+}
+
+// Adds position to the tables, returning the last position with the same 3 byte prefix (or -1).
+static inline int32_t insertPosition(MatchFinder& finder, size_t position)
+{
+	int32_t shortCandidate = -1;
+	if (position + MIN_MATCH <= finder.size)
+	{
+		int32_t& bucket3 = finder.head3[hash3(finder.buffer + position)];
+		shortCandidate = bucket3;
+		bucket3 = (int32_t)position;
+	}
+
+	int32_t& previous = finder.prev[position & (WINDOW_SIZE - 1)];
+	if (position + 4 <= finder.size)
+	{
+		int32_t& bucket4 = finder.head4[hash4(finder.buffer + position)];
+		previous = bucket4;
+		bucket4 = (int32_t)position;
+	}
+	else
+	{
+		previous = -1;
+	}
+	return shortCandidate;
+}
+
+static inline unsigned int getMatchLength(const unsigned char* a, const unsigned char* b, unsigned int maxLength)
+{
+	unsigned int length = 0;
+	while (length + 8 <= maxLength)
+	{
+		uint64_t wordA, wordB;
+		memcpy(&wordA, a + length, 8);
+		memcpy(&wordB, b + length, 8);
+		if (wordA != wordB)
+		{
+			return length + countTrailingZeros(wordA ^ wordB) / 8;
+		}
+		length += 8;
+	}
+	while ((length < maxLength) && (a[length] == b[length]))
+	{
+		++length;
+	}
+	return length;
+}
+
+// Looks for a match at position longer than bestLength. Position must already have been inserted,
+// shortCandidate is what insertPosition() returned. Returns 0 if there isn't one.
+static unsigned int findLongestMatch(const MatchFinder& finder, size_t position, int32_t shortCandidate, unsigned int bestLength, unsigned int maxChain, unsigned int niceLength, unsigned int& bestDistance)
+{
+	const size_t available = finder.size - position;
+	const unsigned int maxLength = (available < MAX_MATCH) ? (unsigned int)available : MAX_MATCH;
+	if ((maxLength < MIN_MATCH) || (bestLength >= maxLength))
+	{
+		return 0;
+	}
+
+	if (niceLength > maxLength)
+	{
+		niceLength = maxLength;
+	}
+	const size_t minimumPosition = (position > MAXIMUM_DISTANCE) ? position - MAXIMUM_DISTANCE : 0;
+	const unsigned char* current = finder.buffer + position;
+	const unsigned int startingLength = bestLength;
+
+	if ((bestLength < MIN_MATCH) && (shortCandidate >= 0) && ((size_t)shortCandidate >= minimumPosition))
+	{
+		const unsigned char* match = finder.buffer + shortCandidate;
+		if ((match[0] == current[0]) && (match[1] == current[1]) && (match[2] == current[2]))
+		{
+			bestLength = getMatchLength(match, current, maxLength);
+			bestDistance = (unsigned int)(position - shortCandidate);
+			if (bestLength >= niceLength)
+			{
+				return bestLength;
+			}
+		}
+	}
+
+	int32_t candidate = finder.prev[position & (WINDOW_SIZE - 1)];
+	for (unsigned int chain = maxChain; (chain > 0) && (candidate >= 0) && ((size_t)candidate >= minimumPosition); --chain)
+	{
+		const unsigned char* match = finder.buffer + candidate;
+		if ((match[bestLength] == current[bestLength]) && (match[0] == current[0]) && (match[1] == current[1]))
+		{
+			const unsigned int length = getMatchLength(match, current, maxLength);
+			if (length > bestLength)
+			{
+				bestLength = length;
+				bestDistance = (unsigned int)(position - candidate);
+				if (length >= niceLength)
+				{
+					break;
+				}
+			}
+		}
+
+		const int32_t next = finder.prev[candidate & (WINDOW_SIZE - 1)];
+		if (next >= candidate)
+		{
+			break;
+		}
+		candidate = next;
+	}
+
+	return (bestLength > startingLength) ? bestLength : 0;
+}
+
+// Whether a match is worth taking for the strategy.
+static inline bool isUsefulMatch(unsigned int length, unsigned int distance, unsigned int minimumMatch)
+{
+	return (length >= minimumMatch) && !((length == MIN_MATCH) && (distance > TOO_FAR));
+}
+
+static void parseGreedy(DeflateEncoder& encoder, MatchFinder& finder, size_t start, const MatchFinderSettings& settings, unsigned int minimumMatch)
+{
+	size_t position = start;
+	while (position < finder.size)
+	{
+		const int32_t shortCandidate = insertPosition(finder, position);
+		unsigned int distance = 0;
+		const unsigned int length = findLongestMatch(finder, position, shortCandidate, MIN_MATCH - 1, settings.maxChain, settings.niceLength, distance);
+		if (isUsefulMatch(length, distance, minimumMatch))
+		{
+			addMatch(encoder, length, distance);
+			if (length <= settings.maxLazy)
+			{
+				for (size_t p = position + 1; p < position + length; ++p)
+				{
+					insertPosition(finder, p);
+				}
+			}
+			position += length;
+		}
+		else
+		{
+			addLiteral(encoder, finder.buffer[position]);
+			++position;
+		}
+	}
+}
+
+// As zlib's deflate_slow(): a match is only taken once the next position has been checked for a longer one.
+static void parseLazy(DeflateEncoder& encoder, MatchFinder& finder, size_t start, const MatchFinderSettings& settings, unsigned int minimumMatch)
+{
+	size_t position = start;
+	unsigned int previousLength = 0;
+	unsigned int previousDistance = 0;
+	bool literalPending = false; // The byte before position hasn't been emitted yet.
+
+	while (position < finder.size)
+	{
+		const int32_t shortCandidate = insertPosition(finder, position);
+		unsigned int length = 0;
+		unsigned int distance = 0;
+		if (previousLength < settings.maxLazy)
+		{
+			const unsigned int maxChain = (previousLength >= settings.goodLength) ? settings.maxChain / 4 : settings.maxChain;
+			length = findLongestMatch(finder, position, shortCandidate, (previousLength > MIN_MATCH - 1) ? previousLength : MIN_MATCH - 1, maxChain, settings.niceLength, distance);
+			if (!isUsefulMatch(length, distance, minimumMatch))
+			{
+				length = 0;
+			}
+		}
+
+		if ((previousLength >= minimumMatch) && (length <= previousLength))
+		{
+			addMatch(encoder, previousLength, previousDistance);
+			const size_t matchEnd = position - 1 + previousLength;
+			for (size_t p = position + 1; p < matchEnd; ++p)
+			{
+				insertPosition(finder, p);
+			}
+			position = matchEnd;
+			literalPending = false;
+			previousLength = 0;
+		}
+		else
+		{
+			if (literalPending)
+			{
+				addLiteral(encoder, finder.buffer[position - 1]);
+			}
+			literalPending = true;
+			previousLength = length;
+			previousDistance = distance;
+			++position;
+		}
+	}
+
+	if (literalPending)
+	{
+		addLiteral(encoder, finder.buffer[position - 1]);
+	}
+}
+
+// Z_RLE: only matches with the previous byte.
+static void parseRunLength(DeflateEncoder& encoder, const unsigned char* buffer, size_t start, size_t size)
+{
+	size_t position = start;
+	while (position < size)
+	{
+		unsigned int run = 0;
+		if (position > 0)
+		{
+			const size_t available = size - position;
+			const unsigned int maxLength = (available < MAX_MATCH) ? (unsigned int)available : MAX_MATCH;
+			while ((run < maxLength) && (buffer[position + run] == buffer[position - 1]))
+			{
+				++run;
+			}
+		}
+
+		if (run >= MIN_MATCH)
+		{
+			addMatch(encoder, run, 1);
+			position += run;
+		}
+		else
+		{
+			addLiteral(encoder, buffer[position]);
+			++position;
+		}
+	}
+}
+
+// Optimal parsing:
+// As in Zopfli, every match at every position of a block is found up front, then dynamic programming
+// finds the cheapest way through the block given a bit cost for each symbol. The first pass costs symbols
+// as the fixed Huffman code would, later ones by how often the previous pass used them (their entropy),
+// until a pass stops getting cheaper or OPTIMAL_PASSES are done. Block ends are chosen before parsing,
+// from the statistics of the longest match at each position, as the other parsers do.
+const unsigned int OPTIMAL_MAX_CHAIN = 1024;
+const unsigned int OPTIMAL_PASSES = 15;
+const unsigned int COST_SCALE = 16; // Costs are in 1/16ths of a bit.
+
+struct MatchCandidate
+{
+	uint16_t length;
+	uint16_t distance;
+};
+
+struct SymbolCosts
+{
+	uint32_t literal[256];
+	uint32_t length[MAX_MATCH + 1]; // Including the extra bits.
+	uint32_t distance[NUM_DISTANCE_SYMBOLS]; // Including the extra bits.
+};
+
+// Appends the matches at position, each longer than the one before, so the shortest distance for
+// any length is the first match at least that long. Position must already have been inserted.
+// Returns the longest length, or 0 if there's no match.
+static unsigned int findAllMatches(const MatchFinder& finder, size_t position, int32_t shortCandidate, unsigned int maxChain, std::vector<MatchCandidate>& matches)
+{
+	const size_t available = finder.size - position;
+	const unsigned int maxLength = (available < MAX_MATCH) ? (unsigned int)available : MAX_MATCH;
+	if (maxLength < MIN_MATCH)
+	{
+		return 0;
+	}
+
+	const size_t minimumPosition = (position > MAXIMUM_DISTANCE) ? position - MAXIMUM_DISTANCE : 0;
+	const unsigned char* current = finder.buffer + position;
+	unsigned int bestLength = MIN_MATCH - 1;
+
+	if ((shortCandidate >= 0) && ((size_t)shortCandidate >= minimumPosition))
+	{
+		const unsigned char* match = finder.buffer + shortCandidate;
+		if ((match[0] == current[0]) && (match[1] == current[1]) && (match[2] == current[2]))
+		{
+			bestLength = getMatchLength(match, current, maxLength);
+			matches.push_back(MatchCandidate{ (uint16_t)bestLength, (uint16_t)(position - shortCandidate) });
+			if (bestLength >= maxLength)
+			{
+				return bestLength;
+			}
+		}
+	}
+
+	int32_t candidate = finder.prev[position & (WINDOW_SIZE - 1)];
+	for (unsigned int chain = maxChain; (chain > 0) && (candidate >= 0) && ((size_t)candidate >= minimumPosition); --chain)
+	{
+		const unsigned char* match = finder.buffer + candidate;
+		if ((match[bestLength] == current[bestLength]) && (match[0] == current[0]) && (match[1] == current[1]))
+		{
+			const unsigned int length = getMatchLength(match, current, maxLength);
+			if (length > bestLength)
+			{
+				bestLength = length;
+				matches.push_back(MatchCandidate{ (uint16_t)length, (uint16_t)(position - candidate) });
+				if (length >= maxLength)
+				{
+					break;
+				}
+			}
+		}
+
+		const int32_t next = finder.prev[candidate & (WINDOW_SIZE - 1)];
+		if (next >= candidate)
+		{
+			break;
+		}
+		candidate = next;
+	}
+
+	return (bestLength >= MIN_MATCH) ? bestLength : 0;
+}
+
+static void setSymbolCosts(SymbolCosts& costs, const double* litLenBits, const double* distanceBits)
+{
+	for (unsigned int s = 0; s < 256; ++s)
+	{
+		costs.literal[s] = (uint32_t)(litLenBits[s] * COST_SCALE + 0.5);
+	}
+	for (unsigned int length = MIN_MATCH; length <= MAX_MATCH; ++length)
+	{
+		const unsigned int code = lookupTables.lengthCode[length];
+		costs.length[length] = (uint32_t)((litLenBits[END_OF_BLOCK + 1 + code] + LENGTH_EXTRA[code]) * COST_SCALE + 0.5);
+	}
+	for (unsigned int s = 0; s < NUM_DISTANCE_SYMBOLS; ++s)
+	{
+		costs.distance[s] = (uint32_t)((distanceBits[s] + DISTANCE_EXTRA[s]) * COST_SCALE + 0.5);
+	}
+}
+
+// -log2 of each symbol's probability. Unused symbols are costed as if they'd been used once.
+static void getEntropyBits(const uint32_t* frequencies, unsigned int numSymbols, double* bits)
+{
+	uint64_t total = 0;
+	for (unsigned int s = 0; s < numSymbols; ++s)
+	{
+		total += frequencies[s];
+	}
+	const double log2Total = (total > 0) ? log2((double)total) : 0.0;
+	for (unsigned int s = 0; s < numSymbols; ++s)
+	{
+		bits[s] = (frequencies[s] > 0) ? log2Total - log2((double)frequencies[s]) : log2Total;
+	}
+}
+
+// Works back from the end of the block to find the cheapest symbols to cover it, then reads them off from the start.
+static void findCheapestParse(const unsigned char* block, size_t blockLength, const std::vector<MatchCandidate>& matches, const std::vector<uint32_t>& matchStarts, const SymbolCosts& costs, std::vector<uint32_t>& pathCosts, std::vector<DeflateSymbol>& choices, std::vector<DeflateSymbol>& parse)
+{
+	pathCosts.assign(blockLength + 1, 0);
+	choices.resize(blockLength);
+	for (size_t i = blockLength; i-- > 0;)
+	{
+		uint32_t best = costs.literal[block[i]] + pathCosts[i + 1];
+		DeflateSymbol choice = { block[i], 0 };
+
+		// Any length up to a match's can be used at its distance:
+		const size_t remaining = blockLength - i;
+		unsigned int length = MIN_MATCH;
+		for (uint32_t m = matchStarts[i]; m < matchStarts[i + 1]; ++m)
+		{
+			const MatchCandidate& match = matches[m];
+			const unsigned int maxLength = (match.length < remaining) ? match.length : (unsigned int)remaining;
+			const uint32_t distanceCost = costs.distance[getDistanceCode(match.distance)];
+			for (; length <= maxLength; ++length)
+			{
+				const uint32_t cost = costs.length[length] + distanceCost + pathCosts[i + length];
+				if (cost < best)
+				{
+					best = cost;
+					choice = DeflateSymbol{ (uint16_t)(END_OF_BLOCK + length), match.distance };
+				}
+			}
+		}
+		pathCosts[i] = best;
+		choices[i] = choice;
+	}
+
+	parse.clear();
+	for (size_t i = 0; i < blockLength; i += (choices[i].litLen > END_OF_BLOCK) ? choices[i].litLen - END_OF_BLOCK : 1)
+	{
+		parse.push_back(choices[i]);
+	}
+}
+
+// Emits every block but the last, which is left for the caller to flush.
+static void parseOptimal(DeflateEncoder& encoder, MatchFinder& finder, size_t start)
+{
+	std::vector<MatchCandidate> matches;
+	std::vector<uint32_t> matchStarts; // For each position in the block, its first entry in matches.
+	std::vector<uint32_t> pathCosts;
+	std::vector<DeflateSymbol> choices;
+	std::vector<DeflateSymbol> parse;
+	std::vector<DeflateSymbol> bestParse;
+
+	size_t position = start;
+	while (position < finder.size)
+	{
+		// Find the block's matches, watching the longest ones for where the block should end:
+		const size_t blockStart = position;
+		size_t greedyPosition = position;
+		matches.clear();
+		matchStarts.clear();
+		while (position < finder.size)
+		{
+			const int32_t shortCandidate = insertPosition(finder, position);
+			matchStarts.push_back((uint32_t)matches.size());
+			const unsigned int longest = findAllMatches(finder, position, shortCandidate, OPTIMAL_MAX_CHAIN, matches);
+			if (position >= greedyPosition)
+			{
+				if (longest > 0)
+				{
+					observeMatch(encoder, longest);
+					greedyPosition = position + longest;
+				}
+				else
+				{
+					observeLiteral(encoder, finder.buffer[position]);
+					greedyPosition = position + 1;
+				}
+			}
+			++position;
+
+			// Nothing inside a match of the longest length is worth searching:
+			if (longest >= MAX_MATCH)
+			{
+				for (const size_t matchEnd = position - 1 + longest; position < matchEnd; ++position)
+				{
+					insertPosition(finder, position);
+					matchStarts.push_back((uint32_t)matches.size());
+				}
+			}
+
+			const uint64_t blockLength = position - blockStart;
+			if ((encoder.numNewObservations >= OBSERVATIONS_PER_BLOCK_CHECK) && (blockLength >= MIN_BLOCK_LENGTH) && (finder.size - position >= MIN_BLOCK_LENGTH) &&
+				((blockLength >= SOFT_MAX_BLOCK_LENGTH) || shouldEndBlock(encoder, blockLength)))
+			{
+				break;
+			}
+		}
+		matchStarts.push_back((uint32_t)matches.size());
+
+		// Parse it, re-estimating the costs each pass:
+		const size_t blockLength = position - blockStart;
+		unsigned char fixedLitLenLengths[NUM_FIXED_LITLEN_SYMBOLS];
+		unsigned char fixedDistanceLengths[NUM_DISTANCE_SYMBOLS];
+		getFixedCodeLengths(fixedLitLenLengths, fixedDistanceLengths);
+		double litLenBits[NUM_FIXED_LITLEN_SYMBOLS];
+		double distanceBits[NUM_DISTANCE_SYMBOLS];
+		for (unsigned int s = 0; s < NUM_FIXED_LITLEN_SYMBOLS; ++s)
+		{
+			litLenBits[s] = fixedLitLenLengths[s];
+		}
+		for (unsigned int s = 0; s < NUM_DISTANCE_SYMBOLS; ++s)
+		{
+			distanceBits[s] = fixedDistanceLengths[s];
+		}
+
+		SymbolCosts costs;
+		setSymbolCosts(costs, litLenBits, distanceBits);
+		uint64_t bestBits = UINT64_MAX;
+		uint64_t previousBits = UINT64_MAX;
+		for (unsigned int pass = 0; pass < OPTIMAL_PASSES; ++pass)
+		{
+			findCheapestParse(finder.buffer + blockStart, blockLength, matches, matchStarts, costs, pathCosts, choices, parse);
+
+			uint32_t litLenFrequencies[NUM_LITLEN_SYMBOLS] = {};
+			uint32_t distanceFrequencies[NUM_DISTANCE_SYMBOLS] = {};
+			for (const DeflateSymbol& symbol : parse)
+			{
+				if (symbol.litLen > END_OF_BLOCK)
+				{
+					litLenFrequencies[END_OF_BLOCK + 1 + lookupTables.lengthCode[symbol.litLen - END_OF_BLOCK]]++;
+					distanceFrequencies[getDistanceCode(symbol.distance)]++;
+				}
+				else
+				{
+					litLenFrequencies[symbol.litLen]++;
+				}
+			}
+			litLenFrequencies[END_OF_BLOCK]++;
+
+			unsigned char litLenLengths[NUM_LITLEN_SYMBOLS];
+			unsigned char distanceLengths[NUM_DISTANCE_SYMBOLS];
+			if (encoder.fixedCodeOnly)
+			{
+				memcpy(litLenLengths, fixedLitLenLengths, NUM_LITLEN_SYMBOLS);
+				memcpy(distanceLengths, fixedDistanceLengths, NUM_DISTANCE_SYMBOLS);
+			}
+			else
+			{
+				buildCodeLengths(litLenFrequencies, NUM_LITLEN_SYMBOLS, MAX_CODE_LENGTH, litLenLengths);
+				buildCodeLengths(distanceFrequencies, NUM_DISTANCE_SYMBOLS, MAX_CODE_LENGTH, distanceLengths);
+			}
+			const uint64_t bits = getSymbolBits(litLenFrequencies, distanceFrequencies, litLenLengths, distanceLengths);
+			if (bits < bestBits)
+			{
+				bestBits = bits;
+				bestParse.swap(parse);
+			}
+
+			// The fixed code's costs never change:
+			if (encoder.fixedCodeOnly || (bits >= previousBits))
+			{
+				break;
+			}
+			previousBits = bits;
+			getEntropyBits(litLenFrequencies, NUM_LITLEN_SYMBOLS, litLenBits);
+			getEntropyBits(distanceFrequencies, NUM_DISTANCE_SYMBOLS, distanceBits);
+			setSymbolCosts(costs, litLenBits, distanceBits);
+		}
+
+		for (const DeflateSymbol& symbol : bestParse)
+		{
+			if (symbol.litLen > END_OF_BLOCK)
+			{
+				recordMatch(encoder, symbol.litLen - END_OF_BLOCK, symbol.distance);
+			}
+			else
+			{
+				recordLiteral(encoder, (unsigned char)symbol.litLen);
+			}
+		}
+		if (position < finder.size)
+		{
+			flushBlock(encoder, false);
+		}
+	}
+}
+
+static bool deflateWholeBuffer(const unsigned char* data, unsigned int size, const unsigned char* dictionary, unsigned int dictionaryLength, int level, int strategy, bool optimal, unsigned char* out, unsigned int outCapacity, unsigned int& outSize)
+{
+	if ((level == Z_DEFAULT_COMPRESSION) || (level > 9))
+	{
+		level = (level > 9) ? 9 : 6;
+	}
+	if (level < 0)
+	{
+		return false;
+	}
+
+	// As with deflateSetDictionary(), the header has the Adler-32 of the whole dictionary but only the end of a long one can be reached:
+	const bool hasDictionary = (dictionaryLength > 0);
+	const uLong dictionaryAdler = adler32(adler32(0L, Z_NULL, 0), dictionary, dictionaryLength);
+	if (dictionaryLength > WINDOW_SIZE)
+	{
+		dictionary += dictionaryLength - WINDOW_SIZE;
+		dictionaryLength = WINDOW_SIZE;
+	}
+
+	std::vector<unsigned char> buffer(dictionaryLength + (size_t)size);
+	if (dictionaryLength > 0)
+	{
+		memcpy(buffer.data(), dictionary, dictionaryLength);
+	}
+	if (size > 0)
+	{
+		memcpy(buffer.data() + dictionaryLength, data, size);
+	}
+
+	DeflateEncoder encoder = {};
+	encoder.buffer = buffer.data();
+	encoder.bufferSize = buffer.size();
+	encoder.fixedCodeOnly = (strategy == Z_FIXED);
+	encoder.blockStart = dictionaryLength;
+	encoder.inputEnd = dictionaryLength;
+	encoder.output.reserve(size / 2 + 64);
+	encoder.symbols.reserve(SOFT_MAX_BLOCK_LENGTH + OBSERVATIONS_PER_BLOCK_CHECK);
+
+	// zlib header (RFC 1950), with the dictionary's Adler-32 if there is one:
+	const unsigned int levelFlags = ((strategy >= Z_HUFFMAN_ONLY) || (level < 2)) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+	unsigned int header = ((Z_DEFLATED + (7 << 4)) << 8) | (levelFlags << 6);
+	if (hasDictionary)
+	{
+		header |= 0x20;
+	}
+	header += 31 - (header % 31);
+	encoder.output.push_back((unsigned char)(header >> 8));
+	encoder.output.push_back((unsigned char)header);
+	if (hasDictionary)
+	{
+		for (int shift = 24; shift >= 0; shift -= 8)
+		{
+			encoder.output.push_back((unsigned char)(dictionaryAdler >> shift));
+		}
+	}
+
+	if (level == 0)
+	{
+		encoder.inputEnd = buffer.size();
+		writeStoredBlocks(encoder, true);
+	}
+	else
+	{
+		if (strategy == Z_HUFFMAN_ONLY)
+		{
+			for (size_t position = dictionaryLength; position < buffer.size(); ++position)
+			{
+				addLiteral(encoder, buffer[position]);
+			}
+		}
+		else if (strategy == Z_RLE)
+		{
+			parseRunLength(encoder, buffer.data(), dictionaryLength, buffer.size());
+		}
+		else
+		{
+			MatchFinder finder;
+			finder.buffer = buffer.data();
+			finder.size = buffer.size();
+			finder.head3.assign((size_t)1 << HASH3_BITS, -1);
+			finder.head4.assign((size_t)1 << HASH4_BITS, -1);
+			finder.prev.assign(WINDOW_SIZE, -1);
+			for (size_t position = 0; position < dictionaryLength; ++position)
+			{
+				insertPosition(finder, position);
+			}
+
+			// Z_FILTERED drops short matches in favour of literals, as zlib does:
+			const unsigned int minimumMatch = (strategy == Z_FILTERED) ? 6 : MIN_MATCH;
+			const MatchFinderSettings& settings = LEVEL_SETTINGS[level];
+			if (optimal)
+			{
+				parseOptimal(encoder, finder, dictionaryLength);
+			}
+			else if (settings.lazy)
+			{
+				parseLazy(encoder, finder, dictionaryLength, settings, minimumMatch);
+			}
+			else
+			{
+				parseGreedy(encoder, finder, dictionaryLength, settings, minimumMatch);
+			}
+		}
+		flushBlock(encoder, true);
+	}
+	flushBits(encoder);
+
+	const uLong dataAdler = adler32(adler32(0L, Z_NULL, 0), data, size);
+	for (int shift = 24; shift >= 0; shift -= 8)
+	{
+		encoder.output.push_back((unsigned char)(dataAdler >> shift));
+	}
+
+	if (encoder.output.size() > outCapacity)
+	{
+		return false;
+	}
+	memcpy(out, encoder.output.data(), encoder.output.size());
+	outSize = (unsigned int)encoder.output.size();
+	return true;
+}
+
+bool wholeBufferDeflate(const unsigned char* data, unsigned int size, const unsigned char* dictionary, unsigned int dictionaryLength, int level, int strategy, unsigned char* out, unsigned int outCapacity, unsigned int& outSize)
+{
+	return deflateWholeBuffer(data, size, dictionary, dictionaryLength, level, strategy, false, out, outCapacity, outSize);
+}
+
+bool optimalDeflate(const unsigned char* data, unsigned int size, const unsigned char* dictionary, unsigned int dictionaryLength, int strategy, unsigned char* out, unsigned int outCapacity, unsigned int& outSize)
+{
+	if ((strategy != Z_DEFAULT_STRATEGY) && (strategy != Z_FIXED))
+	{
+		return false;
+	}
+	return deflateWholeBuffer(data, size, dictionary, dictionaryLength, Z_BEST_COMPRESSION, strategy, true, out, outCapacity, outSize);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+// Whole buffer DEFLATE encoder:
+// An alternative to zlib's deflate() for when the whole chunk is already in memory. There's no sliding
+// window or incremental state to keep up; the match finder runs over the dictionary and chunk as one
+// buffer, and blocks are ended where the statistics of the data change rather than when a buffer fills.
+// The output is a standard zlib stream (RFC 1950/1951), so inflate() reads it as usual.
+
+#include <stdint.h>
+
+// Compresses size bytes of data. level (0-9) and strategy (Z_DEFAULT_STRATEGY etc.) mean what they do to
+// deflateInit2(); there's no memLevel, the match finder's tables don't depend on it. A dictionary of up to
+// 32KB can be given, as with deflateSetDictionary(). Fails if the result doesn't fit in outCapacity bytes.
+bool wholeBufferDeflate(const unsigned char* data, unsigned int size, const unsigned char* dictionary, unsigned int dictionaryLength, int level, int strategy, unsigned char* out, unsigned int outCapacity, unsigned int& outSize);
+
+// As wholeBufferDeflate() at level 9, but each block is parsed optimally for the Huffman codes it ends up
+// with (as Zopfli does) instead of greedily or lazily. Many times slower, for a few percent smaller output.
+// Only Z_DEFAULT_STRATEGY and Z_FIXED mean anything here, other strategies fail.
+bool optimalDeflate(const unsigned char* data, unsigned int size, const unsigned char* dictionary, unsigned int dictionaryLength, int strategy, unsigned char* out, unsigned int outCapacity, unsigned int& outSize);
@@ -0,0 +1,129 @@
+#include "MappedFile.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h> // CreateFileMapping, MapViewOfFile
+#else
+#include <unistd.h> // close, ftruncate
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#endif
+
+void unmapFile(MappedFile& mappedFile)
+{
+#ifdef _WIN32
+	if (mappedFile.data)
+	{
+		UnmapViewOfFile(mappedFile.data);
+	}
+	if (mappedFile.mappingHandle)
+	{
+		CloseHandle(mappedFile.mappingHandle);
+	}
+	if (mappedFile.fileHandle != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(mappedFile.fileHandle);
+	}
+	mappedFile.fileHandle = INVALID_HANDLE_VALUE;
+	mappedFile.mappingHandle = nullptr;
+#else
+	if (mappedFile.data)
+	{
+		munmap(mappedFile.data, mappedFile.size);
+	}
+	if (mappedFile.fileDescriptor >= 0)
+	{
+		close(mappedFile.fileDescriptor);
+	}
+	mappedFile.fileDescriptor = -1;
+#endif
+	mappedFile.data = nullptr;
+	mappedFile.size = 0;
+}
+
+bool mapFile(const char* filePath, bool writable, size_t size, MappedFile& mappedFile)
+{
+	mappedFile.data = nullptr;
+	mappedFile.size = 0;
+#ifdef _WIN32
+	mappedFile.mappingHandle = nullptr;
+	mappedFile.fileHandle = CreateFileA(filePath, writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, writable ? 0 : FILE_SHARE_READ, nullptr, writable ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (mappedFile.fileHandle == INVALID_HANDLE_VALUE)
+	{
+		printf("Error opening %s for %s.\n", filePath, writable ? "writing" : "reading");
+		return false;
+	}
+
+	if (!writable)
+	{
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(mappedFile.fileHandle, &fileSize))
+		{
+			printf("Unable to get the size of %s.\n", filePath);
+			unmapFile(mappedFile);
+			return false;
+		}
+		size = (size_t)fileSize.QuadPart;
+	}
+
+	if (size > 0)
+	{
+		// Mapping a writable file bigger than it is extends it:
+		mappedFile.mappingHandle = CreateFileMappingA(mappedFile.fileHandle, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, (DWORD)((uint64_t)size >> 32), (DWORD)size, nullptr);
+		mappedFile.data = mappedFile.mappingHandle ? (unsigned char*)MapViewOfFile(mappedFile.mappingHandle, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size) : nullptr;
+		if (!mappedFile.data)
+		{
+			printf("Unable to map %s.\n", filePath);
+			unmapFile(mappedFile);
+			return false;
+		}
+	}
+#else
+	mappedFile.fileDescriptor = open(filePath, writable ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY, 0666);
+	if (mappedFile.fileDescriptor < 0)
+	{
+		printf("Error opening %s for %s.\n", filePath, writable ? "writing" : "reading");
+		return false;
+	}
+
+	if (writable)
+	{
+		if (ftruncate(mappedFile.fileDescriptor, (off_t)size) != 0)
+		{
+			printf("Unable to size %s.\n", filePath);
+			unmapFile(mappedFile);
+			return false;
+		}
+	}
+	else
+	{
+		struct stat fileStatus;
+		if (fstat(mappedFile.fileDescriptor, &fileStatus) != 0)
+		{
+			printf("Unable to get the size of %s.\n", filePath);
+			unmapFile(mappedFile);
+			return false;
+		}
+		size = (size_t)fileStatus.st_size;
+	}
+
+	if (size > 0)
+	{
+		void* data = mmap(nullptr, size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, mappedFile.fileDescriptor, 0);
+		if (data == MAP_FAILED)
+		{
+			printf("Unable to map %s.\n", filePath);
+			unmapFile(mappedFile);
+			return false;
+		}
+		mappedFile.data = (unsigned char*)data;
+	}
+#endif
+	mappedFile.size = size;
+	return true;
+}
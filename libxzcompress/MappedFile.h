@@ -0,0 +1,26 @@
+#pragma once
+
+// Memory mapped files:
+// A whole file mapped into memory, read only or read/write. Restoring and the random access reader
+// inflate chunks straight out of a mapping of the compressed file, and restoring inflates them straight
+// into a mapping of the output file, so the data isn't copied through read and write buffers on the way.
+
+#include <stddef.h>
+
+struct MappedFile
+{
+	unsigned char* data;
+	size_t size;
+#ifdef _WIN32
+	void* fileHandle; // HANDLE
+	void* mappingHandle; // HANDLE
+#else
+	int fileDescriptor;
+#endif
+};
+
+// Maps a whole file for reading, or when writable creates (or truncates) the file at size bytes and maps that.
+// An empty file maps successfully with data left null.
+bool mapFile(const char* filePath, bool writable, size_t size, MappedFile& mappedFile);
+
+void unmapFile(MappedFile& mappedFile);
@@ -0,0 +1,1572 @@
+#include "MetaData.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h> // stat
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h> // LockFileEx, MoveFileEx
+#include <io.h> // _commit, _chsize_s, _get_osfhandle
+#else
+#include <unistd.h> // fdatasync, ftruncate
+#include <sys/file.h> // flock
+#endif
+
+#include "SimdKernels.h"
+
+// Fast parsing:
+// jsoncpp's reader goes through the text a character at a time, keeping every comment it finds, which for a
+// large meta data file is most of the time it takes to open. Meta data files are plain Json, so they're parsed
+// here straight into Json::Values instead: strings are found with findJsonStringEnd() and only copied once,
+// and keys are added to their object without a std::string of their own. The Values come out as jsoncpp's
+// would, down to which numbers are ints. Anything this doesn't take (comments, trailing commas, lone
+// surrogates, numbers jsoncpp is lenient about) makes it give up, and the text is left to jsoncpp.
+// It can also list an object's members without parsing their values, by matching up the brackets found with
+// findJsonStructure(), which is how a reader loads one file's entry without the rest (readMetaDataEntry()).
+struct MetaDataMember
+{
+	std::string name;
+	const char* valueBegin;
+	const char* valueEnd;
+};
+
+class MetaDataParser
+{
+public:
+	MetaDataParser(const char* begin, const char* end);
+
+	// The whole text as one value, with nothing but whitespace after it.
+	bool parseDocument(Json::Value& value);
+
+	// The whole text as one object, each member's name and where its value is.
+	bool indexObject(std::vector<MetaDataMember>& members);
+
+private:
+	bool parseValue(Json::Value& value, unsigned int depth);
+	bool parseString(const char*& textBegin, const char*& textEnd);
+	bool parseNumber(Json::Value& value);
+	bool parseLiteral(const char* literal, size_t length);
+	bool skipValue();
+	bool skipString();
+	void skipWhitespace();
+
+	const char* position;
+	const char* end;
+	std::string decodedText; // A string that had escapes in it, the last one parsed.
+};
+
+const unsigned int MAXIMUM_PARSE_DEPTH = 256; // Deeper than any meta data goes, jsoncpp gets anything deeper.
+
+MetaDataParser::MetaDataParser(const char* begin, const char* end)
+	: position(begin), end(end)
+{
+}
+
+bool MetaDataParser::parseDocument(Json::Value& value)
+{
+	skipWhitespace();
+	if (!parseValue(value, 0))
+	{
+		return false;
+	}
+	skipWhitespace();
+	return position == end;
+}
+
+bool MetaDataParser::indexObject(std::vector<MetaDataMember>& members)
+{
+	skipWhitespace();
+	if ((position == end) || (*position != '{'))
+	{
+		return false;
+	}
+	++position;
+	skipWhitespace();
+	if ((position != end) && (*position == '}'))
+	{
+		++position;
+		skipWhitespace();
+		return position == end;
+	}
+
+	while (true)
+	{
+		MetaDataMember member;
+		const char* nameBegin = nullptr;
+		const char* nameEnd = nullptr;
+		if ((position == end) || (*position != '"') || !parseString(nameBegin, nameEnd))
+		{
+			return false;
+		}
+		member.name.assign(nameBegin, nameEnd);
+		skipWhitespace();
+		if ((position == end) || (*position != ':'))
+		{
+			return false;
+		}
+		++position;
+		skipWhitespace();
+		member.valueBegin = position;
+		if (!skipValue())
+		{
+			return false;
+		}
+		member.valueEnd = position;
+		members.push_back(member);
+
+		skipWhitespace();
+		if (position == end)
+		{
+			return false;
+		}
+		if (*position == '}')
+		{
+			++position;
+			skipWhitespace();
+			return position == end;
+		}
+		if (*position != ',')
+		{
+			return false;
+		}
+		++position;
+		skipWhitespace();
+	}
+}
+
+void MetaDataParser::skipWhitespace()
+{
+	while ((position != end) && ((*position == ' ') || (*position == '\n') || (*position == '\r') || (*position == '\t')))
+	{
+		++position;
+	}
+}
+
+bool MetaDataParser::parseValue(Json::Value& value, unsigned int depth)
+{
+	if ((position == end) || (depth > MAXIMUM_PARSE_DEPTH))
+	{
+		return false;
+	}
+
+	switch (*position)
+	{
+	case '{':
+	{
+		value = Json::Value(Json::objectValue);
+		++position;
+		skipWhitespace();
+		if ((position != end) && (*position == '}'))
+		{
+			++position;
+			return true;
+		}
+		while (true)
+		{
+			const char* nameBegin = nullptr;
+			const char* nameEnd = nullptr;
+			if ((position == end) || (*position != '"') || !parseString(nameBegin, nameEnd))
+			{
+				return false;
+			}
+			Json::Value* member = value.demand(nameBegin, nameEnd); // A repeated name replaces the first, as in jsoncpp.
+			skipWhitespace();
+			if ((position == end) || (*position != ':'))
+			{
+				return false;
+			}
+			++position;
+			skipWhitespace();
+			if (!parseValue(*member, depth + 1))
+			{
+				return false;
+			}
+			skipWhitespace();
+			if (position == end)
+			{
+				return false;
+			}
+			if (*position == '}')
+			{
+				++position;
+				return true;
+			}
+			if (*position != ',')
+			{
+				return false;
+			}
+			++position;
+			skipWhitespace();
+		}
+	}
+	case '[':
+	{
+		value = Json::Value(Json::arrayValue);
+		++position;
+		skipWhitespace();
+		if ((position != end) && (*position == ']'))
+		{
+			++position;
+			return true;
+		}
+		while (true)
+		{
+			if (!parseValue(value.append(Json::Value()), depth + 1))
+			{
+				return false;
+			}
+			skipWhitespace();
+			if (position == end)
+			{
+				return false;
+			}
+			if (*position == ']')
+			{
+				++position;
+				return true;
+			}
+			if (*position != ',')
+			{
+				return false;
+			}
+			++position;
+			skipWhitespace();
+		}
+	}
+	case '"':
+	{
+		const char* textBegin = nullptr;
+		const char* textEnd = nullptr;
+		if (!parseString(textBegin, textEnd))
+		{
+			return false;
+		}
+		value = Json::Value(textBegin, textEnd);
+		return true;
+	}
+	case 't':
+		value = true;
+		return parseLiteral("true", 4);
+	case 'f':
+		value = false;
+		return parseLiteral("false", 5);
+	case 'n':
+		value = Json::Value();
+		return parseLiteral("null", 4);
+	default:
+		return parseNumber(value);
+	}
+}
+
+bool MetaDataParser::parseLiteral(const char* literal, size_t length)
+{
+	if (((size_t)(end - position) < length) || (memcmp(position, literal, length) != 0))
+	{
+		return false;
+	}
+	position += length;
+	return true;
+}
+
+unsigned int decodeHexDigits(const char* digits)
+{
+	unsigned int value = 0;
+	for (int i = 0; i < 4; ++i)
+	{
+		const char c = digits[i];
+		value <<= 4;
+		if ((c >= '0') && (c <= '9'))
+		{
+			value += c - '0';
+		}
+		else if ((c >= 'a') && (c <= 'f'))
+		{
+			value += c - 'a' + 10;
+		}
+		else if ((c >= 'A') && (c <= 'F'))
+		{
+			value += c - 'A' + 10;
+		}
+		else
+		{
+			return 0xFFFFFFFF;
+		}
+	}
+	return value;
+}
+
+void appendUtf8(unsigned int codePoint, std::string& text)
+{
+	if (codePoint < 0x80)
+	{
+		text += (char)codePoint;
+	}
+	else if (codePoint < 0x800)
+	{
+		text += (char)(0xC0 | (codePoint >> 6));
+		text += (char)(0x80 | (codePoint & 0x3F));
+	}
+	else if (codePoint < 0x10000)
+	{
+		text += (char)(0xE0 | (codePoint >> 12));
+		text += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+		text += (char)(0x80 | (codePoint & 0x3F));
+	}
+	else
+	{
+		text += (char)(0xF0 | (codePoint >> 18));
+		text += (char)(0x80 | ((codePoint >> 12) & 0x3F));
+		text += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+		text += (char)(0x80 | (codePoint & 0x3F));
+	}
+}
+
+// Points textBegin and textEnd at the string's characters: in the text itself if it has no escapes, otherwise
+// in decodedText, valid until the next string is parsed.
+bool MetaDataParser::parseString(const char*& textBegin, const char*& textEnd)
+{
+	const char* stringBegin = position + 1;
+	const char* stringEnd = findJsonStringEnd(stringBegin, end);
+	if (stringEnd == end)
+	{
+		return false;
+	}
+	if (*stringEnd == '"')
+	{
+		textBegin = stringBegin;
+		textEnd = stringEnd;
+		position = stringEnd + 1;
+		return true;
+	}
+
+	decodedText.assign(stringBegin, stringEnd);
+	const char* current = stringEnd;
+	while (*current != '"')
+	{
+		// At a backslash:
+		if (end - current < 2)
+		{
+			return false;
+		}
+		const char escape = current[1];
+		current += 2;
+		switch (escape)
+		{
+		case '"':
+		case '\\':
+		case '/':
+			decodedText += escape;
+			break;
+		case 'b':
+			decodedText += '\b';
+			break;
+		case 'f':
+			decodedText += '\f';
+			break;
+		case 'n':
+			decodedText += '\n';
+			break;
+		case 'r':
+			decodedText += '\r';
+			break;
+		case 't':
+			decodedText += '\t';
+			break;
+		case 'u':
+		{
+			if (end - current < 4)
+			{
+				return false;
+			}
+			unsigned int codePoint = decodeHexDigits(current);
+			current += 4;
+			if ((codePoint >= 0xD800) && (codePoint <= 0xDBFF))
+			{
+				// The first half of a surrogate pair, the second has to follow:
+				if ((end - current < 6) || (current[0] != '\\') || (current[1] != 'u'))
+				{
+					return false;
+				}
+				const unsigned int lowSurrogate = decodeHexDigits(current + 2);
+				if ((lowSurrogate < 0xDC00) || (lowSurrogate > 0xDFFF))
+				{
+					return false;
+				}
+				codePoint = 0x10000 + ((codePoint & 0x3FF) << 10) + (lowSurrogate & 0x3FF);
+				current += 6;
+			}
+			else if (((codePoint >= 0xDC00) && (codePoint <= 0xDFFF)) || (codePoint > 0xFFFF)) // A lone second half, or a bad digit.
+			{
+				return false;
+			}
+			appendUtf8(codePoint, decodedText);
+			break;
+		}
+		default:
+			return false;
+		}
+
+		const char* next = findJsonStringEnd(current, end);
+		if (next == end)
+		{
+			return false;
+		}
+		decodedText.append(current, next);
+		current = next;
+	}
+
+	textBegin = decodedText.data();
+	textEnd = textBegin + decodedText.size();
+	position = current + 1;
+	return true;
+}
+
+// Only numbers exactly as Json has them. Whole numbers are ints if they fit in one, unsigned if they only
+// fit in that, and doubles if they don't fit at all, which is how jsoncpp decides.
+bool MetaDataParser::parseNumber(Json::Value& value)
+{
+	const char* numberBegin = position;
+	const bool isNegative = (*position == '-');
+	if (isNegative)
+	{
+		++position;
+	}
+	if ((position == end) || (*position < '0') || (*position > '9') || ((*position == '0') && (position + 1 != end) && (position[1] >= '0') && (position[1] <= '9')))
+	{
+		return false;
+	}
+
+	Json::LargestUInt magnitude = 0;
+	bool overflowed = false;
+	for (; (position != end) && (*position >= '0') && (*position <= '9'); ++position)
+	{
+		const unsigned int digit = *position - '0';
+		overflowed = overflowed || (magnitude > (Json::Value::maxLargestUInt - digit) / 10);
+		magnitude = magnitude * 10 + digit;
+	}
+
+	bool isInteger = true;
+	if ((position != end) && (*position == '.'))
+	{
+		isInteger = false;
+		++position;
+		if ((position == end) || (*position < '0') || (*position > '9'))
+		{
+			return false;
+		}
+		while ((position != end) && (*position >= '0') && (*position <= '9'))
+		{
+			++position;
+		}
+	}
+	if ((position != end) && ((*position == 'e') || (*position == 'E')))
+	{
+		isInteger = false;
+		++position;
+		if ((position != end) && ((*position == '+') || (*position == '-')))
+		{
+			++position;
+		}
+		if ((position == end) || (*position < '0') || (*position > '9'))
+		{
+			return false;
+		}
+		while ((position != end) && (*position >= '0') && (*position <= '9'))
+		{
+			++position;
+		}
+	}
+
+	const Json::LargestUInt largestNegativeMagnitude = (Json::LargestUInt)Json::Value::maxLargestInt + 1;
+	if (isInteger && !overflowed && (!isNegative || (magnitude <= largestNegativeMagnitude)))
+	{
+		if (isNegative)
+		{
+			value = (magnitude == largestNegativeMagnitude) ? Json::Value::minLargestInt : -(Json::LargestInt)magnitude;
+		}
+		else if (magnitude <= (Json::LargestUInt)Json::Value::maxLargestInt)
+		{
+			value = (Json::LargestInt)magnitude;
+		}
+		else
+		{
+			value = magnitude;
+		}
+		return true;
+	}
+
+	// Numbers jsoncpp reads as doubles, out of range ones are left to it:
+	const std::string number(numberBegin, position);
+	char* numberEnd = nullptr;
+	errno = 0;
+	const double decoded = strtod(number.c_str(), &numberEnd);
+	if ((errno == ERANGE) || (numberEnd != number.c_str() + number.size()))
+	{
+		return false;
+	}
+	value = decoded;
+	return true;
+}
+
+bool MetaDataParser::skipString()
+{
+	const char* current = position + 1;
+	while (true)
+	{
+		current = findJsonStringEnd(current, end);
+		if (end - current < 2)
+		{
+			if ((current != end) && (*current == '"'))
+			{
+				position = current + 1;
+				return true;
+			}
+			return false;
+		}
+		if (*current == '"')
+		{
+			position = current + 1;
+			return true;
+		}
+		current += 2; // An escape, whatever follows the backslash can't end the string.
+	}
+}
+
+// Steps over the value without looking at what's in it, only matching up its brackets.
+bool MetaDataParser::skipValue()
+{
+	if (position == end)
+	{
+		return false;
+	}
+	if (*position == '"')
+	{
+		return skipString();
+	}
+	if ((*position != '{') && (*position != '['))
+	{
+		// A number or a literal, up to whatever ends it:
+		const char* valueBegin = position;
+		while ((position != end) && (*position != ',') && (*position != '}') && (*position != ']') &&
+			(*position != ' ') && (*position != '\n') && (*position != '\r') && (*position != '\t'))
+		{
+			++position;
+		}
+		return position != valueBegin;
+	}
+
+	unsigned int depth = 0;
+	while (true)
+	{
+		position = findJsonStructure(position, end);
+		if (position == end)
+		{
+			return false;
+		}
+		if (*position == '"')
+		{
+			if (!skipString())
+			{
+				return false;
+			}
+			continue;
+		}
+		const bool opening = ((*position | 0x20) == '{');
+		++position;
+		if (opening)
+		{
+			++depth;
+		}
+		else if (--depth == 0)
+		{
+			return true;
+		}
+	}
+}
+
+// The fast parser, or jsoncpp's for anything it doesn't take.
+bool parseMetaDataText(const char* begin, const char* end, Json::Value& value)
+{
+	MetaDataParser parser(begin, end);
+	if (parser.parseDocument(value))
+	{
+		return true;
+	}
+
+	value = Json::Value();
+	Json::CharReaderBuilder builder;
+	std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+	std::string errs;
+	return reader->parse(begin, end, &value, &errs);
+}
+
+const size_t METADATA_READ_BUFFER_SIZE = 1024 * 1024;
+
+// Reads the rest of an open file.
+bool readWholeFile(FILE* fileHandle, std::string& text)
+{
+	text.clear();
+#ifdef _WIN32
+	struct _stat64 fileStatus;
+	if (_fstat64(_fileno(fileHandle), &fileStatus) == 0)
+#else
+	struct stat fileStatus;
+	if (fstat(fileno(fileHandle), &fileStatus) == 0)
+#endif
+	{
+		text.reserve((size_t)fileStatus.st_size);
+	}
+
+	std::vector<char> buffer(METADATA_READ_BUFFER_SIZE);
+	size_t bytesRead = 0;
+	while ((bytesRead = fread(buffer.data(), 1, buffer.size(), fileHandle)) > 0)
+	{
+		text.append(buffer.data(), bytesRead);
+	}
+	if (ferror(fileHandle))
+	{
+		printf("An error occurred reading the metadata.\n");
+		return false;
+	}
+	return true;
+}
+
+bool readTextFile(const char* filePath, std::string& text, bool& fileExists)
+{
+	FILE* fileHandle = nullptr;
+	fileExists = (fopen_s(&fileHandle, filePath, "rb") == 0);
+	if (!fileExists)
+	{
+		text.clear();
+		return true;
+	}
+	const bool success = readWholeFile(fileHandle, text);
+	fclose(fileHandle);
+	return success;
+}
+
+bool parseMetaDataFile(const std::string& metaDataText, Json::Value& rootJsonValue)
+{
+	if (!parseMetaDataText(metaDataText.data(), metaDataText.data() + metaDataText.size(), rootJsonValue))
+	{
+		printf("An existing Json file was found but an error occurred during parsing.\n");
+		return false;
+	}
+	return true;
+}
+
+bool lockFile(FILE* fileHandle, bool exclusive);
+void unlockFile(FILE* fileHandle);
+void splitMetaDataLog(const std::string& logText, std::vector<std::pair<const char*, const char*> >& lines);
+void applyMetaDataLog(const std::string& logText, Json::Value& rootJsonValue);
+
+// Reads the meta data file, and its log if it has one, as they are. Both are read under the log's lock, so
+// a compaction can't move the log's entries into the file in between.
+bool readMetaDataTexts(const char* metaDataFilePath, std::string& metaDataText, bool& metaDataFileExists, std::string& logText, bool& logExists)
+{
+	const std::string logFilePath = getMetaDataLogFilePath(metaDataFilePath);
+	FILE* logFileHandle = nullptr;
+	logExists = (fopen_s(&logFileHandle, logFilePath.c_str(), "rb") == 0);
+	if (!logExists)
+	{
+		logText.clear();
+		return readTextFile(metaDataFilePath, metaDataText, metaDataFileExists);
+	}
+
+	const bool success = lockFile(logFileHandle, false) && readTextFile(metaDataFilePath, metaDataText, metaDataFileExists) && readWholeFile(logFileHandle, logText);
+	unlockFile(logFileHandle);
+	fclose(logFileHandle);
+	return success;
+}
+
+bool readMetaDataFile(const char* metaDataFilePath, Json::Value& rootJsonValue, bool& fileExists)
+{
+	std::string metaDataText;
+	std::string logText;
+	bool logExists = false;
+	if (!readMetaDataTexts(metaDataFilePath, metaDataText, fileExists, logText, logExists))
+	{
+		return false;
+	}
+
+	if (fileExists && !parseMetaDataFile(metaDataText, rootJsonValue))
+	{
+		return false;
+	}
+	if (logExists)
+	{
+		fileExists = true;
+		applyMetaDataLog(logText, rootJsonValue);
+	}
+	return true;
+}
+
+bool readMetaDataEntry(const char* metaDataFilePath, const std::string& fileKey, Json::Value& rootJsonValue, bool& fileExists)
+{
+	std::string metaDataText;
+	std::string logText;
+	bool logExists = false;
+	if (!readMetaDataTexts(metaDataFilePath, metaDataText, fileExists, logText, logExists))
+	{
+		return false;
+	}
+
+	// Where each entry's value is, the log's lines replacing the file's in order:
+	std::unordered_map<std::string, std::pair<const char*, const char*> > entries;
+	std::vector<MetaDataMember> members;
+	if (fileExists)
+	{
+		MetaDataParser parser(metaDataText.data(), metaDataText.data() + metaDataText.size());
+		if (!parser.indexObject(members))
+		{
+			// Not an object (or not valid Json), so it's all read, to fail as jsoncpp would:
+			if (!parseMetaDataFile(metaDataText, rootJsonValue))
+			{
+				return false;
+			}
+			applyMetaDataLog(logText, rootJsonValue);
+			return true;
+		}
+	}
+	std::vector<std::pair<const char*, const char*> > lines;
+	splitMetaDataLog(logText, lines);
+	for (const std::pair<const char*, const char*>& line : lines)
+	{
+		MetaDataParser parser(line.first, line.second);
+		if (!parser.indexObject(members))
+		{
+			printf("Skipping a damaged line in the meta data log.\n");
+		}
+	}
+	for (const MetaDataMember& member : members)
+	{
+		entries[member.name] = std::make_pair(member.valueBegin, member.valueEnd);
+	}
+	fileExists = fileExists || logExists;
+
+	// The file's entry, then those of any files its chunks are duplicates of, and so on:
+	std::vector<std::string> pendingFileKeys(1, fileKey);
+	while (!pendingFileKeys.empty())
+	{
+		const std::string pendingFileKey = pendingFileKeys.back();
+		pendingFileKeys.pop_back();
+		std::unordered_map<std::string, std::pair<const char*, const char*> >::const_iterator entry = entries.find(pendingFileKey);
+		if ((entry == entries.end()) || rootJsonValue.isMember(pendingFileKey))
+		{
+			continue;
+		}
+
+		Json::Value& entryJsonValue = rootJsonValue[pendingFileKey];
+		if (!parseMetaDataText(entry->second.first, entry->second.second, entryJsonValue))
+		{
+			printf("An existing Json file was found but an error occurred during parsing.\n");
+			return false;
+		}
+
+		const Json::Value& parsedEntry = entryJsonValue;
+		if (!parsedEntry.isArray() || parsedEntry.empty() || !parsedEntry[0].isObject())
+		{
+			continue;
+		}
+		const Json::Value& chunksJsonValue = parsedEntry[0]["chunks"];
+		if (!chunksJsonValue.isArray())
+		{
+			continue;
+		}
+		for (Json::ArrayIndex i = 0; i < chunksJsonValue.size(); ++i)
+		{
+			const Json::Value& duplicateOfFile = chunksJsonValue[i]["duplicate_of_file"];
+			if (duplicateOfFile.isString() && !rootJsonValue.isMember(duplicateOfFile.asString()))
+			{
+				pendingFileKeys.push_back(duplicateOfFile.asString());
+			}
+		}
+	}
+	return true;
+}
+
+void addReferencedEntries(const Json::Value& rootJsonValue, ReferencedEntries& referencedEntries)
+{
+	for (const std::string& fileKey : rootJsonValue.getMemberNames())
+	{
+		const Json::Value& chunksJsonValue = rootJsonValue[fileKey][0]["chunks"];
+		for (Json::ArrayIndex i = 0; i < chunksJsonValue.size(); ++i)
+		{
+			const Json::Value& duplicateOfFile = chunksJsonValue[i]["duplicate_of_file"];
+			if (duplicateOfFile.isString())
+			{
+				referencedEntries.emplace(duplicateOfFile.asString(), fileKey);
+			}
+		}
+	}
+}
+
+void addReferencedEntries(const std::string& fileKey, const MetaDataEntry& entry, ReferencedEntries& referencedEntries)
+{
+	for (const ChunkRecord& chunk : entry.chunks)
+	{
+		if (chunk.isDuplicate && !chunk.duplicateOfFile.empty())
+		{
+			referencedEntries.emplace(chunk.duplicateOfFile, fileKey);
+		}
+	}
+}
+
+bool checkEntryIsUnreferenced(const ReferencedEntries& referencedEntries, const std::string& fileKey)
+{
+	ReferencedEntries::const_iterator referenced = referencedEntries.find(fileKey);
+	if (referenced != referencedEntries.end())
+	{
+		printf("%s can't be compressed again while %s has chunks which are duplicates of its chunks (/dd), compress that again without /dd first.\n", fileKey.c_str(), referenced->second.c_str());
+		return false;
+	}
+	return true;
+}
+
+void appendChunkRecord(const ChunkRecord& chunk, Json::Value& chunksJsonValue)
+{
+	Json::Value& chunkJsonValue = chunksJsonValue.append(Json::Value(Json::objectValue));
+	chunkJsonValue["chunk_size_uncompressed"] = chunk.chunkSizeUncompressed;
+	chunkJsonValue["chunk_size_compressed"] = chunk.chunkSizeCompressed;
+	if (chunk.isDuplicate)
+	{
+		chunkJsonValue["duplicate_of_chunk"] = chunk.duplicateOfChunk;
+		if (!chunk.duplicateOfFile.empty())
+		{
+			chunkJsonValue["duplicate_of_file"] = chunk.duplicateOfFile;
+		}
+	}
+	else
+	{
+		chunkJsonValue["deflate_strategy"] = chunk.deflateStrategy;
+		chunkJsonValue["deflate_level"] = chunk.deflateLevel;
+		chunkJsonValue["deflate_mem_level"] = chunk.deflateMemLevel;
+	}
+	if (chunk.codec)
+	{
+		chunkJsonValue["codec"] = chunk.codec;
+	}
+	if (chunk.tuned)
+	{
+		Json::Value& deflateTune = chunkJsonValue["deflate_tune"];
+		for (int setting : chunk.deflateTune)
+		{
+			deflateTune.append(setting);
+		}
+	}
+	if (chunk.dependsOnPreviousChunk)
+	{
+		chunkJsonValue["depends_on_previous_chunk"] = true;
+	}
+	if (chunk.searchBudgetTruncated)
+	{
+		chunkJsonValue["search_budget_truncated"] = true;
+	}
+	if (!chunk.chunkHash.empty())
+	{
+		chunkJsonValue["chunk_sha256"] = chunk.chunkHash;
+	}
+	if (chunk.hasCrc)
+	{
+		chunkJsonValue["chunk_crc32"] = chunk.chunkCrc;
+	}
+}
+
+// Streaming writer:
+// Writes Json text as it goes, laid out exactly as StreamWriterBuilder does with three space indentation
+// and no comments: " : " after a key, an object or array that has anything in it starts on a new line,
+// except that an array of fewer than 25 plain values that fits in 74 characters goes on one line.
+// Compact, for the log, everything goes on one line with nothing between the values but ',' and ':'.
+class MetaDataWriter
+{
+public:
+	MetaDataWriter(FILE* fileHandle, bool compact);
+
+	void beginObject(); // Only for objects with something in them, as are the next three.
+	void endObject();
+	void beginArray(); // One value to a line.
+	void endArray();
+	void writeKey(const std::string& name);
+	void writeText(const std::string& text); // A value already formatted.
+	void writeIntegers(const int* values, unsigned int count); // An array short enough for one line.
+	void writeValue(const Json::Value& value);
+	void endRecord(); // Ends a line of the log.
+
+	// Writes out what's buffered, false if anything failed to write.
+	bool flush();
+
+private:
+	void beginValue(bool container);
+	void newLine();
+	void write(const std::string& text);
+	bool formatOnOneLine(const Json::Value& value, std::string& text);
+
+	FILE* fileHandle;
+	bool compact;
+	std::string buffer;
+	std::vector<bool> firstInContainer; // For each open container, whether nothing's been written in it yet.
+	bool afterKey;
+	bool failed;
+};
+
+const size_t METADATA_WRITE_BUFFER_SIZE = 1024 * 1024;
+const unsigned int JSON_RIGHT_MARGIN = 74; // Arrays reaching it are written one value to a line.
+
+MetaDataWriter::MetaDataWriter(FILE* fileHandle, bool compact)
+	: fileHandle(fileHandle), compact(compact), afterKey(false), failed(false)
+{
+	buffer.reserve(METADATA_WRITE_BUFFER_SIZE);
+}
+
+void MetaDataWriter::newLine()
+{
+	if (compact)
+	{
+		return;
+	}
+	write("\n");
+	buffer.append(firstInContainer.size() * 3, ' ');
+}
+
+void MetaDataWriter::write(const std::string& text)
+{
+	buffer += text;
+	if (buffer.size() >= METADATA_WRITE_BUFFER_SIZE)
+	{
+		flush();
+	}
+}
+
+bool MetaDataWriter::flush()
+{
+	if (!buffer.empty() && (fwrite(buffer.data(), buffer.size(), 1, fileHandle) != 1))
+	{
+		failed = true;
+	}
+	buffer.clear();
+	return !failed;
+}
+
+// A value after a key stays on the key's line unless it's a container; in an array every value gets its own line.
+void MetaDataWriter::beginValue(bool container)
+{
+	if (afterKey)
+	{
+		afterKey = false;
+		if (container)
+		{
+			newLine();
+		}
+	}
+	else if (!firstInContainer.empty())
+	{
+		if (!firstInContainer.back())
+		{
+			write(",");
+		}
+		firstInContainer.back() = false;
+		newLine();
+	}
+}
+
+void MetaDataWriter::beginObject()
+{
+	beginValue(true);
+	write("{");
+	firstInContainer.push_back(true);
+}
+
+void MetaDataWriter::endObject()
+{
+	firstInContainer.pop_back();
+	newLine();
+	write("}");
+}
+
+void MetaDataWriter::beginArray()
+{
+	beginValue(true);
+	write("[");
+	firstInContainer.push_back(true);
+}
+
+void MetaDataWriter::endArray()
+{
+	firstInContainer.pop_back();
+	newLine();
+	write("]");
+}
+
+void MetaDataWriter::writeKey(const std::string& name)
+{
+	if (!firstInContainer.back())
+	{
+		write(",");
+	}
+	firstInContainer.back() = false;
+	newLine();
+	write(Json::valueToQuotedString(name.c_str()));
+	write(compact ? ":" : " : ");
+	afterKey = true;
+}
+
+void MetaDataWriter::writeText(const std::string& text)
+{
+	beginValue(false);
+	write(text);
+}
+
+void MetaDataWriter::writeIntegers(const int* values, unsigned int count)
+{
+	std::string text = compact ? "[" : "[ ";
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		text += (i == 0) ? "" : (compact ? "," : ", ");
+		text += Json::valueToString((Json::LargestInt)values[i]);
+	}
+	text += compact ? "]" : " ]";
+	writeText(text);
+}
+
+void MetaDataWriter::endRecord()
+{
+	write("\n");
+}
+
+// Plain values, empty containers and arrays short enough to be written on one line.
+bool MetaDataWriter::formatOnOneLine(const Json::Value& value, std::string& text)
+{
+	switch (value.type())
+	{
+	case Json::nullValue:
+		text = "null";
+		return true;
+	case Json::intValue:
+		text = Json::valueToString(value.asLargestInt());
+		return true;
+	case Json::uintValue:
+		text = Json::valueToString(value.asLargestUInt());
+		return true;
+	case Json::realValue:
+		text = Json::valueToString(value.asDouble());
+		return true;
+	case Json::stringValue:
+		text = Json::valueToQuotedString(value.asCString());
+		return true;
+	case Json::booleanValue:
+		text = Json::valueToString(value.asBool());
+		return true;
+	case Json::arrayValue:
+	{
+		const Json::ArrayIndex size = value.size();
+		if (size == 0)
+		{
+			text = "[]";
+			return true;
+		}
+		if (size * 3 >= JSON_RIGHT_MARGIN)
+		{
+			return false;
+		}
+
+		std::vector<std::string> elements(size);
+		size_t lineLength = 4 + (size - 1) * 2; // "[ " + ", " between + " ]"
+		for (Json::ArrayIndex i = 0; i < size; ++i)
+		{
+			const Json::Value& element = value[i];
+			if ((element.isArray() || element.isObject()) && !element.empty())
+			{
+				return false;
+			}
+			if (element.hasComment(Json::commentBefore) || element.hasComment(Json::commentAfterOnSameLine) || element.hasComment(Json::commentAfter))
+			{
+				return false;
+			}
+			formatOnOneLine(element, elements[i]);
+			lineLength += elements[i].size();
+		}
+		if (lineLength >= JSON_RIGHT_MARGIN)
+		{
+			return false;
+		}
+
+		text = "[ ";
+		for (Json::ArrayIndex i = 0; i < size; ++i)
+		{
+			text += (i > 0) ? ", " : "";
+			text += elements[i];
+		}
+		text += " ]";
+		return true;
+	}
+	case Json::objectValue:
+		if (value.empty())
+		{
+			text = "{}";
+			return true;
+		}
+		return false;
+	}
+	return false;
+}
+
+void MetaDataWriter::writeValue(const Json::Value& value)
+{
+	std::string text;
+	const bool container = (value.isArray() || value.isObject()) && !value.empty();
+	if (!(compact && container) && formatOnOneLine(value, text))
+	{
+		writeText(text);
+	}
+	else if (value.isArray())
+	{
+		beginArray();
+		for (Json::ArrayIndex i = 0; i < value.size(); ++i)
+		{
+			writeValue(value[i]);
+		}
+		endArray();
+	}
+	else
+	{
+		beginObject();
+		for (const std::string& name : value.getMemberNames())
+		{
+			writeKey(name);
+			writeValue(value[name]);
+		}
+		endObject();
+	}
+}
+
+// The keys in the order a Json::Value would have them.
+void writeChunkRecord(MetaDataWriter& writer, const ChunkRecord& chunk)
+{
+	writer.beginObject();
+	if (chunk.hasCrc)
+	{
+		writer.writeKey("chunk_crc32");
+		writer.writeText(Json::valueToString((Json::LargestUInt)chunk.chunkCrc));
+	}
+	if (!chunk.chunkHash.empty())
+	{
+		writer.writeKey("chunk_sha256");
+		writer.writeText(Json::valueToQuotedString(chunk.chunkHash.c_str()));
+	}
+	writer.writeKey("chunk_size_compressed");
+	writer.writeText(Json::valueToString((Json::LargestUInt)chunk.chunkSizeCompressed));
+	writer.writeKey("chunk_size_uncompressed");
+	writer.writeText(Json::valueToString((Json::LargestUInt)chunk.chunkSizeUncompressed));
+	if (chunk.codec)
+	{
+		writer.writeKey("codec");
+		writer.writeText(Json::valueToQuotedString(chunk.codec));
+	}
+	if (!chunk.isDuplicate)
+	{
+		writer.writeKey("deflate_level");
+		writer.writeText(Json::valueToString((Json::LargestInt)chunk.deflateLevel));
+		writer.writeKey("deflate_mem_level");
+		writer.writeText(Json::valueToString((Json::LargestInt)chunk.deflateMemLevel));
+		writer.writeKey("deflate_strategy");
+		writer.writeText(Json::valueToString((Json::LargestInt)chunk.deflateStrategy));
+	}
+	if (chunk.tuned)
+	{
+		// Four numbers always fit on one line:
+		writer.writeKey("deflate_tune");
+		writer.writeIntegers(chunk.deflateTune, 4);
+	}
+	if (chunk.dependsOnPreviousChunk)
+	{
+		writer.writeKey("depends_on_previous_chunk");
+		writer.writeText("true");
+	}
+	if (chunk.isDuplicate)
+	{
+		writer.writeKey("duplicate_of_chunk");
+		writer.writeText(Json::valueToString((Json::LargestUInt)chunk.duplicateOfChunk));
+		if (!chunk.duplicateOfFile.empty())
+		{
+			writer.writeKey("duplicate_of_file");
+			writer.writeText(Json::valueToQuotedString(chunk.duplicateOfFile.c_str()));
+		}
+	}
+	if (chunk.searchBudgetTruncated)
+	{
+		writer.writeKey("search_budget_truncated");
+		writer.writeText("true");
+	}
+	writer.endObject();
+}
+
+// An entry is an array holding one object, with "chunks" among the header's keys where it sorts.
+void writeMetaDataEntry(MetaDataWriter& writer, const std::string& fileKey, const MetaDataEntry& entry)
+{
+	std::vector<std::string> names = entry.header.getMemberNames();
+	if (!entry.chunks.empty())
+	{
+		names.insert(std::lower_bound(names.begin(), names.end(), std::string("chunks")), "chunks");
+	}
+
+	writer.writeKey(fileKey);
+	writer.beginArray();
+	if (names.empty())
+	{
+		writer.writeText("{}");
+	}
+	else
+	{
+		writer.beginObject();
+		for (const std::string& name : names)
+		{
+			writer.writeKey(name);
+			if ((name == "chunks") && !entry.chunks.empty())
+			{
+				writer.beginArray();
+				for (const ChunkRecord& chunk : entry.chunks)
+				{
+					writeChunkRecord(writer, chunk);
+				}
+				writer.endArray();
+			}
+			else
+			{
+				writer.writeValue(entry.header[name]);
+			}
+		}
+		writer.endObject();
+	}
+	writer.endArray();
+}
+
+bool writeMetaDataFile(const char* metaDataFilePath, const Json::Value& rootJsonValue)
+{
+	return writeMetaDataFile(metaDataFilePath, rootJsonValue, MetaDataEntries());
+}
+
+// Writes the whole file, false if anything failed to write.
+bool writeMetaDataText(FILE* metaDataFileHandle, const Json::Value& rootJsonValue, const MetaDataEntries& newEntries)
+{
+	MetaDataWriter writer(metaDataFileHandle, false);
+	if (newEntries.empty())
+	{
+		writer.writeValue(rootJsonValue);
+	}
+	else
+	{
+		// Both are in name order, so the new entries are merged in as the root's are written:
+		const std::vector<std::string> names = rootJsonValue.isObject() ? rootJsonValue.getMemberNames() : std::vector<std::string>();
+		std::vector<std::string>::const_iterator name = names.begin();
+		MetaDataEntries::const_iterator newEntry = newEntries.begin();
+		writer.beginObject();
+		while ((name != names.end()) || (newEntry != newEntries.end()))
+		{
+			if ((newEntry != newEntries.end()) && ((name == names.end()) || (newEntry->first <= *name)))
+			{
+				if ((name != names.end()) && (newEntry->first == *name))
+				{
+					++name;
+				}
+				writeMetaDataEntry(writer, newEntry->first, newEntry->second);
+				++newEntry;
+			}
+			else
+			{
+				writer.writeKey(*name);
+				writer.writeValue(rootJsonValue[*name]);
+				++name;
+			}
+		}
+		writer.endObject();
+	}
+
+	return writer.flush();
+}
+
+bool writeMetaDataFile(const char* metaDataFilePath, const Json::Value& rootJsonValue, const MetaDataEntries& newEntries)
+{
+	FILE* metaDataFileHandle = nullptr;
+	if (fopen_s(&metaDataFileHandle, metaDataFilePath, "w") != 0)
+	{
+		printf("An error occurred writing the metadata.\n");
+		return false;
+	}
+
+	const bool written = writeMetaDataText(metaDataFileHandle, rootJsonValue, newEntries);
+	if ((fclose(metaDataFileHandle) != 0) || !written)
+	{
+		printf("An error occurred writing the metadata.\n");
+		return false;
+	}
+
+	return true;
+}
+
+// Meta data log:
+
+// Locks the whole of the open file, waiting for anyone else's lock (shared or exclusive) that's in the way.
+bool lockFile(FILE* fileHandle, bool exclusive)
+{
+#ifdef _WIN32
+	OVERLAPPED overlapped = {};
+	if (!LockFileEx((HANDLE)_get_osfhandle(_fileno(fileHandle)), exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, MAXDWORD, MAXDWORD, &overlapped))
+#else
+	if (flock(fileno(fileHandle), exclusive ? LOCK_EX : LOCK_SH) != 0)
+#endif
+	{
+		printf("An error occurred locking the meta data log.\n");
+		return false;
+	}
+	return true;
+}
+
+void unlockFile(FILE* fileHandle)
+{
+#ifdef _WIN32
+	OVERLAPPED overlapped = {};
+	UnlockFileEx((HANDLE)_get_osfhandle(_fileno(fileHandle)), 0, MAXDWORD, MAXDWORD, &overlapped);
+#else
+	flock(fileno(fileHandle), LOCK_UN);
+#endif
+}
+
+bool syncMetaDataFile(FILE* fileHandle)
+{
+	if (fflush(fileHandle) != 0)
+	{
+		return false;
+	}
+#ifdef _WIN32
+	return _commit(_fileno(fileHandle)) == 0;
+#else
+	return fdatasync(fileno(fileHandle)) == 0;
+#endif
+}
+
+// 0 if the file doesn't exist.
+uint64_t getMetaDataFileSize(const char* filePath)
+{
+#ifdef _WIN32
+	struct _stat64 fileStatus;
+	if (_stat64(filePath, &fileStatus) != 0)
+#else
+	struct stat fileStatus;
+	if (stat(filePath, &fileStatus) != 0)
+#endif
+	{
+		return 0;
+	}
+	return fileStatus.st_size;
+}
+
+std::string getMetaDataLogFilePath(const char* metaDataFilePath)
+{
+	return std::string(metaDataFilePath) + ".log";
+}
+
+bool metaDataLogExists(const char* metaDataFilePath)
+{
+	FILE* logFileHandle = nullptr;
+	if (fopen_s(&logFileHandle, getMetaDataLogFilePath(metaDataFilePath).c_str(), "rb") != 0)
+	{
+		return false;
+	}
+	fclose(logFileHandle);
+	return true;
+}
+
+bool replaceFile(const char* temporaryFilePath, const char* filePath)
+{
+#ifdef _WIN32
+	if (!MoveFileExA(temporaryFilePath, filePath, MOVEFILE_REPLACE_EXISTING))
+#else
+	if (rename(temporaryFilePath, filePath) != 0)
+#endif
+	{
+		printf("Unable to replace %s, it may still be open.\n", filePath);
+		return false;
+	}
+	return true;
+}
+
+// The log's complete lines, without the torn one a run that stopped while appending it may have left.
+void splitMetaDataLog(const std::string& logText, std::vector<std::pair<const char*, const char*> >& lines)
+{
+	size_t lineStart = 0;
+	while (lineStart < logText.size())
+	{
+		const size_t lineEnd = logText.find('\n', lineStart);
+		if (lineEnd == std::string::npos)
+		{
+			break;
+		}
+		if (lineEnd > lineStart)
+		{
+			lines.push_back(std::make_pair(logText.data() + lineStart, logText.data() + lineEnd));
+		}
+		lineStart = lineEnd + 1;
+	}
+}
+
+// Each line replaces the entries it names, in the order they were appended.
+void applyMetaDataLog(const std::string& logText, Json::Value& rootJsonValue)
+{
+	std::vector<std::pair<const char*, const char*> > lines;
+	splitMetaDataLog(logText, lines);
+	for (const std::pair<const char*, const char*>& line : lines)
+	{
+		Json::Value recordJsonValue;
+		if (!parseMetaDataText(line.first, line.second, recordJsonValue) || !recordJsonValue.isObject())
+		{
+			printf("Skipping a damaged line in the meta data log.\n");
+			continue;
+		}
+		for (const std::string& fileKey : recordJsonValue.getMemberNames())
+		{
+			rootJsonValue[fileKey].swap(recordJsonValue[fileKey]);
+		}
+	}
+}
+
+// With the log locked exclusively: writes the file again with the log's entries in it and empties the log.
+// The new file is on disk before it replaces the old one, and the log is only emptied after that, so
+// stopping at any point leaves either the old file and the log or the new file and a log of entries
+// it already has.
+bool compactMetaDataLog(const char* metaDataFilePath, FILE* logFileHandle)
+{
+	Json::Value rootJsonValue;
+	std::string metaDataText;
+	bool metaDataFileExists = false;
+	std::string logText;
+	if (!readTextFile(metaDataFilePath, metaDataText, metaDataFileExists) || (fseek(logFileHandle, 0, SEEK_SET) != 0) || !readWholeFile(logFileHandle, logText))
+	{
+		return false;
+	}
+	if (metaDataFileExists && !parseMetaDataFile(metaDataText, rootJsonValue))
+	{
+		return false;
+	}
+	metaDataText.clear();
+	applyMetaDataLog(logText, rootJsonValue);
+	logText.clear();
+
+	const std::string temporaryFilePath = std::string(metaDataFilePath) + ".tmp";
+	FILE* temporaryFileHandle = nullptr;
+	if (fopen_s(&temporaryFileHandle, temporaryFilePath.c_str(), "w") != 0)
+	{
+		printf("Error opening %s for writing.\n", temporaryFilePath.c_str());
+		return false;
+	}
+	bool written = writeMetaDataText(temporaryFileHandle, rootJsonValue, MetaDataEntries()) && syncMetaDataFile(temporaryFileHandle);
+	written = (fclose(temporaryFileHandle) == 0) && written;
+	if (!written)
+	{
+		printf("An error occurred writing the metadata.\n");
+		remove(temporaryFilePath.c_str());
+		return false;
+	}
+	if (!replaceFile(temporaryFilePath.c_str(), metaDataFilePath))
+	{
+		remove(temporaryFilePath.c_str());
+		return false;
+	}
+
+#ifdef _WIN32
+	const bool truncated = (fflush(logFileHandle) == 0) && (_chsize_s(_fileno(logFileHandle), 0) == 0);
+#else
+	const bool truncated = (fflush(logFileHandle) == 0) && (ftruncate(fileno(logFileHandle), 0) == 0);
+#endif
+	if (!truncated || !syncMetaDataFile(logFileHandle))
+	{
+		printf("An error occurred emptying the meta data log.\n");
+		return false;
+	}
+	return true;
+}
+
+bool appendMetaDataEntries(const char* metaDataFilePath, const MetaDataEntries& newEntries)
+{
+	const std::string logFilePath = getMetaDataLogFilePath(metaDataFilePath);
+	FILE* logFileHandle = nullptr;
+	if (fopen_s(&logFileHandle, logFilePath.c_str(), "a+b") != 0)
+	{
+		printf("Error opening %s for appending.\n", logFilePath.c_str());
+		return false;
+	}
+	if (!lockFile(logFileHandle, true))
+	{
+		fclose(logFileHandle);
+		return false;
+	}
+
+	// A line left torn by a run that stopped while appending it is ended, so it's skipped on its own rather
+	// than taking this one with it:
+	bool success = true;
+	if ((fseek(logFileHandle, -1, SEEK_END) == 0) && (fgetc(logFileHandle) != '\n'))
+	{
+		fseek(logFileHandle, 0, SEEK_END);
+		success = fputc('\n', logFileHandle) != EOF;
+	}
+	fseek(logFileHandle, 0, SEEK_END);
+
+	MetaDataWriter writer(logFileHandle, true);
+	for (MetaDataEntries::const_iterator newEntry = newEntries.begin(); newEntry != newEntries.end(); ++newEntry)
+	{
+		writer.beginObject();
+		writeMetaDataEntry(writer, newEntry->first, newEntry->second);
+		writer.endObject();
+		writer.endRecord();
+	}
+	success = writer.flush() && success && syncMetaDataFile(logFileHandle);
+	if (!success)
+	{
+		printf("An error occurred writing the meta data log.\n");
+	}
+
+	// Compacted once the log has grown to the size of the file, so that over many runs it costs each one
+	// about as much as it added:
+	const uint64_t logSize = getMetaDataFileSize(logFilePath.c_str());
+	if (success && (logSize >= (uint64_t)MINIMUM_COMPACTED_LOG_SIZE) && (logSize >= getMetaDataFileSize(metaDataFilePath)))
+	{
+		// The entries are already safely in the log, so this run succeeded even if compacting doesn't:
+		compactMetaDataLog(metaDataFilePath, logFileHandle);
+	}
+
+	unlockFile(logFileHandle);
+	fclose(logFileHandle);
+	return success;
+}
+
+bool compactMetaDataFile(const char* metaDataFilePath)
+{
+	const std::string logFilePath = getMetaDataLogFilePath(metaDataFilePath);
+	FILE* logFileHandle = nullptr;
+	if (fopen_s(&logFileHandle, logFilePath.c_str(), "r+b") != 0)
+	{
+		printf("%s has no meta data log to compact.\n", metaDataFilePath);
+		return false;
+	}
+	bool success = lockFile(logFileHandle, true) && compactMetaDataLog(metaDataFilePath, logFileHandle);
+	unlockFile(logFileHandle);
+	fclose(logFileHandle);
+	return success;
+}
+
+bool updateMetaDataFile(const char* metaDataFilePath, const Json::Value& rootJsonValue, const MetaDataEntries& newEntries, bool useLog)
+{
+	if (useLog || metaDataLogExists(metaDataFilePath))
+	{
+		return appendMetaDataEntries(metaDataFilePath, newEntries);
+	}
+	return writeMetaDataFile(metaDataFilePath, rootJsonValue, newEntries);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+// Meta data files:
+// The Json file describing every compressed file's chunks, keyed by the name of the input they came from.
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+
+// External libraries:
+#include <json/json.h>
+
+// What the meta data says about one chunk, one of the "chunks" in a file's entry.
+struct ChunkRecord
+{
+	unsigned int chunkSizeUncompressed;
+	unsigned int chunkSizeCompressed; // 0 for a duplicate.
+	const char* codec; // Its name, or null for zlib, which isn't recorded.
+	int deflateStrategy; // These aren't recorded for a duplicate.
+	int deflateLevel;
+	int deflateMemLevel;
+	bool tuned; // /ultra, deflateTune holds [good_length, max_lazy, nice_length, max_chain].
+	int deflateTune[4];
+	bool dependsOnPreviousChunk; // /pd
+	bool searchBudgetTruncated; // /bms
+	bool isDuplicate; // /dd
+	unsigned int duplicateOfChunk;
+	std::string duplicateOfFile; // Empty for this file.
+	std::string chunkHash; // /dd, the SHA-256 as hex.
+	bool hasCrc; // /vf
+	uint32_t chunkCrc;
+};
+
+// A file's entry, with its chunks kept as records rather than as Json::Values, which for a file of millions
+// of chunks would be millions of maps. header is everything in the entry but "chunks".
+struct MetaDataEntry
+{
+	Json::Value header;
+	std::vector<ChunkRecord> chunks;
+};
+
+typedef std::map<std::string, MetaDataEntry> MetaDataEntries;
+
+// Adds the chunk to an entry's "chunks" as a Json::Value, as reading it back from the file would.
+void appendChunkRecord(const ChunkRecord& chunk, Json::Value& chunksJsonValue);
+
+// Reads an existing meta data file, and its log if it has one, into rootJsonValue. A missing file is fine
+// (there's nothing to read yet), one that can't be parsed isn't.
+bool readMetaDataFile(const char* metaDataFilePath, Json::Value& rootJsonValue, bool& fileExists);
+
+// Reads only fileKey's entry, and those of the files its chunks are duplicates of, into rootJsonValue, stepping
+// over the rest of the file without parsing it. For readers, which only need one file of an index of many.
+bool readMetaDataEntry(const char* metaDataFilePath, const std::string& fileKey, Json::Value& rootJsonValue, bool& fileExists);
+
+// The entries other entries have chunks which are duplicates of (/dd, "duplicate_of_file"), each with one of
+// the entries pointing into it. Compressing a file replaces its entry, which would leave those pointing at
+// chunks that aren't there any more, so it isn't done while there are any.
+typedef std::unordered_map<std::string, std::string> ReferencedEntries;
+
+void addReferencedEntries(const Json::Value& rootJsonValue, ReferencedEntries& referencedEntries);
+
+// Adds those of an entry not written to the meta data yet.
+void addReferencedEntries(const std::string& fileKey, const MetaDataEntry& entry, ReferencedEntries& referencedEntries);
+
+// Says which entry points into fileKey's, if one does.
+bool checkEntryIsUnreferenced(const ReferencedEntries& referencedEntries, const std::string& fileKey);
+
+bool writeMetaDataFile(const char* metaDataFilePath, const Json::Value& rootJsonValue);
+
+// Writes rootJsonValue with newEntries added, replacing any it has under the same names. The file is
+// written as it goes, each chunk straight from its record, and comes out exactly as it would have had the
+// entries been added to rootJsonValue as Json::Values.
+bool writeMetaDataFile(const char* metaDataFilePath, const Json::Value& rootJsonValue, const MetaDataEntries& newEntries);
+
+// Meta data log (/mlog):
+// Writing the whole meta data file again for every run costs as much as everything already in it, and two
+// runs at once each write back what they read, losing the other's entry. With a log ("<meta data file>.log")
+// a run appends its entries to the log instead, one line of Json each ({"<file key>":[entry]}), while holding
+// a lock on the log, so any number of runs can add to the same meta data at once, each only writing its own
+// chunks. Readers lock the log too (shared) and read it after the file, later lines replacing entries of the
+// same name. A torn last line, from a run stopped part way through appending, is skipped.
+// Once the log is as large as the file (and at least MINIMUM_COMPACTED_LOG_SIZE) the run that made it so
+// compacts it: the file is written again with the log's entries in it, next to itself, and renamed over the
+// old one before the log is emptied. A meta data file that has a log keeps it, with /mlog or without.
+
+const long long MINIMUM_COMPACTED_LOG_SIZE = 16 * 1024 * 1024;
+
+std::string getMetaDataLogFilePath(const char* metaDataFilePath);
+
+bool metaDataLogExists(const char* metaDataFilePath);
+
+// Adds newEntries to the meta data file: to the log if useLog or there already is one, otherwise by writing
+// rootJsonValue, the file as it was read, again with them.
+bool updateMetaDataFile(const char* metaDataFilePath, const Json::Value& rootJsonValue, const MetaDataEntries& newEntries, bool useLog);
+
+// Appends newEntries to the log, compacting it if it's grown large enough.
+bool appendMetaDataEntries(const char* metaDataFilePath, const MetaDataEntries& newEntries);
+
+// Folds the log into the meta data file now, whatever its size (/compact).
+bool compactMetaDataFile(const char* metaDataFilePath);
+
+// Renames temporaryFilePath over filePath. Where the old file is still open this works on POSIX (whoever
+// has it open keeps the old one) but fails on Windows.
+bool replaceFile(const char* temporaryFilePath, const char* filePath);
@@ -0,0 +1,137 @@
+#pragma once
+
+// Simple parallel for, used by the chunk scheduler, /sbs sub-blocks and /rr reads, and a pool of threads
+// that runs the same loop without starting new ones, for compressBuffer().
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+// Runs work(0) to work(count - 1) on up to threads threads (this one included), each taking the next index when it's done with one.
+template <typename Work>
+void runInParallel(size_t count, unsigned int threads, const Work& work)
+{
+	std::atomic<size_t> next(0);
+	auto worker = [&next, count, &work]()
+	{
+		for (size_t i = next++; i < count; i = next++)
+		{
+			work(i);
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned int t = 1; (t < threads) && (t < count); ++t)
+	{
+		workers.emplace_back(worker);
+	}
+	worker();
+	for (std::thread& thread : workers)
+	{
+		thread.join();
+	}
+}
+
+// Threads kept from one run() to the next. run() is runInParallel() on the pool's threads and the calling
+// one, without starting any threads or allocating, for callers that run many small batches. One run() at a time.
+class WorkerPool
+{
+public:
+	// threads includes the thread that calls run().
+	WorkerPool(unsigned int threads)
+		: generation(0), count(0), next(0), work(nullptr), invoke(nullptr), busyWorkers(0), stopping(false)
+	{
+		for (unsigned int t = 1; t < threads; ++t)
+		{
+			workers.emplace_back([this]() { runWorker(); });
+		}
+	}
+
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		started.notify_all();
+		for (std::thread& thread : workers)
+		{
+			thread.join();
+		}
+	}
+
+	template <typename Work>
+	void run(size_t count, const Work& work)
+	{
+		runWork(count, &work, [](const void* work, size_t i) { (*(const Work*)work)(i); });
+	}
+
+private:
+	WorkerPool(const WorkerPool&);
+	WorkerPool& operator=(const WorkerPool&);
+
+	void runWork(size_t workCount, const void* workToRun, void (*invokeWork)(const void*, size_t))
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			count = workCount;
+			next = 0;
+			work = workToRun;
+			invoke = invokeWork;
+			busyWorkers = (unsigned int)workers.size();
+			++generation;
+		}
+		started.notify_all();
+		takeWork();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [this]() { return busyWorkers == 0; });
+	}
+
+	void runWorker()
+	{
+		uint64_t lastGeneration = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			started.wait(lock, [this, lastGeneration]() { return stopping || (generation != lastGeneration); });
+			if (stopping)
+			{
+				return;
+			}
+			lastGeneration = generation;
+
+			lock.unlock();
+			takeWork();
+			lock.lock();
+			if (--busyWorkers == 0)
+			{
+				finished.notify_one();
+			}
+		}
+	}
+
+	void takeWork()
+	{
+		for (size_t i = next++; i < count; i = next++)
+		{
+			invoke(work, i);
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable started; // A run() has work for the workers, or they're stopping.
+	std::condition_variable finished; // The last worker is done with the run's work.
+	uint64_t generation; // Counts run()s, so a worker knows one is new.
+	size_t count;
+	std::atomic<size_t> next;
+	const void* work;
+	void (*invoke)(const void*, size_t);
+	unsigned int busyWorkers;
+	bool stopping;
+};
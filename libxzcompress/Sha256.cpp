@@ -0,0 +1,147 @@
+#include "Sha256.h"
+
+#include <stdint.h>
+#include <string.h>
+
+struct Sha256
+{
+	uint32_t state[8];
+	uint64_t totalLength;
+	unsigned char block[64];
+	size_t blockFill;
+};
+
+static const uint32_t SHA256_ROUND_CONSTANTS[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotateRight(uint32_t x, unsigned int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+void sha256Init(Sha256& sha)
+{
+	static const uint32_t initialState[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	memcpy(sha.state, initialState, sizeof(initialState));
+	sha.totalLength = 0;
+	sha.blockFill = 0;
+}
+
+void sha256ProcessBlock(Sha256& sha, const unsigned char* block)
+{
+	uint32_t w[64];
+	for (unsigned int t = 0; t < 16; ++t)
+	{
+		w[t] = ((uint32_t)block[t * 4] << 24) | ((uint32_t)block[t * 4 + 1] << 16) | ((uint32_t)block[t * 4 + 2] << 8) | block[t * 4 + 3];
+	}
+	for (unsigned int t = 16; t < 64; ++t)
+	{
+		const uint32_t s0 = rotateRight(w[t - 15], 7) ^ rotateRight(w[t - 15], 18) ^ (w[t - 15] >> 3);
+		const uint32_t s1 = rotateRight(w[t - 2], 17) ^ rotateRight(w[t - 2], 19) ^ (w[t - 2] >> 10);
+		w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+	}
+
+	uint32_t a = sha.state[0], b = sha.state[1], c = sha.state[2], d = sha.state[3];
+	uint32_t e = sha.state[4], f = sha.state[5], g = sha.state[6], h = sha.state[7];
+	for (unsigned int t = 0; t < 64; ++t)
+	{
+		const uint32_t t1 = h + (rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_ROUND_CONSTANTS[t] + w[t];
+		const uint32_t t2 = (rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	sha.state[0] += a; sha.state[1] += b; sha.state[2] += c; sha.state[3] += d;
+	sha.state[4] += e; sha.state[5] += f; sha.state[6] += g; sha.state[7] += h;
+}
+
+void sha256Update(Sha256& sha, const unsigned char* data, size_t length)
+{
+	sha.totalLength += length;
+
+	if (sha.blockFill > 0)
+	{
+		const size_t toCopy = (length < 64 - sha.blockFill) ? length : 64 - sha.blockFill;
+		memcpy(sha.block + sha.blockFill, data, toCopy);
+		sha.blockFill += toCopy;
+		data += toCopy;
+		length -= toCopy;
+		if (sha.blockFill < 64)
+		{
+			return;
+		}
+		sha256ProcessBlock(sha, sha.block);
+		sha.blockFill = 0;
+	}
+
+	while (length >= 64)
+	{
+		sha256ProcessBlock(sha, data);
+		data += 64;
+		length -= 64;
+	}
+
+	memcpy(sha.block, data, length);
+	sha.blockFill = length;
+}
+
+void sha256Final(Sha256& sha, unsigned char digest[32])
+{
+	const uint64_t totalBits = sha.totalLength * 8;
+
+	sha.block[sha.blockFill++] = 0x80;
+	if (sha.blockFill > 56)
+	{
+		memset(sha.block + sha.blockFill, 0, 64 - sha.blockFill);
+		sha256ProcessBlock(sha, sha.block);
+		sha.blockFill = 0;
+	}
+	memset(sha.block + sha.blockFill, 0, 56 - sha.blockFill);
+	for (unsigned int i = 0; i < 8; ++i)
+	{
+		sha.block[56 + i] = (unsigned char)(totalBits >> (56 - i * 8));
+	}
+	sha256ProcessBlock(sha, sha.block);
+
+	for (unsigned int i = 0; i < 8; ++i)
+	{
+		digest[i * 4] = (unsigned char)(sha.state[i] >> 24);
+		digest[i * 4 + 1] = (unsigned char)(sha.state[i] >> 16);
+		digest[i * 4 + 2] = (unsigned char)(sha.state[i] >> 8);
+		digest[i * 4 + 3] = (unsigned char)sha.state[i];
+	}
+}
+
+std::string sha256ToHex(const unsigned char* data, size_t length)
+{
+	Sha256 sha;
+	sha256Init(sha);
+	sha256Update(sha, data, length);
+
+	unsigned char digest[32];
+	sha256Final(sha, digest);
+
+	static const char hexDigits[] = "0123456789abcdef";
+	std::string hex(64, '0');
+	for (unsigned int i = 0; i < 32; ++i)
+	{
+		hex[i * 2] = hexDigits[digest[i] >> 4];
+		hex[i * 2 + 1] = hexDigits[digest[i] & 0xF];
+	}
+	return hex;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// SHA-256 (FIPS 180-4), used to recognise chunks whose content has already been stored (/dd), and to check
+// a duplicate restored from the first copy is still what was deduplicated.
+
+#include <stddef.h>
+#include <string>
+
+// The digest as 64 lower case hex digits, as the meta data has it ("chunk_sha256").
+std::string sha256ToHex(const unsigned char* data, size_t length);
@@ -0,0 +1,228 @@
+#include "SimdKernels.h"
+
+// External libraries:
+#include <zlib.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define XZCOMPRESS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC lets any function use any intrinsic, GCC and Clang need to be told per function:
+#if defined(XZCOMPRESS_X86) && !defined(_MSC_VER)
+#define TARGET_PCLMUL __attribute__((target("pclmul,sse4.1")))
+#else
+#define TARGET_PCLMUL
+#endif
+
+#ifdef XZCOMPRESS_X86
+static bool detectPclmul()
+{
+#ifdef _MSC_VER
+	int info[4] = {};
+	__cpuid(info, 1);
+	return ((info[2] & (1 << 1)) != 0) && ((info[2] & (1 << 19)) != 0); // PCLMULQDQ and SSE4.1
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+static const bool hasPclmul = detectPclmul();
+
+bool cpuHasPclmul()
+{
+	return hasPclmul;
+}
+#else
+bool cpuHasPclmul()
+{
+	return false;
+}
+#endif
+
+// CRC32:
+// Folds 64 bytes at a time with carry-less multiplies, then reduces to 32 bits (Barrett reduction),
+// as in Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+// The constants are for zlib's (reflected) polynomial. Takes and returns the un-inverted CRC register.
+// length must be at least 64 and a multiple of 16.
+const size_t PCLMUL_CRC_MINIMUM_LENGTH = 64;
+
+#ifdef XZCOMPRESS_X86
+TARGET_PCLMUL static uint32_t crc32Pclmul(uint32_t crc, const unsigned char* data, size_t length)
+{
+	alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+	alignas(16) static const uint64_t k3k4[] = { 0x01751997d0ULL, 0x00ccaa009eULL };
+	alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124ULL, 0x0000000000ULL };
+	alignas(16) static const uint64_t poly[] = { 0x01db710641ULL, 0x01f7011641ULL };
+
+	__m128i x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+	__m128i x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+	__m128i x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+	__m128i x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	__m128i x0 = _mm_load_si128((const __m128i*)k1k2);
+	data += 64;
+	length -= 64;
+
+	// Four 128 bit accumulators:
+	while (length >= 64)
+	{
+		const __m128i x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		const __m128i x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		const __m128i x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		const __m128i x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+		data += 64;
+		length -= 64;
+	}
+
+	// Fold them into one:
+	x0 = _mm_load_si128((const __m128i*)k3k4);
+	const __m128i accumulators[] = { x2, x3, x4 };
+	for (const __m128i& next : accumulators)
+	{
+		const __m128i x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, next), x5);
+	}
+
+	// Any remaining 16 byte blocks:
+	while (length >= 16)
+	{
+		const __m128i x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+		data += 16;
+		length -= 16;
+	}
+
+	// 128 bits down to 64:
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// And 64 down to 32:
+	x0 = _mm_load_si128((const __m128i*)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+uint32_t fastCrc32(uint32_t crc, const unsigned char* data, size_t length)
+{
+#ifdef XZCOMPRESS_X86
+	if (hasPclmul && (length >= PCLMUL_CRC_MINIMUM_LENGTH))
+	{
+		const size_t foldedLength = length & ~(size_t)15;
+		crc = ~crc32Pclmul(~crc, data, foldedLength);
+		data += foldedLength;
+		length -= foldedLength;
+	}
+#endif
+
+	// zlib takes an unsigned int length, so very large buffers go in pieces:
+	while (length > 0)
+	{
+		const unsigned int pieceLength = (length > 0x40000000) ? 0x40000000 : (unsigned int)length;
+		crc = (uint32_t)crc32(crc, data, pieceLength);
+		data += pieceLength;
+		length -= pieceLength;
+	}
+	return crc;
+}
+
+// Json structure:
+// 16 bytes at a time with SSE2, which every x64 CPU has. '[' and '{' differ only in bit 5, as do ']' and '}',
+// so setting it leaves two compares for the four brackets.
+#if defined(XZCOMPRESS_X86) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)))
+#define XZCOMPRESS_SSE2
+
+static inline unsigned int countTrailingZeros(unsigned int mask)
+{
+#ifdef _MSC_VER
+	unsigned long index = 0;
+	_BitScanForward(&index, mask);
+	return (unsigned int)index;
+#else
+	return (unsigned int)__builtin_ctz(mask);
+#endif
+}
+#endif
+
+const char* findJsonStructure(const char* begin, const char* end)
+{
+#ifdef XZCOMPRESS_SSE2
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i caseBit = _mm_set1_epi8(0x20);
+	const __m128i openBrace = _mm_set1_epi8('{');
+	const __m128i closeBrace = _mm_set1_epi8('}');
+	while (end - begin >= 16)
+	{
+		const __m128i bytes = _mm_loadu_si128((const __m128i*)begin);
+		const __m128i folded = _mm_or_si128(bytes, caseBit);
+		const __m128i matches = _mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_or_si128(_mm_cmpeq_epi8(folded, openBrace), _mm_cmpeq_epi8(folded, closeBrace)));
+		const unsigned int mask = (unsigned int)_mm_movemask_epi8(matches);
+		if (mask != 0)
+		{
+			return begin + countTrailingZeros(mask);
+		}
+		begin += 16;
+	}
+#endif
+	for (; begin < end; ++begin)
+	{
+		const char c = *begin;
+		if ((c == '"') || ((c | 0x20) == '{') || ((c | 0x20) == '}'))
+		{
+			break;
+		}
+	}
+	return begin;
+}
+
+const char* findJsonStringEnd(const char* begin, const char* end)
+{
+#ifdef XZCOMPRESS_SSE2
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	while (end - begin >= 16)
+	{
+		const __m128i bytes = _mm_loadu_si128((const __m128i*)begin);
+		const unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(bytes, backslash)));
+		if (mask != 0)
+		{
+			return begin + countTrailingZeros(mask);
+		}
+		begin += 16;
+	}
+#endif
+	for (; begin < end; ++begin)
+	{
+		if ((*begin == '"') || (*begin == '\\'))
+		{
+			break;
+		}
+	}
+	return begin;
+}
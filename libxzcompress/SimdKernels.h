@@ -0,0 +1,19 @@
+#pragma once
+
+// SIMD kernels:
+// Hot loops with hand vectorised versions. The CPU is checked at run time, so one build runs
+// everywhere and only uses the instructions the machine actually has.
+
+#include <stddef.h>
+#include <stdint.h>
+
+bool cpuHasPclmul();
+
+// Same result as zlib's crc32(), using carry-less multiplication (PCLMULQDQ) when it's available.
+uint32_t fastCrc32(uint32_t crc, const unsigned char* data, size_t length);
+
+// Json structure, for skipping over meta data without parsing it. Each returns end if there's nothing to find.
+// The first '"', '[', ']', '{' or '}', the characters that matter outside a string.
+const char* findJsonStructure(const char* begin, const char* end);
+// The first '"' or '\\', the characters that matter inside one.
+const char* findJsonStringEnd(const char* begin, const char* end);
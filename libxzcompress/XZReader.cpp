@@ -0,0 +1,863 @@
+#include "XZReader.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> // INT_MAX
+#include <sys/types.h>
+#include <sys/stat.h> // fstat
+#include <map>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <io.h> // _read, _lseeki64
+#else
+#include <unistd.h> // pread
+#endif
+
+// External libraries:
+#include <zlib.h>
+
+#include "SimdKernels.h"
+#include "Sha256.h"
+
+// A /pd chunk is primed with (up to) the last 32KB of the chunk before it, all of deflate's window.
+const unsigned int PRIMED_DICTIONARY_SIZE = 32768;
+
+bool inflateChunk(const unsigned char* compressedData, unsigned int compressedDataSize, unsigned char* chunkData, unsigned int chunkSize, const unsigned char* dictionary, unsigned int dictionaryLength)
+{
+	z_stream myZStream = {};
+	myZStream.zalloc = Z_NULL;
+	myZStream.zfree = Z_NULL;
+	myZStream.opaque = Z_NULL;
+	myZStream.avail_in = compressedDataSize;
+	myZStream.next_in = (Bytef*)compressedData;
+	myZStream.avail_out = chunkSize;
+	myZStream.next_out = chunkData;
+
+	int inflateInitReturnVal = inflateInit(&myZStream);
+	if (inflateInitReturnVal != Z_OK)
+	{
+		printf("An error occurred calling inflateInit().\n");
+		return false;
+	}
+
+	int inflateReturnVal = inflate(&myZStream, Z_FINISH);
+	if ((inflateReturnVal == Z_NEED_DICT) && (dictionaryLength > 0))
+	{
+		if (inflateSetDictionary(&myZStream, dictionary, dictionaryLength) == Z_OK)
+		{
+			inflateReturnVal = inflate(&myZStream, Z_FINISH);
+		}
+	}
+	inflateEnd(&myZStream);
+	if ((inflateReturnVal != Z_STREAM_END) || (myZStream.total_out != chunkSize))
+	{
+		printf("An error occurred during inflate.\n");
+		return false;
+	}
+
+	return true;
+}
+
+// Loads the /td dictionary a meta data entry names, if it has one, and checks it's the one its chunks were
+// compressed with.
+static bool loadSharedDictionary(const Json::Value& entry, std::vector<unsigned char>& sharedDictionary)
+{
+	const Json::Value& dictionaryFile = entry["dictionary_file"];
+	if (!dictionaryFile.isString())
+	{
+		return true;
+	}
+
+	MappedFile mappedDictionary;
+	if (!mapFile(dictionaryFile.asCString(), false, 0, mappedDictionary))
+	{
+		return false;
+	}
+	sharedDictionary.assign(mappedDictionary.data, mappedDictionary.data + mappedDictionary.size);
+	unmapFile(mappedDictionary);
+
+	if (adler32(adler32(0L, Z_NULL, 0), sharedDictionary.data(), (unsigned int)sharedDictionary.size()) != entry["dictionary_adler32"].asUInt())
+	{
+		printf("%s is not the dictionary these chunks were compressed with.\n", dictionaryFile.asCString());
+		return false;
+	}
+
+	return true;
+}
+
+// Compressed sources:
+
+MappedFileSource::MappedFileSource()
+	: mappedFile(), mapped(false)
+{
+}
+
+MappedFileSource::~MappedFileSource()
+{
+	if (mapped)
+	{
+		unmapFile(mappedFile);
+	}
+}
+
+bool MappedFileSource::open(const char* compressedFilePath)
+{
+	if (mapped)
+	{
+		unmapFile(mappedFile);
+	}
+	mapped = mapFile(compressedFilePath, false, 0, mappedFile);
+	return mapped;
+}
+
+uint64_t MappedFileSource::getSize()
+{
+	return mapped ? mappedFile.size : 0;
+}
+
+bool MappedFileSource::read(uint64_t offset, unsigned char* buffer, size_t length)
+{
+	if ((offset > getSize()) || (length > getSize() - offset))
+	{
+		return false;
+	}
+
+	if (length > 0)
+	{
+		memcpy(buffer, mappedFile.data + offset, length);
+	}
+	return true;
+}
+
+const unsigned char* MappedFileSource::getData()
+{
+	return mapped ? mappedFile.data : nullptr;
+}
+
+FileDescriptorSource::FileDescriptorSource(int fileDescriptor)
+	: fileDescriptor(fileDescriptor)
+{
+}
+
+uint64_t FileDescriptorSource::getSize()
+{
+#ifdef _WIN32
+	struct _stat64 fileStatus;
+	if (_fstat64(fileDescriptor, &fileStatus) != 0)
+#else
+	struct stat fileStatus;
+	if (fstat(fileDescriptor, &fileStatus) != 0)
+#endif
+	{
+		return 0;
+	}
+
+	return (uint64_t)fileStatus.st_size;
+}
+
+bool FileDescriptorSource::read(uint64_t offset, unsigned char* buffer, size_t length)
+{
+#ifdef _WIN32
+	std::lock_guard<std::mutex> lock(readMutex);
+	if (_lseeki64(fileDescriptor, (__int64)offset, SEEK_SET) != (__int64)offset)
+	{
+		return false;
+	}
+#endif
+	while (length > 0)
+	{
+#ifdef _WIN32
+		const int bytesRead = _read(fileDescriptor, buffer, (length < INT_MAX) ? (unsigned int)length : INT_MAX);
+#else
+		const ssize_t bytesRead = pread(fileDescriptor, buffer, length, (off_t)offset);
+		if ((bytesRead < 0) && (errno == EINTR))
+		{
+			continue;
+		}
+#endif
+		if (bytesRead <= 0)
+		{
+			return false;
+		}
+		buffer += bytesRead;
+		offset += bytesRead;
+		length -= bytesRead;
+	}
+	return true;
+}
+
+MemorySource::MemorySource(const unsigned char* data, size_t size)
+	: data(data), size(size)
+{
+}
+
+uint64_t MemorySource::getSize()
+{
+	return size;
+}
+
+bool MemorySource::read(uint64_t offset, unsigned char* buffer, size_t length)
+{
+	if ((offset > size) || (length > size - offset))
+	{
+		return false;
+	}
+
+	if (length > 0)
+	{
+		memcpy(buffer, data + offset, length);
+	}
+	return true;
+}
+
+const unsigned char* MemorySource::getData()
+{
+	return data;
+}
+
+CallbackSource::CallbackSource(uint64_t size, const ReadCallback& readCallback)
+	: size(size), readCallback(readCallback)
+{
+}
+
+uint64_t CallbackSource::getSize()
+{
+	return size;
+}
+
+bool CallbackSource::read(uint64_t offset, unsigned char* buffer, size_t length)
+{
+	return (offset <= size) && (length <= size - offset) && readCallback(offset, buffer, length);
+}
+
+// The reader:
+
+XZReader::XZReader(ChunkCache& cache)
+	: cache(cache), size(0), prefetchThreadCount(0), maximumPrefetchDepth(0), prefetchDepthLimit(0), prefetchStopping(false), anyChunkRead(false), lastChunkRead(0), prefetchedUpTo(0), prefetchStatistics()
+{
+}
+
+XZReader::~XZReader()
+{
+	close();
+}
+
+bool XZReader::open(const Json::Value& rootJsonValue, const char* fileKey, const char* compressedFilePath)
+{
+	return openFirstFile(rootJsonValue, fileKey, compressedFilePath, nullptr);
+}
+
+bool XZReader::open(const Json::Value& rootJsonValue, const char* fileKey, CompressedSource& compressedSource, const char* sourceName)
+{
+	return openFirstFile(rootJsonValue, fileKey, sourceName, &compressedSource);
+}
+
+bool XZReader::openFirstFile(const Json::Value& rootJsonValue, const char* fileKey, const char* compressedFilePath, CompressedSource* compressedSource)
+{
+	close();
+	if (openFile(rootJsonValue, fileKey, compressedFilePath, compressedSource) < 0)
+	{
+		close();
+		return false;
+	}
+
+	size = 0;
+	for (const Chunk& chunk : files[0].chunks)
+	{
+		size += chunk.uncompressedSize;
+	}
+
+	if ((maximumPrefetchDepth > 0) && !files[0].chunks.empty())
+	{
+		// Don't read so far ahead that the chunks are evicted again before they're used:
+		const uint64_t averageChunkSize = (size / files[0].chunks.size()) + 1;
+		const uint64_t chunksInHalfTheCache = cache.getCapacity() / 2 / averageChunkSize;
+		prefetchDepthLimit = (unsigned int)std::min<uint64_t>(maximumPrefetchDepth, std::max<uint64_t>(chunksInHalfTheCache, 1));
+		anyChunkRead = false;
+		prefetchStopping = false;
+		prefetchStatistics = PrefetchStatistics();
+		prefetchStatistics.depth = 1;
+		for (unsigned int t = 0; t < prefetchThreadCount; ++t)
+		{
+			prefetchThreads.emplace_back(&XZReader::prefetchChunks, this);
+		}
+	}
+	return true;
+}
+
+void XZReader::close()
+{
+	stopPrefetching();
+	files.clear();
+	size = 0;
+}
+
+uint64_t XZReader::getSize() const
+{
+	return size;
+}
+
+// Adds a file (and, first, any files its chunks are duplicates of) to files, returning its index or -1.
+// Without a compressedSource, compressedFilePath is mapped; either way it's the name the cache knows the chunks by.
+int XZReader::openFile(const Json::Value& rootJsonValue, const std::string& fileKey, const std::string& compressedFilePath, CompressedSource* compressedSource)
+{
+	for (size_t f = 0; f < files.size(); ++f)
+	{
+		if (files[f].fileKey == fileKey)
+		{
+			return (int)f;
+		}
+	}
+
+	if (!rootJsonValue.isMember(fileKey))
+	{
+		printf("%s was not found in the meta data.\n", fileKey.c_str());
+		return -1;
+	}
+	const Json::Value& entry = rootJsonValue[fileKey][0];
+
+	File file;
+	file.fileKey = fileKey;
+	file.cacheFileId = cache.getFileId(compressedFilePath);
+	if (!compressedSource)
+	{
+		MappedFileSource* mappedFileSource = new MappedFileSource();
+		file.ownedSource.reset(mappedFileSource);
+		if (!mappedFileSource->open(compressedFilePath.c_str()))
+		{
+			return -1;
+		}
+		compressedSource = mappedFileSource;
+	}
+	file.compressedSource = compressedSource;
+	file.compressedSize = compressedSource->getSize();
+	const int fileIndex = (int)files.size();
+	files.push_back(std::move(file));
+
+	if (!loadSharedDictionary(entry, files[fileIndex].sharedDictionary))
+	{
+		return -1;
+	}
+
+	// Deduplicated chunks take up no space in the compressed file:
+	const Json::Value& chunksJsonValue = entry["chunks"];
+	std::vector<Chunk> chunks(chunksJsonValue.size());
+	std::vector<std::string> duplicateHashes;
+	uint64_t uncompressedOffset = 0;
+	uint64_t compressedOffset = 0;
+	for (Json::ArrayIndex i = 0; i < chunksJsonValue.size(); ++i)
+	{
+		const Json::Value& chunkJsonValue = chunksJsonValue[i];
+		Chunk& chunk = chunks[i];
+		chunk.uncompressedOffset = uncompressedOffset;
+		chunk.uncompressedSize = chunkJsonValue["chunk_size_uncompressed"].asUInt();
+		chunk.compressedOffset = compressedOffset;
+		chunk.compressedSize = chunkJsonValue["chunk_size_compressed"].asUInt();
+		chunk.dependsOnPreviousChunk = chunkJsonValue["depends_on_previous_chunk"].asBool() && (i > 0);
+		chunk.duplicateOfFile = -1;
+		chunk.duplicateOfChunk = 0;
+		chunk.hasCrc = chunkJsonValue.isMember("chunk_crc32");
+		chunk.crc = chunkJsonValue["chunk_crc32"].asUInt();
+		chunk.duplicateIndex = 0;
+
+		if (chunkJsonValue.isMember("duplicate_of_file"))
+		{
+			const std::string otherFileKey = chunkJsonValue["duplicate_of_file"].asString();
+			chunk.duplicateOfFile = openFile(rootJsonValue, otherFileKey, rootJsonValue[otherFileKey][0]["compressed_file"].asString());
+			chunk.duplicateOfChunk = chunkJsonValue["duplicate_of_chunk"].asUInt();
+			if (chunk.duplicateOfFile < 0)
+			{
+				return -1;
+			}
+		}
+		else if (chunkJsonValue.isMember("duplicate_of_chunk"))
+		{
+			chunk.duplicateOfFile = fileIndex;
+			chunk.duplicateOfChunk = chunkJsonValue["duplicate_of_chunk"].asUInt();
+			if (chunk.duplicateOfChunk >= i)
+			{
+				printf("Chunk %d of %s is a duplicate of a chunk after it.\n", i + 1, fileKey.c_str());
+				return -1;
+			}
+		}
+
+		if ((chunk.duplicateOfFile >= 0) && chunkJsonValue.isMember("chunk_sha256"))
+		{
+			chunk.duplicateIndex = (unsigned int)duplicateHashes.size() + 1;
+			duplicateHashes.push_back(chunkJsonValue["chunk_sha256"].asString());
+		}
+
+		uncompressedOffset += chunk.uncompressedSize;
+		compressedOffset += chunk.compressedSize;
+	}
+	files[fileIndex].chunks.swap(chunks);
+	files[fileIndex].duplicateHashes.swap(duplicateHashes);
+	files[fileIndex].duplicatesVerified.reset(new std::atomic<bool>[files[fileIndex].duplicateHashes.size()]);
+	for (size_t d = 0; d < files[fileIndex].duplicateHashes.size(); ++d)
+	{
+		files[fileIndex].duplicatesVerified[d] = false;
+	}
+
+	return fileIndex;
+}
+
+CachedChunk XZReader::getChunk(int fileIndex, unsigned int chunkIndex, ChunkLookup* lookup)
+{
+	const Chunk& chunk = files[fileIndex].chunks[chunkIndex];
+	if (chunk.duplicateOfFile >= 0)
+	{
+		// Duplicates share the cache entry of the copy that was stored, which is never a duplicate itself:
+		const std::vector<Chunk>& originalChunks = files[chunk.duplicateOfFile].chunks;
+		if ((chunk.duplicateOfChunk >= originalChunks.size()) || (originalChunks[chunk.duplicateOfChunk].duplicateOfFile >= 0))
+		{
+			printf("Chunk %u of %s is a duplicate of a chunk that isn't stored.\n", chunkIndex + 1, files[fileIndex].fileKey.c_str());
+			return CachedChunk();
+		}
+		CachedChunk originalChunk = getChunk(chunk.duplicateOfFile, chunk.duplicateOfChunk, lookup);
+
+		// The first time it's read, the copy is checked against the hash the duplicate was deduplicated with,
+		// as the copy's entry may have been compressed again since:
+		const File& file = files[fileIndex];
+		if (originalChunk && (chunk.duplicateIndex > 0) && !file.duplicatesVerified[chunk.duplicateIndex - 1])
+		{
+			if (sha256ToHex(originalChunk->data(), originalChunk->size()) != file.duplicateHashes[chunk.duplicateIndex - 1])
+			{
+				printf("Chunk %u of %s does not match the SHA-256 it was deduplicated with, the chunk it's a duplicate of has changed.\n", chunkIndex + 1, file.fileKey.c_str());
+				return CachedChunk();
+			}
+			file.duplicatesVerified[chunk.duplicateIndex - 1] = true;
+		}
+		return originalChunk;
+	}
+
+	return cache.get(files[fileIndex].cacheFileId, chunkIndex, [this, fileIndex, chunkIndex](std::vector<unsigned char>& chunkData)
+	{
+		return loadChunk(fileIndex, chunkIndex, chunkData);
+	}, lookup);
+}
+
+bool XZReader::loadChunk(int fileIndex, unsigned int chunkIndex, std::vector<unsigned char>& chunkData)
+{
+	const File& file = files[fileIndex];
+	if (!file.chunks[chunkIndex].dependsOnPreviousChunk)
+	{
+		return inflatePrimedChunk(fileIndex, chunkIndex, CachedChunk(), chunkData);
+	}
+
+	// A primed chunk needs the end of the chunk before it, which needs the one before that, and so on. Rather
+	// than loading each through the cache in turn, which for a long chain goes as deep as the chain is long,
+	// go back to the nearest chunk that's cached (or a duplicate, or the start of the chain) and inflate
+	// forwards from there, caching each chunk on the way:
+	unsigned int firstChunkIndex = chunkIndex;
+	CachedChunk previousChunk;
+	while (file.chunks[firstChunkIndex].dependsOnPreviousChunk)
+	{
+		const unsigned int previousChunkIndex = firstChunkIndex - 1;
+		if (file.chunks[previousChunkIndex].duplicateOfFile >= 0)
+		{
+			previousChunk = getChunk(fileIndex, previousChunkIndex);
+			if (!previousChunk)
+			{
+				return false;
+			}
+			break;
+		}
+		previousChunk = cache.find(file.cacheFileId, previousChunkIndex);
+		if (previousChunk)
+		{
+			break;
+		}
+		firstChunkIndex = previousChunkIndex;
+	}
+
+	for (unsigned int i = firstChunkIndex; i < chunkIndex; ++i)
+	{
+		std::shared_ptr<std::vector<unsigned char> > inflatedChunk(new std::vector<unsigned char>());
+		if (!inflatePrimedChunk(fileIndex, i, previousChunk, *inflatedChunk))
+		{
+			return false;
+		}
+		cache.add(file.cacheFileId, i, inflatedChunk);
+		previousChunk = inflatedChunk;
+	}
+	return inflatePrimedChunk(fileIndex, chunkIndex, previousChunk, chunkData);
+}
+
+// Primed with the end of previousChunk, or if there isn't one (the start of a chain) as any other chunk.
+bool XZReader::inflatePrimedChunk(int fileIndex, unsigned int chunkIndex, const CachedChunk& previousChunk, std::vector<unsigned char>& chunkData)
+{
+	if (!previousChunk)
+	{
+		return inflateStoredChunk(fileIndex, chunkIndex, files[fileIndex].sharedDictionary.data(), (unsigned int)files[fileIndex].sharedDictionary.size(), chunkData);
+	}
+
+	const unsigned int dictionaryLength = (previousChunk->size() < PRIMED_DICTIONARY_SIZE) ? (unsigned int)previousChunk->size() : PRIMED_DICTIONARY_SIZE;
+	return inflateStoredChunk(fileIndex, chunkIndex, previousChunk->data() + previousChunk->size() - dictionaryLength, dictionaryLength, chunkData);
+}
+
+bool XZReader::inflateStoredChunk(int fileIndex, unsigned int chunkIndex, const unsigned char* dictionary, unsigned int dictionaryLength, std::vector<unsigned char>& chunkData)
+{
+	const File& file = files[fileIndex];
+	const Chunk& chunk = file.chunks[chunkIndex];
+	if (chunk.compressedOffset + chunk.compressedSize > file.compressedSize)
+	{
+		printf("The compressed file is shorter than the meta data says.\n");
+		return false;
+	}
+
+	// Inflated where it is if the source is in memory, otherwise read out first:
+	const unsigned char* compressedData = file.compressedSource->getData();
+	std::vector<unsigned char> compressedChunk;
+	if (compressedData)
+	{
+		compressedData += chunk.compressedOffset;
+	}
+	else
+	{
+		compressedChunk.resize(chunk.compressedSize);
+		if (!file.compressedSource->read(chunk.compressedOffset, compressedChunk.data(), chunk.compressedSize))
+		{
+			printf("A read error occurred while reading chunk %u of %s.\n", chunkIndex + 1, file.fileKey.c_str());
+			return false;
+		}
+		compressedData = compressedChunk.data();
+	}
+
+	chunkData.resize(chunk.uncompressedSize);
+	if (!inflateChunk(compressedData, chunk.compressedSize, chunkData.data(), chunk.uncompressedSize, dictionary, dictionaryLength))
+	{
+		return false;
+	}
+
+	if (chunk.hasCrc && (fastCrc32(0, chunkData.data(), chunkData.size()) != chunk.crc))
+	{
+		printf("Chunk %u of %s does not match its CRC-32.\n", chunkIndex + 1, file.fileKey.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool XZReader::read(uint64_t offset, unsigned char* buffer, size_t length, size_t& bytesRead)
+{
+	bytesRead = 0;
+	if (files.empty())
+	{
+		return false;
+	}
+
+	// Start at the last chunk that starts at or before offset:
+	const std::vector<Chunk>& chunks = files[0].chunks;
+	std::vector<Chunk>::const_iterator next = std::upper_bound(chunks.begin(), chunks.end(), offset, [](uint64_t o, const Chunk& chunk) { return o < chunk.uncompressedOffset; });
+	unsigned int chunkIndex = (unsigned int)(next - chunks.begin());
+	chunkIndex -= (chunkIndex > 0) ? 1 : 0;
+
+	while ((bytesRead < length) && (offset < size))
+	{
+		const Chunk& chunk = chunks[chunkIndex];
+		bool stillQueued = false;
+		const bool prefetched = (maximumPrefetchDepth > 0) && queuePrefetches(chunkIndex, stillQueued);
+		ChunkLookup lookup = CHUNK_CACHED;
+		CachedChunk chunkData = getChunk(0, chunkIndex, &lookup);
+		if (prefetched)
+		{
+			adaptPrefetchDepth(lookup, stillQueued);
+		}
+		if (!chunkData)
+		{
+			printf("Unable to read chunk %u of %s.\n", chunkIndex + 1, files[0].fileKey.c_str());
+			return false;
+		}
+
+		const size_t offsetInChunk = (size_t)(offset - chunk.uncompressedOffset);
+		const size_t bytesToCopy = std::min(length - bytesRead, (size_t)chunk.uncompressedSize - offsetInChunk);
+		if (bytesToCopy > 0)
+		{
+			memcpy(buffer + bytesRead, chunkData->data() + offsetInChunk, bytesToCopy);
+		}
+		bytesRead += bytesToCopy;
+		offset += bytesToCopy;
+		++chunkIndex;
+	}
+
+	return true;
+}
+
+void XZReader::setPrefetch(unsigned int threads, unsigned int maximumDepth)
+{
+	prefetchThreadCount = threads;
+	maximumPrefetchDepth = (threads > 0) ? maximumDepth : 0;
+}
+
+PrefetchStatistics XZReader::getPrefetchStatistics() const
+{
+	std::lock_guard<std::mutex> lock(prefetchMutex);
+	return prefetchStatistics;
+}
+
+// Called as a read gets to each chunk. If it's the same chunk as last time or the next one, the chunks up
+// to the prefetch depth after it are queued. Returns whether the chunk was itself one that was queued, and
+// takes it off the queue if no prefetch thread has got to it yet (the read will inflate it itself).
+bool XZReader::queuePrefetches(unsigned int chunkIndex, bool& stillQueued)
+{
+	std::lock_guard<std::mutex> lock(prefetchMutex);
+	const bool sequential = anyChunkRead && ((chunkIndex == lastChunkRead) || (chunkIndex == lastChunkRead + 1));
+	const bool wasQueued = sequential && (chunkIndex != lastChunkRead) && (chunkIndex < prefetchedUpTo);
+	stillQueued = false;
+	if (wasQueued)
+	{
+		std::deque<unsigned int>::iterator queued = std::find(prefetchQueue.begin(), prefetchQueue.end(), chunkIndex);
+		stillQueued = (queued != prefetchQueue.end());
+		if (stillQueued)
+		{
+			prefetchQueue.erase(queued);
+		}
+	}
+	anyChunkRead = true;
+	lastChunkRead = chunkIndex;
+
+	if (!sequential)
+	{
+		prefetchQueue.clear();
+		prefetchStatistics.depth = 1;
+		prefetchedUpTo = chunkIndex + 1;
+		return false;
+	}
+
+	prefetchedUpTo = std::max(prefetchedUpTo, chunkIndex + 1);
+	const unsigned int end = (unsigned int)std::min<size_t>((size_t)chunkIndex + 1 + prefetchStatistics.depth, files[0].chunks.size());
+	for (; prefetchedUpTo < end; ++prefetchedUpTo)
+	{
+		prefetchQueue.push_back(prefetchedUpTo);
+		prefetchStatistics.chunksQueued++;
+	}
+	prefetchWanted.notify_all();
+	return wasQueued;
+}
+
+void XZReader::adaptPrefetchDepth(ChunkLookup lookup, bool stillQueued)
+{
+	std::lock_guard<std::mutex> lock(prefetchMutex);
+	if (lookup == CHUNK_CACHED)
+	{
+		prefetchStatistics.hits++;
+	}
+	else if (lookup == CHUNK_WAITED)
+	{
+		// The reader is keeping up with the inflating, get further ahead of it:
+		prefetchStatistics.waits++;
+		prefetchStatistics.depth = std::min(prefetchStatistics.depth * 2, prefetchDepthLimit);
+	}
+	else
+	{
+		// If it was inflated and then evicted before the reader got to it, it's reading too far ahead. If the
+		// prefetch threads just hadn't got to it, going further ahead wouldn't help either.
+		prefetchStatistics.misses++;
+		if (!stillQueued)
+		{
+			prefetchStatistics.depth = std::max(prefetchStatistics.depth / 2, 1u);
+		}
+	}
+}
+
+// The prefetch threads: take the next queued chunk and get it into the cache.
+void XZReader::prefetchChunks()
+{
+	std::unique_lock<std::mutex> lock(prefetchMutex);
+	while (true)
+	{
+		prefetchWanted.wait(lock, [this]() { return prefetchStopping || !prefetchQueue.empty(); });
+		if (prefetchStopping)
+		{
+			return;
+		}
+
+		const unsigned int chunkIndex = prefetchQueue.front();
+		prefetchQueue.pop_front();
+		lock.unlock();
+		getChunk(0, chunkIndex);
+		lock.lock();
+	}
+}
+
+void XZReader::stopPrefetching()
+{
+	{
+		std::lock_guard<std::mutex> lock(prefetchMutex);
+		prefetchStopping = true;
+		prefetchQueue.clear();
+	}
+	prefetchWanted.notify_all();
+	for (std::thread& thread : prefetchThreads)
+	{
+		thread.join();
+	}
+	prefetchThreads.clear();
+}
+
+// Decompression:
+
+// Where each chunk starts in the compressed file (deduplicated chunks take up no space).
+std::vector<uint64_t> getCompressedChunkOffsets(const Json::Value& chunks)
+{
+	std::vector<uint64_t> offsets(chunks.size());
+	uint64_t offset = 0;
+	for (Json::ArrayIndex i = 0; i < chunks.size(); ++i)
+	{
+		offsets[i] = offset;
+		offset += chunks[i]["chunk_size_compressed"].asUInt();
+	}
+	return offsets;
+}
+
+bool inflateMappedChunk(const MappedFile& compressedFile, uint64_t compressedDataOffset, unsigned int compressedDataSize, unsigned char* chunkData, unsigned int chunkSize, const unsigned char* dictionary, unsigned int dictionaryLength)
+{
+	if (compressedDataOffset + compressedDataSize > (uint64_t)compressedFile.size)
+	{
+		printf("The compressed file is shorter than the meta data says.\n");
+		return false;
+	}
+
+	return inflateChunk(compressedFile.data + (size_t)compressedDataOffset, compressedDataSize, chunkData, chunkSize, dictionary, dictionaryLength);
+}
+
+// Restores the input file recorded under fileKey in the meta data.
+// Both files are mapped; each chunk is inflated straight into its place in the output file.
+bool decompressFile(const Json::Value& rootJsonValue, const char* fileKey, const char* compressedFilePath, const char* outputFilePath, bool verbose)
+{
+	if (!rootJsonValue.isMember(fileKey))
+	{
+		printf("%s was not found in the meta data.\n", fileKey);
+		return false;
+	}
+
+	const Json::Value& chunks = rootJsonValue[fileKey][0]["chunks"];
+	const std::vector<uint64_t> compressedChunkOffsets = getCompressedChunkOffsets(chunks);
+
+	// A trained dictionary is loaded once and used for every chunk:
+	std::vector<unsigned char> sharedDictionary;
+	if (!loadSharedDictionary(rootJsonValue[fileKey][0], sharedDictionary))
+	{
+		return false;
+	}
+
+	// The meta data tells us how big the restored file is, so it can be created at its full size up front:
+	std::vector<size_t> uncompressedChunkOffsets(chunks.size());
+	size_t outputFileSize = 0;
+	for (Json::ArrayIndex i = 0; i < chunks.size(); ++i)
+	{
+		uncompressedChunkOffsets[i] = outputFileSize;
+		outputFileSize += chunks[i]["chunk_size_uncompressed"].asUInt();
+	}
+
+	MappedFile compressedFile;
+	if (!mapFile(compressedFilePath, false, 0, compressedFile))
+	{
+		return false;
+	}
+
+	MappedFile outputFile;
+	if (!mapFile(outputFilePath, true, outputFileSize, outputFile))
+	{
+		unmapFile(compressedFile);
+		return false;
+	}
+
+	// Chunks deduplicated against other files need those files' compressed data:
+	std::map<std::string, MappedFile> otherCompressedFiles;
+	std::map<std::string, std::vector<uint64_t> > otherCompressedChunkOffsets;
+
+	bool success = true;
+
+	for (Json::ArrayIndex i = 0; (i < chunks.size()) && success; ++i)
+	{
+		if (verbose)
+		{
+			printf("Chunk %d of %d\n", i + 1, chunks.size());
+		}
+
+		const Json::Value& chunk = chunks[i];
+		const unsigned int chunkSize = chunk["chunk_size_uncompressed"].asUInt();
+		unsigned char* chunkData = outputFile.data + uncompressedChunkOffsets[i];
+
+		if (chunk.isMember("duplicate_of_file"))
+		{
+			const std::string otherFileKey = chunk["duplicate_of_file"].asString();
+			const Json::Value& otherEntry = rootJsonValue[otherFileKey][0];
+			const unsigned int otherChunkIndex = chunk["duplicate_of_chunk"].asUInt();
+
+			if (otherCompressedFiles.find(otherFileKey) == otherCompressedFiles.end())
+			{
+				MappedFile otherCompressedFile;
+				success = mapFile(otherEntry["compressed_file"].asString().c_str(), false, 0, otherCompressedFile);
+				if (success)
+				{
+					otherCompressedFiles[otherFileKey] = otherCompressedFile;
+					otherCompressedChunkOffsets[otherFileKey] = getCompressedChunkOffsets(otherEntry["chunks"]);
+				}
+			}
+
+			if (success)
+			{
+				const std::vector<uint64_t>& otherOffsets = otherCompressedChunkOffsets[otherFileKey];
+				success = (otherChunkIndex < otherOffsets.size()) &&
+					inflateMappedChunk(otherCompressedFiles[otherFileKey], otherOffsets[otherChunkIndex], otherEntry["chunks"][otherChunkIndex]["chunk_size_compressed"].asUInt(), chunkData, chunkSize, nullptr, 0);
+			}
+		}
+		else if (chunk.isMember("duplicate_of_chunk"))
+		{
+			// We've restored the first copy already, it's earlier in the same mapping:
+			const unsigned int originalChunkIndex = chunk["duplicate_of_chunk"].asUInt();
+			success = (originalChunkIndex < i) && (chunks[originalChunkIndex]["chunk_size_uncompressed"].asUInt() == chunkSize);
+			if (success && (chunkSize > 0))
+			{
+				memcpy(chunkData, outputFile.data + uncompressedChunkOffsets[originalChunkIndex], chunkSize);
+			}
+		}
+		else
+		{
+			// A primed chunk needs the end of the chunk we restored before it, which sits just before this one:
+			const unsigned char* dictionary = sharedDictionary.data();
+			unsigned int dictionaryLength = (unsigned int)sharedDictionary.size();
+			if (chunk["depends_on_previous_chunk"].asBool() && (i > 0))
+			{
+				const unsigned int previousChunkSize = chunks[i - 1]["chunk_size_uncompressed"].asUInt();
+				dictionaryLength = (previousChunkSize < PRIMED_DICTIONARY_SIZE) ? previousChunkSize : PRIMED_DICTIONARY_SIZE;
+				dictionary = chunkData - dictionaryLength;
+			}
+
+			success = inflateMappedChunk(compressedFile, compressedChunkOffsets[i], chunk["chunk_size_compressed"].asUInt(), chunkData, chunkSize, dictionary, dictionaryLength);
+		}
+
+		// A duplicate is checked against the hash of the chunk it was deduplicated as, in case the copy it's
+		// restored from has been compressed again since:
+		if (success && chunk.isMember("duplicate_of_chunk") && chunk.isMember("chunk_sha256") && (sha256ToHex(chunkData, chunkSize) != chunk["chunk_sha256"].asString()))
+		{
+			printf("Chunk %d does not match the SHA-256 it was deduplicated with, the chunk it's a duplicate of has changed.\n", i + 1);
+			success = false;
+		}
+
+		// Chunks compressed with /verify carry the CRC-32 of their input, check what we restored against it:
+		if (success && chunk.isMember("chunk_crc32") && (fastCrc32(0, chunkData, chunkSize) != chunk["chunk_crc32"].asUInt()))
+		{
+			printf("Chunk %d does not match its CRC-32.\n", i + 1);
+			success = false;
+		}
+
+		if (!success)
+		{
+			printf("Unable to restore chunk %d.\n", i + 1);
+		}
+	}
+
+	for (std::map<std::string, MappedFile>::iterator it = otherCompressedFiles.begin(); it != otherCompressedFiles.end(); ++it)
+	{
+		unmapFile(it->second);
+	}
+	unmapFile(outputFile);
+	unmapFile(compressedFile);
+
+	return success;
+}
@@ -0,0 +1,218 @@
+#pragma once
+
+// Random access reader:
+// Reads any range of a file compressed by XZCompress, inflating only the chunks the range covers. Chunks
+// are found with the meta data and inflated straight out of a mapping of the compressed file, into a
+// ChunkCache that can be shared by any number of readers, so ranges that land in the same chunk only
+// inflate it once. Once open, a reader can be read from by several threads at once.
+//
+// Sequential read ahead:
+// With prefetching on, a reader that's read chunk after chunk queues the chunks after the one being read
+// for its own threads to inflate into the cache before they're asked for. How far ahead it goes adapts:
+// if the reader catches up with a chunk that's still being inflated it goes twice as far, if it finds one
+// that was inflated and already evicted it goes half as far. Any other jump starts over at one chunk ahead.
+// It never goes further than half the cache would hold.
+
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// External libraries:
+#include <json/json.h>
+
+#include "ChunkCache.h"
+#include "MappedFile.h"
+
+// Inflates one chunk, which must come out at exactly chunkSize bytes. A dictionary is only used if the
+// chunk asks for one.
+bool inflateChunk(const unsigned char* compressedData, unsigned int compressedDataSize, unsigned char* chunkData, unsigned int chunkSize, const unsigned char* dictionary, unsigned int dictionaryLength);
+
+// Restores the whole file recorded under fileKey in the meta data to outputFilePath. When verbose, reports
+// each chunk as it's restored.
+bool decompressFile(const Json::Value& rootJsonValue, const char* fileKey, const char* compressedFilePath, const char* outputFilePath, bool verbose);
+
+// Where a reader's compressed chunks come from. Unlike CompressorInput, every read says where it's from,
+// as chunks are loaded by several threads at once.
+class CompressedSource
+{
+public:
+	virtual ~CompressedSource() {}
+
+	virtual uint64_t getSize() = 0;
+
+	// Reads exactly length bytes at offset. May be called from several threads at once.
+	virtual bool read(uint64_t offset, unsigned char* buffer, size_t length) = 0;
+
+	// The whole source, if it's in memory, so chunks can be inflated where they are rather than copied out first.
+	virtual const unsigned char* getData() { return nullptr; }
+};
+
+// A compressed file mapped into memory, as open() with a path uses.
+class MappedFileSource : public CompressedSource
+{
+public:
+	MappedFileSource();
+	~MappedFileSource();
+
+	bool open(const char* compressedFilePath);
+
+	uint64_t getSize();
+	bool read(uint64_t offset, unsigned char* buffer, size_t length);
+	const unsigned char* getData();
+
+private:
+	MappedFile mappedFile;
+	bool mapped;
+
+	MappedFileSource(const MappedFileSource&) = delete;
+	MappedFileSource& operator=(const MappedFileSource&) = delete;
+};
+
+// Reads an open file descriptor at each chunk's offset, without moving it (except on Windows, which has
+// no pread, where reads take turns).
+class FileDescriptorSource : public CompressedSource
+{
+public:
+	FileDescriptorSource(int fileDescriptor);
+
+	uint64_t getSize();
+	bool read(uint64_t offset, unsigned char* buffer, size_t length);
+
+private:
+	int fileDescriptor;
+#ifdef _WIN32
+	std::mutex readMutex;
+#endif
+};
+
+// Reads from memory the caller keeps hold of until the reader is closed.
+class MemorySource : public CompressedSource
+{
+public:
+	MemorySource(const unsigned char* data, size_t size);
+
+	uint64_t getSize();
+	bool read(uint64_t offset, unsigned char* buffer, size_t length);
+	const unsigned char* getData();
+
+private:
+	const unsigned char* data;
+	size_t size;
+};
+
+// Reads length bytes at offset through a callback, which has to cope with being called from several threads at once.
+class CallbackSource : public CompressedSource
+{
+public:
+	typedef std::function<bool(uint64_t offset, unsigned char* buffer, size_t length)> ReadCallback;
+
+	CallbackSource(uint64_t size, const ReadCallback& readCallback);
+
+	uint64_t getSize();
+	bool read(uint64_t offset, unsigned char* buffer, size_t length);
+
+private:
+	uint64_t size;
+	ReadCallback readCallback;
+};
+
+struct PrefetchStatistics
+{
+	uint64_t chunksQueued;
+	uint64_t hits; // Prefetched chunks that were ready when read.
+	uint64_t waits; // ...that were still being inflated.
+	uint64_t misses; // ...that weren't there at all, evicted or not started yet.
+	unsigned int depth; // How many chunks ahead it's prefetching now.
+};
+
+class XZReader
+{
+public:
+	XZReader(ChunkCache& cache);
+	~XZReader();
+
+	// Turns on sequential read ahead, up to maximumDepth chunks ahead on threads threads, from the next open().
+	void setPrefetch(unsigned int threads, unsigned int maximumDepth);
+	PrefetchStatistics getPrefetchStatistics() const;
+
+	// Opens the file recorded under fileKey in the meta data, whose chunks are in compressedFilePath. Chunks
+	// deduplicated against other files are read from those files' "compressed_file".
+	bool open(const Json::Value& rootJsonValue, const char* fileKey, const char* compressedFilePath);
+
+	// As above, but the file's chunks are read from compressedSource, which the caller keeps hold of until
+	// close(). sourceName keys its chunks in the cache in place of a path, so readers of the same source
+	// share them. Chunks deduplicated against other files are still read from their "compressed_file".
+	bool open(const Json::Value& rootJsonValue, const char* fileKey, CompressedSource& compressedSource, const char* sourceName);
+	void close();
+
+	uint64_t getSize() const;
+
+	// Copies up to length bytes from offset into buffer, fewer at the end of the file.
+	bool read(uint64_t offset, unsigned char* buffer, size_t length, size_t& bytesRead);
+
+private:
+	struct Chunk
+	{
+		uint64_t uncompressedOffset;
+		unsigned int uncompressedSize;
+		uint64_t compressedOffset;
+		unsigned int compressedSize;
+		bool dependsOnPreviousChunk;
+		int duplicateOfFile; // An index into files, -1 if the chunk isn't a duplicate.
+		unsigned int duplicateOfChunk;
+		bool hasCrc;
+		uint32_t crc;
+		unsigned int duplicateIndex; // 1 + its index into File::duplicateHashes, 0 if it has no hash to check.
+	};
+
+	struct File
+	{
+		std::string fileKey;
+		uint32_t cacheFileId;
+		CompressedSource* compressedSource;
+		std::unique_ptr<CompressedSource> ownedSource; // When the reader opened the compressed file itself.
+		uint64_t compressedSize;
+		std::vector<unsigned char> sharedDictionary;
+		std::vector<Chunk> chunks;
+		std::vector<std::string> duplicateHashes; // The SHA-256 each duplicate was deduplicated with.
+		std::unique_ptr<std::atomic<bool>[]> duplicatesVerified; // Checked against the copy it's read from yet?
+	};
+
+	bool openFirstFile(const Json::Value& rootJsonValue, const char* fileKey, const char* compressedFilePath, CompressedSource* compressedSource);
+	int openFile(const Json::Value& rootJsonValue, const std::string& fileKey, const std::string& compressedFilePath, CompressedSource* compressedSource = nullptr);
+	CachedChunk getChunk(int fileIndex, unsigned int chunkIndex, ChunkLookup* lookup = nullptr);
+	bool loadChunk(int fileIndex, unsigned int chunkIndex, std::vector<unsigned char>& chunkData);
+	bool inflatePrimedChunk(int fileIndex, unsigned int chunkIndex, const CachedChunk& previousChunk, std::vector<unsigned char>& chunkData);
+	bool inflateStoredChunk(int fileIndex, unsigned int chunkIndex, const unsigned char* dictionary, unsigned int dictionaryLength, std::vector<unsigned char>& chunkData);
+	bool queuePrefetches(unsigned int chunkIndex, bool& stillQueued);
+	void adaptPrefetchDepth(ChunkLookup lookup, bool stillQueued);
+	void prefetchChunks();
+	void stopPrefetching();
+
+	ChunkCache& cache;
+	std::vector<File> files; // The file being read first, then any its duplicates point into.
+	uint64_t size;
+
+	unsigned int prefetchThreadCount;
+	unsigned int maximumPrefetchDepth; // 0 when prefetching is off.
+	unsigned int prefetchDepthLimit; // maximumPrefetchDepth, or less if the cache can't hold that many chunks.
+	std::vector<std::thread> prefetchThreads;
+	mutable std::mutex prefetchMutex;
+	std::condition_variable prefetchWanted;
+	std::deque<unsigned int> prefetchQueue;
+	bool prefetchStopping;
+	bool anyChunkRead;
+	unsigned int lastChunkRead;
+	unsigned int prefetchedUpTo; // The first chunk after the ones queued.
+	PrefetchStatistics prefetchStatistics;
+
+	XZReader(const XZReader&) = delete;
+	XZReader& operator=(const XZReader&) = delete;
+};